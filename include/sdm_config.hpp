@@ -15,8 +15,24 @@ struct SDMConfig {
     uint32_t max_drivers;
     uint32_t max_vehicles;
     uint32_t max_trips;
+    uint32_t max_maintenance;
+    uint32_t max_expenses;
+    uint32_t max_documents;
+    uint32_t max_incidents;
     uint8_t btree_order;
     uint32_t cache_size;
+    bool use_mmap;
+    bool io_uring;
+    uint64_t buffer_pool_size;
+    uint32_t shards;
+    bool wal_enabled;
+    uint32_t wal_group_commit_ms;
+    uint32_t wal_group_commit_bytes;
+    uint32_t compaction_interval;
+    double compaction_threshold;
+    uint32_t cold_after_days;
+    uint32_t backup_interval;
+    uint32_t full_backup_every;
     
 
     uint16_t port;
@@ -39,10 +55,17 @@ struct SDMConfig {
     string database_path;
     string index_path;
     string log_path;
+    string backup_path;
     
     SDMConfig() : total_size(524288000), block_size(4096), max_drivers(10000),
-                 max_vehicles(50000), max_trips(10000000), btree_order(5),
-                 cache_size(256), port(8080), max_connections(1000),
+                 max_vehicles(50000), max_trips(10000000), max_maintenance(100000),
+                 max_expenses(500000), max_documents(100000),
+                 max_incidents(50000), btree_order(5),
+                 cache_size(256), use_mmap(true), io_uring(true),
+                 buffer_pool_size(16777216), shards(1), wal_enabled(true),
+                 wal_group_commit_ms(0), wal_group_commit_bytes(65536),
+                 compaction_interval(600), compaction_threshold(0.25),
+                 cold_after_days(365), backup_interval(0), full_backup_every(7), port(8080), max_connections(1000),
                  queue_capacity(10000), worker_threads(16),
                  require_authentication(true), password_hash_algo("SHA256"),
                  session_timeout(1800), admin_username("admin"),
@@ -50,7 +73,8 @@ struct SDMConfig {
                  alert_check_interval(3600),
                  database_path("compiled/SDM.db"),
                  index_path("compiled/indexes"),
-                 log_path("compiled/SDM.log") {}
+                 log_path("compiled/SDM.log"),
+                 backup_path("compiled/backups") {}
     
     bool load_from_file(const string& filename) {
         ifstream file(filename);
@@ -104,8 +128,24 @@ private:
             else if (key == "max_drivers") max_drivers = stoul(value);
             else if (key == "max_vehicles") max_vehicles = stoul(value);
             else if (key == "max_trips") max_trips = stoul(value);
+            else if (key == "max_maintenance") max_maintenance = stoul(value);
+            else if (key == "max_expenses") max_expenses = stoul(value);
+            else if (key == "max_documents") max_documents = stoul(value);
+            else if (key == "max_incidents") max_incidents = stoul(value);
             else if (key == "btree_order") btree_order = stoi(value);
             else if (key == "cache_size") cache_size = stoul(value);
+            else if (key == "use_mmap") use_mmap = (value == "true");
+            else if (key == "io_uring") io_uring = (value == "true");
+            else if (key == "buffer_pool_size") buffer_pool_size = stoull(value);
+            else if (key == "shards") shards = stoul(value);
+            else if (key == "wal_enabled") wal_enabled = (value == "true");
+            else if (key == "wal_group_commit_ms") wal_group_commit_ms = stoul(value);
+            else if (key == "wal_group_commit_bytes") wal_group_commit_bytes = stoul(value);
+            else if (key == "compaction_interval") compaction_interval = stoul(value);
+            else if (key == "compaction_threshold") compaction_threshold = stod(value);
+            else if (key == "cold_after_days") cold_after_days = stoul(value);
+            else if (key == "backup_interval") backup_interval = stoul(value);
+            else if (key == "full_backup_every") full_backup_every = stoul(value);
         }
         else if (section == "server") {
             if (key == "port") port = stoi(value);
@@ -128,6 +168,7 @@ private:
             if (key == "database_path") database_path = value;
             else if (key == "index_path") index_path = value;
             else if (key == "log_path") log_path = value;
+            else if (key == "backup_path") backup_path = value;
         }
     }
 };
@@ -87,7 +87,38 @@ struct SDMHeader
     uint32_t max_vehicles;
     uint32_t max_trips;
 
-    uint8_t reserved[3912];
+    uint64_t free_map_offset;
+    uint32_t table_high_water[7];
+    uint32_t table_record_count[7];
+
+    uint32_t max_maintenance;
+    uint32_t max_expenses;
+    uint32_t max_documents;
+    uint32_t max_incidents;
+
+    uint64_t table_last_id[7];
+
+    uint64_t checkpoint_count;
+
+    uint64_t cold_index_offset;
+
+    uint64_t change_map_offset;
+    uint64_t change_sequence;
+
+    // Files of a sharded database and this file's place among them; zero in
+    // files from before sharding
+    uint32_t shard_count;
+    uint32_t shard_index;
+
+    // Set when log replay changed the tables, until the secondary index,
+    // which is not logged, has been rebuilt from them
+    uint32_t secondary_index_stale;
+
+    // Set in files written by a migration or restore, until the primary and
+    // lookup indexes kept for the whole database have been rebuilt
+    uint32_t lookup_indexes_stale;
+
+    uint8_t reserved[3728];
 
     SDMHeader() : version(0x00010000), total_size(0), created_time(0),
                   last_modified(0), driver_table_offset(0), vehicle_table_offset(0),
@@ -95,10 +126,18 @@ struct SDMHeader
                   expense_table_offset(0), document_table_offset(0),
                   incident_table_offset(0), primary_index_offset(0),
                   secondary_index_offset(0), max_drivers(10000),
-                  max_vehicles(50000), max_trips(10000000)
+                  max_vehicles(50000), max_trips(10000000), free_map_offset(0),
+                  max_maintenance(100000), max_expenses(500000),
+                  max_documents(100000), max_incidents(50000), checkpoint_count(0),
+                  cold_index_offset(0), change_map_offset(0), change_sequence(0),
+                  shard_count(0), shard_index(0), secondary_index_stale(0),
+                  lookup_indexes_stale(0)
     {
         strncpy(magic, "SDMDB001", 8);
         memset(creator_info, 0, sizeof(creator_info));
+        memset(table_high_water, 0, sizeof(table_high_water));
+        memset(table_record_count, 0, sizeof(table_record_count));
+        memset(table_last_id, 0, sizeof(table_last_id));
         memset(reserved, 0, sizeof(reserved));
     }
 };
@@ -530,20 +569,34 @@ struct DatabaseStats
     uint64_t used_space;
     double fragmentation;
     uint32_t active_sessions;
+    uint32_t sealed_blocks;
     
 
-    uint8_t reserved[28];
+    uint8_t reserved[24];
 
     DatabaseStats() : total_drivers(0), active_drivers(0), total_vehicles(0),
                       total_trips(0), total_distance(0), total_expenses(0),
                       total_maintenance_records(0), total_documents(0),
                       total_incidents(0), database_size(0), used_space(0),
-                      fragmentation(0), active_sessions(0)
+                      fragmentation(0), active_sessions(0), sealed_blocks(0)
     {
         memset(reserved, 0, sizeof(reserved));
     }
 };
 
+struct TripTotals
+{
+    uint64_t trip_count;
+    double total_distance;
+    double total_duration;
+    double total_fuel;
+    double max_speed;
+    uint64_t harsh_events;
+
+    TripTotals() : trip_count(0), total_distance(0), total_duration(0),
+                   total_fuel(0), max_speed(0), harsh_events(0) {}
+};
+
 enum class DetectionType : uint8_t
 {
     VEHICLE = 0,
@@ -18,6 +18,7 @@ class MenuSystem
 private:
     SDMConfig config_;
 
+    BufferPool *buffer_pool_;
     DatabaseManager *db_manager_;
     CacheManager *cache_manager_;
     IndexManager *index_manager_;
@@ -50,7 +51,7 @@ public:
 
     MenuSystem(const SDMConfig &config)
         : config_(config), logged_in_(false),
-          db_manager_(nullptr), cache_manager_(nullptr),
+          buffer_pool_(nullptr), db_manager_(nullptr), cache_manager_(nullptr),
           index_manager_(nullptr), security_manager_(nullptr),
           session_manager_(nullptr), trip_manager_(nullptr),
           vehicle_manager_(nullptr), expense_manager_(nullptr),
@@ -90,7 +91,12 @@ public:
         cout << " ✓" << endl;
 
         cout << "[1/8] Database..." << flush;
-        db_manager_ = new DatabaseManager(config_.database_path);
+        buffer_pool_ = new BufferPool(config_.buffer_pool_size);
+        db_manager_ = new DatabaseManager(config_.database_path, config_.use_mmap);
+        db_manager_->configure_wal(config_.wal_enabled, config_.wal_group_commit_ms,
+                                   config_.wal_group_commit_bytes);
+        db_manager_->configure_io(config_.io_uring);
+        db_manager_->configure_buffer_pool(buffer_pool_);
         if (!db_manager_->open())
         {
             cout << " creating new..." << flush;
@@ -112,7 +118,7 @@ public:
         cout << " ✓" << endl;
 
         cout << "[3/8] Indexes..." << flush;
-        index_manager_ = new IndexManager(config_.index_path);
+        index_manager_ = new IndexManager(config_.index_path, buffer_pool_);
         if (!index_manager_->open_indexes())
         {
             cout << " creating new..." << flush;
@@ -122,6 +128,7 @@ public:
                 return false;
             }
         }
+        db_manager_->attach_indexes(index_manager_);
         cout << " ✓" << endl;
 
         cout << "[4/8] Security..." << flush;
@@ -1228,6 +1235,10 @@ public:
         cout << "  Total Trips: " << db_stats.total_trips << endl;
         cout << "  Total Distance: " << fixed << setprecision(2)
              << db_stats.total_distance << " km" << endl;
+        cout << "  Fragmentation: " << fixed << setprecision(1)
+             << (db_stats.fragmentation * 100) << "%" << endl;
+        cout << "  Sealed Blocks: " << db_stats.sealed_blocks << endl;
+        cout << "  Disk Usage: " << (db_stats.used_space / 1024 / 1024) << " MB" << endl;
         cout << endl;
 
         cout << "💾 CACHE STATISTICS" << endl;
@@ -1318,9 +1329,12 @@ public:
 
         delete session_manager_;
         delete security_manager_;
+        if (db_manager_)
+            db_manager_->attach_indexes(nullptr);
         delete index_manager_;
         delete cache_manager_;
         delete db_manager_;
+        delete buffer_pool_;
     }
 };
 
@@ -32,6 +32,8 @@ int main(int argc, char *argv[])
 
     string config_file = "../../include/sdm.conf";
     bool server_mode = true;
+    bool migrate = false;
+    vector<string> restore_files;
 
     for (int i = 1; i < argc; i++)
     {
@@ -45,6 +47,17 @@ int main(int argc, char *argv[])
         {
             server_mode = true;
         }
+        else if (arg == "--migrate")
+        {
+            migrate = true;
+        }
+        else if (arg == "--restore")
+        {
+            while (i + 1 < argc && string(argv[i + 1]).compare(0, 2, "--") != 0)
+            {
+                restore_files.push_back(argv[++i]);
+            }
+        }
         else if (arg == "--help")
         {
             cout << "Smart Drive Manager - Usage:" << endl;
@@ -53,6 +66,9 @@ int main(int argc, char *argv[])
             cout << "Options:" << endl;
             cout << "  --config FILE    Use specified configuration file" << endl;
             cout << "  --server         Run in server mode (daemon)" << endl;
+            cout << "  --migrate        Rewrite the database into the current file format and exit" << endl;
+            cout << "  --restore FILES  Rebuild the database from a full backup and the incremental" << endl;
+            cout << "                   backups taken after it, in order, and exit" << endl;
             cout << "  --help           Show this help message" << endl;
             cout << endl;
             return 0;
@@ -117,6 +133,16 @@ int main(int argc, char *argv[])
     cout << "Queue Capacity: " << config.queue_capacity << endl;
     cout << "========================\n" << endl;
 
+    if (migrate)
+    {
+        return DatabaseManager::migrate(config) ? 0 : 1;
+    }
+
+    if (!restore_files.empty())
+    {
+        return DatabaseManager::restore(config, restore_files) ? 0 : 1;
+    }
+
     if (server_mode)
     {
 
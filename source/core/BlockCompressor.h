@@ -0,0 +1,154 @@
+#ifndef BLOCKCOMPRESSOR_H
+#define BLOCKCOMPRESSOR_H
+
+#include <vector>
+#include <cstdint>
+#include <cstring>
+using namespace std;
+
+// LZ4-style block codec for sealed record ranges. A block is a series of
+// sequences, each a token (literal count in the high nibble, match length
+// minus MIN_MATCH in the low one, 15 meaning more length bytes follow), the
+// literals, then a 2-byte little-endian match offset. The last sequence
+// carries literals only. Record slots are mostly zero padding and repeated
+// field layouts, which this handles well at memcpy-like decode speed.
+class BlockCompressor
+{
+private:
+    static const uint32_t MIN_MATCH = 4;
+    static const uint32_t LAST_LITERALS = 5;
+    static const uint32_t MAX_OFFSET = 65535;
+    static const uint32_t HASH_BITS = 13;
+
+    static uint32_t read32(const uint8_t *p)
+    {
+        uint32_t v;
+        memcpy(&v, p, sizeof(v));
+        return v;
+    }
+
+    static uint32_t hash(uint32_t sequence)
+    {
+        return (sequence * 2654435761u) >> (32 - HASH_BITS);
+    }
+
+    static void put_length(vector<uint8_t> &out, size_t length)
+    {
+        while (length >= 255)
+        {
+            out.push_back(255);
+            length -= 255;
+        }
+        out.push_back(static_cast<uint8_t>(length));
+    }
+
+    static void emit(vector<uint8_t> &out, const uint8_t *literals, size_t literal_count,
+                     uint32_t offset, size_t match_length)
+    {
+        size_t match_code = match_length >= MIN_MATCH ? match_length - MIN_MATCH : 0;
+        uint8_t token = static_cast<uint8_t>((literal_count >= 15 ? 15 : literal_count) << 4);
+        if (offset > 0)
+            token |= static_cast<uint8_t>(match_code >= 15 ? 15 : match_code);
+        out.push_back(token);
+        if (literal_count >= 15)
+            put_length(out, literal_count - 15);
+        out.insert(out.end(), literals, literals + literal_count);
+
+        if (offset == 0)
+            return;
+        out.push_back(static_cast<uint8_t>(offset & 0xFF));
+        out.push_back(static_cast<uint8_t>(offset >> 8));
+        if (match_code >= 15)
+            put_length(out, match_code - 15);
+    }
+
+    static bool get_length(const uint8_t *&in, const uint8_t *end, size_t &length)
+    {
+        uint8_t b;
+        do
+        {
+            if (in >= end)
+                return false;
+            b = *in++;
+            length += b;
+        } while (b == 255);
+        return true;
+    }
+
+public:
+    static void compress(const uint8_t *src, size_t size, vector<uint8_t> &out)
+    {
+        out.clear();
+        out.reserve(size / 2 + 16);
+        vector<uint32_t> table(1u << HASH_BITS, 0);
+
+        size_t anchor = 0;
+        size_t i = 0;
+        while (size >= MIN_MATCH + LAST_LITERALS && i + MIN_MATCH + LAST_LITERALS <= size)
+        {
+            uint32_t sequence = read32(src + i);
+            uint32_t h = hash(sequence);
+            size_t candidate = table[h];
+            table[h] = static_cast<uint32_t>(i + 1);
+
+            if (candidate == 0 || i + 1 - candidate > MAX_OFFSET || read32(src + candidate - 1) != sequence)
+            {
+                i++;
+                continue;
+            }
+
+            candidate--;
+            size_t length = MIN_MATCH;
+            while (i + length + LAST_LITERALS < size && src[candidate + length] == src[i + length])
+                length++;
+
+            emit(out, src + anchor, i - anchor, static_cast<uint32_t>(i - candidate), length);
+            i += length;
+            anchor = i;
+        }
+        emit(out, src + anchor, size - anchor, 0, 0);
+    }
+
+    // Fails on malformed input or when the output is not exactly size bytes
+    static bool decompress(const uint8_t *src, size_t length, uint8_t *dst, size_t size)
+    {
+        const uint8_t *in = src;
+        const uint8_t *end = src + length;
+        size_t written = 0;
+        while (in < end)
+        {
+            uint8_t token = *in++;
+            size_t literal_count = token >> 4;
+            if (literal_count == 15 && !get_length(in, end, literal_count))
+                return false;
+            if (literal_count > static_cast<size_t>(end - in) || literal_count > size - written)
+                return false;
+            memcpy(dst + written, in, literal_count);
+            in += literal_count;
+            written += literal_count;
+            if (in == end)
+                break;
+
+            if (end - in < 2)
+                return false;
+            size_t offset = in[0] | (static_cast<size_t>(in[1]) << 8);
+            in += 2;
+            size_t match_length = token & 0x0F;
+            if (match_length == 15 && !get_length(in, end, match_length))
+                return false;
+            match_length += MIN_MATCH;
+            if (offset == 0 || offset > written || match_length > size - written)
+                return false;
+
+            // Byte by byte: a match may overlap the bytes it produces
+            uint8_t *out = dst + written;
+            const uint8_t *from = out - offset;
+            for (size_t k = 0; k < match_length; k++)
+                out[k] = from[k];
+            written += match_length;
+        }
+        return written == size;
+    }
+};
+
+#endif
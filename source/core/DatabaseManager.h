@@ -1,1109 +1,920 @@
 #ifndef DATABASEMANAGER_H
 #define DATABASEMANAGER_H
 
-#include "../../include/sdm_types.hpp"
-#include "../../include/sdm_config.hpp"
-#include <fstream>
+#include "DatabaseShard.h"
 #include <string>
 #include <vector>
-#include <stdexcept>
+#include <algorithm>
+#include <memory>
 #include <iostream>
-#include <mutex>
 #include <sys/stat.h>
-#include <cstdlib>
-#include <ctime>
-#include <cstring>
 
 using namespace std;
 
+// The database as the managers see it: one or more shard files, each a
+// DatabaseShard with its own locks, log, I/O and secondary index. A driver
+// and their vehicles, trips, maintenance, expenses and incidents live in the
+// shard chosen by a hash of the driver id, so per-driver work touches one
+// shard. Shard 0 is the configured database file and hands out record ids;
+// shard k is the same path with a .shard<k> suffix and keeps its secondary
+// index in <index_path>/shard<k>. The shard count is set when the database is
+// created and recorded in every shard's header; a database from before
+// sharding opens as a single shard.
 class DatabaseManager
 {
 private:
-    fstream file_;
-    string filename_;
-    SDMHeader header_;
-    bool is_open_;
-
-    uint64_t driver_table_start_;
-    uint64_t vehicle_table_start_;
-    uint64_t trip_table_start_;
-    uint64_t maintenance_table_start_;
-    uint64_t expense_table_start_;
-    uint64_t document_table_start_;
-    uint64_t incident_table_start_;
-    mutable std::mutex db_mutex_;
-
-    void calculate_offsets()
-    {
-        uint64_t current_offset = sizeof(SDMHeader);
+    typedef HashTable<uint64_t, uint32_t> SlotDirectory;
 
-        header_.driver_table_offset = current_offset;
-        driver_table_start_ = current_offset;
-        current_offset += header_.max_drivers * sizeof(DriverProfile);
-
-        header_.vehicle_table_offset = current_offset;
-        vehicle_table_start_ = current_offset;
-        current_offset += header_.max_vehicles * sizeof(VehicleInfo);
+    string filename_;
+    bool use_mmap_;
 
-        header_.trip_table_offset = current_offset;
-        trip_table_start_ = current_offset;
-        current_offset += header_.max_trips * sizeof(TripRecord);
+    bool wal_configured_;
+    bool wal_enabled_;
+    uint32_t wal_group_commit_ms_;
+    uint32_t wal_group_commit_bytes_;
+    bool io_uring_enabled_;
+    BufferPool *pool_;
+    // Shard 0's indexes, which also hold the email, username and plate
+    // indexes kept up to date on deletes here
+    IndexManager *indexes_;
 
-        header_.maintenance_table_offset = current_offset;
-        maintenance_table_start_ = current_offset;
-        current_offset += 100000 * sizeof(MaintenanceRecord);
+    // Declared before the shards so they are closed while these still exist
+    vector<unique_ptr<IndexManager>> shard_indexes_;
+    vector<unique_ptr<DatabaseShard>> shards_;
 
-        header_.expense_table_offset = current_offset;
-        expense_table_start_ = current_offset;
-        current_offset += 500000 * sizeof(ExpenseRecord);
+    static string shard_path(const string &path, uint32_t index)
+    {
+        return index == 0 ? path : path + ".shard" + to_string(index);
+    }
 
-        header_.document_table_offset = current_offset;
-        document_table_start_ = current_offset;
-        current_offset += 100000 * sizeof(DocumentMetadata);
+    // The settings of one shard for the static maintenance operations
+    static SDMConfig shard_config(const SDMConfig &config, uint32_t index)
+    {
+        SDMConfig shard = config;
+        shard.database_path = shard_path(config.database_path, index);
+        if (index > 0)
+            shard.index_path = config.index_path + "/shard" + to_string(index);
+        return shard;
+    }
 
-        header_.incident_table_offset = current_offset;
-        incident_table_start_ = current_offset;
-        current_offset += 50000 * sizeof(IncidentReport);
+    // Opens each shard file once to record its place in the database
+    static bool claim_shards(const string &path, bool use_mmap, uint32_t count)
+    {
+        for (uint32_t k = 0; k < count; k++)
+        {
+            DatabaseShard shard(shard_path(path, k), use_mmap);
+            if (!shard.open() || !shard.claim_shard(count, k))
+            {
+                cerr << "      ERROR: Cannot set up shard: " << shard_path(path, k) << endl;
+                return false;
+            }
+        }
+        return true;
+    }
 
-        header_.total_size = current_offset;
+    unique_ptr<DatabaseShard> make_shard(uint32_t index)
+    {
+        unique_ptr<DatabaseShard> shard = make_unique<DatabaseShard>(shard_path(filename_, index), use_mmap_);
+        if (wal_configured_)
+            shard->configure_wal(wal_enabled_, wal_group_commit_ms_, wal_group_commit_bytes_);
+        shard->configure_io(io_uring_enabled_);
+        shard->configure_buffer_pool(pool_);
+        return shard;
     }
 
-public:
-    DatabaseManager(const string &filename) : filename_(filename), is_open_(false) {}
+    // Spreads sequential driver ids over all shards
+    uint32_t shard_of(uint64_t driver_id) const
+    {
+        uint64_t h = driver_id;
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        return static_cast<uint32_t>(h % shards_.size());
+    }
 
-    bool isOpen()
+    // Records created outside shard 0 still advance its id sequence
+    void reserve_id(uint32_t shard, int table, uint64_t id)
     {
-        return is_open_;
+        if (shard != 0)
+            shards_[0]->reserve_id(table, id);
     }
 
-    ~DatabaseManager()
+    template <typename T>
+    bool create_in(uint32_t shard, int table, const T &record, bool (DatabaseShard::*create)(const T &))
     {
-        close();
+        if (!(shards_[shard].get()->*create)(record))
+            return false;
+        reserve_id(shard, table, DatabaseShard::record_id(record));
+        return true;
     }
-    bool create(const SDMConfig &config)
+
+    template <typename T>
+    bool read_any(uint64_t id, T &record, bool (DatabaseShard::*read)(uint64_t, T &))
     {
-        if (file_.is_open())
+        for (unique_ptr<DatabaseShard> &shard : shards_)
         {
-            file_.close();
+            if ((shard.get()->*read)(id, record))
+                return true;
         }
+        return false;
+    }
 
-        cout << "      Creating database: " << filename_ << endl;
-
-        size_t last_slash = filename_.find_last_of('/');
-        if (last_slash != string::npos)
-        {
-            string directory = filename_.substr(0, last_slash);
-            struct stat st;
-            if (stat(directory.c_str(), &st) != 0)
-            {
-                cout << "      Creating directory: " << directory << endl;
-                string cmd = "mkdir -p \"" + directory + "\"";
-                if (system(cmd.c_str()) != 0)
-                {
-                    cerr << "      ERROR: Failed to create directory!" << endl;
-                }
-            }
-        }
+    // Updates the record where it is, or moves it when its driver now maps
+    // to another shard: created there first, then removed from the old one
+    template <typename T>
+    bool update_routed(uint32_t target, int table, SlotDirectory DatabaseShard::*directory, const T &record,
+                       bool (DatabaseShard::*read)(uint64_t, T &), bool (DatabaseShard::*update)(const T &),
+                       bool (DatabaseShard::*create)(const T &))
+    {
+        uint64_t id = DatabaseShard::record_id(record);
+        T existing;
+        if ((shards_[target].get()->*read)(id, existing))
+            return (shards_[target].get()->*update)(record);
 
-        file_.open(filename_, ios::out | ios::binary | ios::trunc);
-        if (!file_.is_open())
+        for (uint32_t s = 0; s < shards_.size(); s++)
         {
-            cerr << "      ERROR: Cannot create file: " << filename_ << endl;
-            return false;
+            if (s == target || !(shards_[s].get()->*read)(id, existing))
+                continue;
+            DatabaseShard &source = *shards_[s];
+            return create_in(target, table, record, create) &&
+                   source.remove_record<T>(table, &(source.*directory), id);
         }
+        return false;
+    }
 
-        header_ = SDMHeader();
-        header_.created_time = get_current_timestamp();
-        header_.last_modified = header_.created_time;
-        header_.max_drivers = config.max_drivers;
-        header_.max_vehicles = config.max_vehicles;
-        header_.max_trips = config.max_trips;
-
-        calculate_offsets();
-
-        file_.write(reinterpret_cast<const char *>(&header_), sizeof(SDMHeader));
+    // Each shard's part of the batch is all or nothing; the batch as a whole
+    // is not
+    template <typename T>
+    bool create_routed_batch(int table, const vector<T> &records, bool (DatabaseShard::*create)(const vector<T> &))
+    {
+        if (shards_.size() == 1)
+            return (shards_[0].get()->*create)(records);
 
-        cout << "      Initializing " << header_.max_drivers << " driver slots..." << flush;
-        DriverProfile empty_driver;
-        memset(&empty_driver, 0, sizeof(DriverProfile));
-        empty_driver.is_active = 0;
-        for (uint32_t i = 0; i < header_.max_drivers; i++)
+        vector<vector<T>> parts(shards_.size());
+        for (const T &record : records)
         {
-            file_.write(reinterpret_cast<const char *>(&empty_driver), sizeof(DriverProfile));
+            parts[shard_of(record.driver_id)].push_back(record);
         }
-        cout << " ✓" << endl;
 
-        cout << "      Initializing " << header_.max_vehicles << " vehicle slots..." << flush;
-        VehicleInfo empty_vehicle;
-        memset(&empty_vehicle, 0, sizeof(VehicleInfo));
-        empty_vehicle.is_active = 0;
-        for (uint32_t i = 0; i < header_.max_vehicles; i++)
+        bool ok = true;
+        for (uint32_t s = 0; s < parts.size(); s++)
         {
-            file_.write(reinterpret_cast<const char *>(&empty_vehicle), sizeof(VehicleInfo));
+            if (parts[s].empty())
+                continue;
+            if (!(shards_[s].get()->*create)(parts[s]))
+            {
+                ok = false;
+                continue;
+            }
+            uint64_t last = 0;
+            for (const T &record : parts[s])
+                last = max(last, DatabaseShard::record_id(record));
+            reserve_id(s, table, last);
         }
-        cout << " ✓" << endl;
+        return ok;
+    }
 
-        cout << "      Initializing " << header_.max_trips << " trip slots..." << flush;
-        TripRecord empty_trip;
-        memset(&empty_trip, 0, sizeof(TripRecord));
-        for (uint32_t i = 0; i < header_.max_trips; i++)
-        {
-            file_.write(reinterpret_cast<const char *>(&empty_trip), sizeof(TripRecord));
-        }
-        cout << " ✓" << endl;
+    // Results of a query asked of every shard, in record id order like the
+    // indexed lookups of a single shard
+    template <typename T>
+    vector<T> gather(uint64_t key, vector<T> (DatabaseShard::*query)(uint64_t))
+    {
+        if (shards_.size() == 1)
+            return (shards_[0].get()->*query)(key);
 
-        cout << "      Initializing maintenance records..." << flush;
-        MaintenanceRecord empty_maintenance;
-        memset(&empty_maintenance, 0, sizeof(MaintenanceRecord));
-        for (uint32_t i = 0; i < 100000; i++)
+        vector<T> records;
+        for (unique_ptr<DatabaseShard> &shard : shards_)
         {
-            file_.write(reinterpret_cast<const char *>(&empty_maintenance), sizeof(MaintenanceRecord));
+            vector<T> part = (shard.get()->*query)(key);
+            records.insert(records.end(), part.begin(), part.end());
         }
-        cout << " ✓" << endl;
+        sort(records.begin(), records.end(), [](const T &a, const T &b)
+             { return DatabaseShard::record_id(a) < DatabaseShard::record_id(b); });
+        return records;
+    }
 
-        cout << "      Initializing expense records..." << flush;
-        ExpenseRecord empty_expense;
-        memset(&empty_expense, 0, sizeof(ExpenseRecord));
-        for (uint32_t i = 0; i < 500000; i++)
+    template <typename Visit>
+    uint64_t sum(Visit visit)
+    {
+        uint64_t total = 0;
+        for (unique_ptr<DatabaseShard> &shard : shards_)
         {
-            file_.write(reinterpret_cast<const char *>(&empty_expense), sizeof(ExpenseRecord));
+            total += visit(*shard);
         }
-        cout << " ✓" << endl;
+        return total;
+    }
 
-        cout << "      Initializing document metadata..." << flush;
-        DocumentMetadata empty_doc;
-        memset(&empty_doc, 0, sizeof(DocumentMetadata));
-        for (uint32_t i = 0; i < 100000; i++)
+    // entries are (entity_id, timestamp) of records already deleted
+    void remove_primary(uint8_t entity_type, const vector<pair<uint64_t, uint64_t>> &entries)
+    {
+        if (!indexes_)
+            return;
+        for (const auto &entry : entries)
         {
-            file_.write(reinterpret_cast<const char *>(&empty_doc), sizeof(DocumentMetadata));
+            indexes_->remove_primary(entity_type, entry.first, entry.second);
         }
-        cout << " ✓" << endl;
+    }
 
-        cout << "      Initializing incident reports..." << flush;
-        IncidentReport empty_incident;
-        memset(&empty_incident, 0, sizeof(IncidentReport));
-        for (uint32_t i = 0; i < 50000; i++)
+    static void merge_totals(HashTable<uint64_t, TripTotals> &totals, const HashTable<uint64_t, TripTotals> &part)
+    {
+        for (uint64_t driver_id : part.keys())
         {
-            file_.write(reinterpret_cast<const char *>(&empty_incident), sizeof(IncidentReport));
+            TripTotals driver_totals;
+            part.get(driver_id, driver_totals);
+            totals.insert(driver_id, driver_totals);
         }
-        cout << " ✓" << endl;
+    }
+
+public:
+    DatabaseManager(const string &filename, bool use_mmap = true)
+        : filename_(filename), use_mmap_(use_mmap), wal_configured_(false), wal_enabled_(true),
+          wal_group_commit_ms_(0), wal_group_commit_bytes_(0), io_uring_enabled_(true), pool_(nullptr), indexes_(nullptr)
+    {
+        shards_.push_back(make_shard(0));
+    }
 
-        file_.flush();
-        file_.close();
+    ~DatabaseManager()
+    {
+        close();
+    }
 
-        cout << "      Database created (" << (header_.total_size / 1024 / 1024) << " MB)" << endl;
+    DatabaseManager(const DatabaseManager &) = delete;
+    DatabaseManager &operator=(const DatabaseManager &) = delete;
 
-        return true;
+    bool isOpen()
+    {
+        return shards_[0]->isOpen();
     }
-    bool open()
+
+    bool create(const SDMConfig &config)
     {
-        file_.open(filename_, ios::in | ios::out | ios::binary);
-        if (!file_.is_open())
+        close();
+        // Every shard gets the full configured capacities: the files are
+        // sparse, and drivers that hash unevenly or a single heavy driver
+        // must not fill one shard while the others sit empty
+        uint32_t count = max<uint32_t>(config.shards, 1);
+        for (uint32_t k = 0; k < count; k++)
         {
-            return false;
+            DatabaseShard shard(shard_path(filename_, k), use_mmap_);
+            if (!shard.create(config))
+                return false;
         }
+        return claim_shards(filename_, use_mmap_, count);
+    }
 
-        file_.read(reinterpret_cast<char *>(&header_), sizeof(SDMHeader));
+    bool open()
+    {
+        close();
+        shards_.resize(1);
+        if (!shards_[0]->open())
+            return false;
 
-        if (string(header_.magic, 8) != "SDMDB001")
+        uint32_t count = max<uint32_t>(shards_[0]->header_.shard_count, 1);
+        bool ok = shards_[0]->claim_shard(count, 0);
+        for (uint32_t k = 1; ok && k < count; k++)
+        {
+            shards_.push_back(make_shard(k));
+            ok = shards_.back()->open() && shards_.back()->claim_shard(count, k);
+            if (!ok)
+                cerr << "      ERROR: Cannot open shard: " << shard_path(filename_, k) << endl;
+        }
+        if (!ok)
         {
-            file_.close();
+            close();
+            shards_.resize(1);
             return false;
         }
 
-        driver_table_start_ = header_.driver_table_offset;
-        vehicle_table_start_ = header_.vehicle_table_offset;
-        trip_table_start_ = header_.trip_table_offset;
-        maintenance_table_start_ = header_.maintenance_table_offset;
-        expense_table_start_ = header_.expense_table_offset;
-        document_table_start_ = header_.document_table_offset;
-        incident_table_start_ = header_.incident_table_offset;
-
-        is_open_ = true;
+        // Shard 0's sequences are advanced outside the log, so after a crash
+        // they can trail ids that the other shards recovered from theirs
+        for (uint32_t k = 1; k < count; k++)
+        {
+            for (int t = 0; t < DatabaseShard::TABLE_COUNT; t++)
+                shards_[0]->reserve_id(t, shards_[k]->header_.table_last_id[t]);
+        }
         return true;
     }
 
     void close()
     {
-        if (is_open_ && file_.is_open())
+        for (unique_ptr<DatabaseShard> &shard : shards_)
         {
-            header_.last_modified = get_current_timestamp();
-            file_.seekp(0, ios::beg);
-            file_.write(reinterpret_cast<const char *>(&header_), sizeof(SDMHeader));
-            file_.flush();
-            file_.close();
-            is_open_ = false;
+            shard->close();
         }
     }
 
-    bool create_driver(const DriverProfile &driver)
+    bool sync()
     {
-        lock_guard<mutex> lock(db_mutex_);
-        if (!is_open_)
-            return false;
-
-        for (uint32_t i = 0; i < header_.max_drivers; i++)
+        bool ok = true;
+        for (unique_ptr<DatabaseShard> &shard : shards_)
         {
-            DriverProfile existing;
-            uint64_t offset = driver_table_start_ + (i * sizeof(DriverProfile));
+            ok = shard->sync() && ok;
+        }
+        return ok;
+    }
 
-            file_.seekg(offset, ios::beg);
-            file_.read(reinterpret_cast<char *>(&existing), sizeof(DriverProfile));
+    bool is_memory_mapped() const { return shards_[0]->is_memory_mapped(); }
 
-            if (existing.is_active == 0)
-            {
-                file_.seekp(offset, ios::beg);
-                file_.write(reinterpret_cast<const char *>(&driver), sizeof(DriverProfile));
-                file_.flush();
-                return true;
-            }
+    uint32_t shard_count() const { return static_cast<uint32_t>(shards_.size()); }
+
+    void configure_wal(bool enabled, uint32_t group_commit_ms, uint32_t group_commit_bytes)
+    {
+        wal_configured_ = true;
+        wal_enabled_ = enabled;
+        wal_group_commit_ms_ = group_commit_ms;
+        wal_group_commit_bytes_ = group_commit_bytes;
+        for (unique_ptr<DatabaseShard> &shard : shards_)
+        {
+            shard->configure_wal(enabled, group_commit_ms, group_commit_bytes);
         }
+    }
 
-        return false;
+    // Only takes effect in pread mode, at the next open
+    void configure_io(bool use_io_uring)
+    {
+        io_uring_enabled_ = use_io_uring;
+        for (unique_ptr<DatabaseShard> &shard : shards_)
+        {
+            shard->configure_io(use_io_uring);
+        }
     }
 
-    bool read_driver(uint64_t driver_id, DriverProfile &driver)
+    // Page pool for pread mode, shared by all shards and taking effect at
+    // the next open; it must outlive the database
+    void configure_buffer_pool(BufferPool *pool)
     {
-        lock_guard<mutex> lock(db_mutex_);
-        if (!is_open_)
-            return false;
+        pool_ = pool;
+        for (unique_ptr<DatabaseShard> &shard : shards_)
+        {
+            shard->configure_buffer_pool(pool);
+        }
+    }
 
-        memset(&driver, 0, sizeof(DriverProfile));
-        for (uint32_t i = 0; i < header_.max_drivers; i++)
+    // Shard 0 uses the given indexes; the others get a secondary index of
+    // their own next to it, through the same page pool
+    void attach_indexes(IndexManager *indexes)
+    {
+        for (uint32_t s = 1; s < shards_.size(); s++)
         {
-            uint64_t offset = driver_table_start_ + (i * sizeof(DriverProfile));
-            file_.seekg(offset, ios::beg);
-            if (!file_.read(reinterpret_cast<char *>(&driver), sizeof(DriverProfile))) break;
+            shards_[s]->attach_indexes(nullptr);
+        }
+        shard_indexes_.clear();
+        shards_[0]->attach_indexes(indexes);
+        indexes_ = indexes;
+        if (!indexes)
+            return;
 
-            if (driver.driver_id == driver_id && driver.is_active == 1)
+        for (uint32_t s = 1; s < shards_.size(); s++)
+        {
+            unique_ptr<IndexManager> own = make_unique<IndexManager>(
+                indexes->get_index_dir() + "/shard" + to_string(s), indexes->get_pool());
+            if (!own->open_secondary_index())
             {
-                return true;
+                cerr << "      WARNING: Shard " << s << " runs without a secondary index" << endl;
+                continue;
             }
+            shards_[s]->attach_indexes(own.get());
+            shard_indexes_.push_back(move(own));
+        }
+
+        bool stale = false;
+        for (unique_ptr<DatabaseShard> &shard : shards_)
+            stale = stale || shard->lookup_indexes_stale();
+        if (stale && rebuild_lookup_indexes())
+        {
+            for (unique_ptr<DatabaseShard> &shard : shards_)
+                shard->clear_lookup_indexes_stale();
         }
-        file_.clear();
-        return false;
     }
 
-    bool update_driver(const DriverProfile &driver)
+    // Rebuilds the indexes kept for the whole database from the records of
+    // every shard, after a migration or restore replaced the files under them
+    bool rebuild_lookup_indexes()
     {
-        lock_guard<mutex> lock(db_mutex_);
-        if (!is_open_)
-            return false;
-
-        for (uint32_t i = 0; i < header_.max_drivers; i++)
+        cout << "      Rebuilding primary and lookup indexes..." << endl;
+        vector<VehicleInfo> vehicles;
+        vector<pair<CompositeKey, BTreeValue>> primary;
+        for (unique_ptr<DatabaseShard> &shard : shards_)
         {
-            DriverProfile existing;
-            uint64_t offset = driver_table_start_ + (i * sizeof(DriverProfile));
+            vector<VehicleInfo> part = shard->get_all_vehicles();
+            vehicles.insert(vehicles.end(), part.begin(), part.end());
+            shard->collect_primary_entries(primary);
+        }
+        return indexes_->rebuild_driver_indexes(get_all_drivers()) && indexes_->rebuild_vehicle_indexes(vehicles) &&
+               indexes_->rebuild_primary_index(move(primary));
+    }
 
-            file_.seekg(offset, ios::beg);
-            file_.read(reinterpret_cast<char *>(&existing), sizeof(DriverProfile));
+    bool create_driver(const DriverProfile &driver)
+    {
+        return create_in(shard_of(driver.driver_id), DatabaseShard::DRIVER_TABLE, driver,
+                         &DatabaseShard::create_driver);
+    }
 
-            if (existing.is_active == 1 && existing.driver_id == driver.driver_id)
-            {
-                file_.seekp(offset, ios::beg);
-                file_.write(reinterpret_cast<const char *>(&driver), sizeof(DriverProfile));
-                file_.flush();
-                return true;
-            }
-        }
+    bool read_driver(uint64_t driver_id, DriverProfile &driver)
+    {
+        return shards_[shard_of(driver_id)]->read_driver(driver_id, driver);
+    }
 
-        return false;
+    bool update_driver(const DriverProfile &driver)
+    {
+        return shards_[shard_of(driver.driver_id)]->update_driver(driver);
     }
 
     bool delete_driver(uint64_t driver_id)
     {
-        if (!is_open_)
+        DatabaseShard &shard = *shards_[shard_of(driver_id)];
+        DriverProfile driver;
+        if (!shard.read_driver(driver_id, driver) || !shard.delete_driver(driver_id))
             return false;
 
-        for (uint32_t i = 0; i < header_.max_drivers; i++)
+        if (indexes_)
         {
-            DriverProfile driver;
-            uint64_t offset = driver_table_start_ + (i * sizeof(DriverProfile));
-
-            file_.seekg(offset, ios::beg);
-            file_.read(reinterpret_cast<char *>(&driver), sizeof(DriverProfile));
-
-            if (driver.is_active == 1 && driver.driver_id == driver_id)
-            {
-                driver.is_active = 0;
-                file_.seekp(offset, ios::beg);
-                file_.write(reinterpret_cast<const char *>(&driver), sizeof(DriverProfile));
-                file_.flush();
-                return true;
-            }
+            indexes_->remove_driver_email(driver.email, driver_id);
+            indexes_->remove_driver_username(driver.username, driver_id);
         }
-
-        return false;
+        return true;
     }
+
     bool update_expense(const ExpenseRecord &expense)
     {
-        lock_guard<mutex> lock(db_mutex_);
-        if (!is_open_)
+        ExpenseRecord existing;
+        bool date_changed = indexes_ && read_expense(expense.expense_id, existing) &&
+                            existing.expense_date != expense.expense_date;
+
+        if (!update_routed(shard_of(expense.driver_id), DatabaseShard::EXPENSE_TABLE, &DatabaseShard::expense_slots_,
+                           expense, &DatabaseShard::read_expense, &DatabaseShard::update_expense,
+                           &DatabaseShard::create_expense))
             return false;
 
-        for (uint32_t i = 0; i < 500000; i++)
+        if (date_changed)
         {
-            ExpenseRecord existing;
-            uint64_t offset = expense_table_start_ + (i * sizeof(ExpenseRecord));
-
-            file_.seekg(offset, ios::beg);
-            file_.read(reinterpret_cast<char *>(&existing), sizeof(ExpenseRecord));
-
-            if (existing.expense_id == expense.expense_id)
-            {
-                file_.seekp(offset, ios::beg);
-                file_.write(reinterpret_cast<const char *>(&expense), sizeof(ExpenseRecord));
-                file_.flush();
-                return true;
-            }
+            indexes_->remove_primary(4, expense.expense_id, existing.expense_date);
+            indexes_->insert_primary(4, expense.expense_id, expense.expense_date, 0);
         }
-
-        return false;
+        return true;
     }
 
     bool delete_expense(uint64_t expense_id)
     {
-        if (!is_open_)
-            return false;
-
-        for (uint32_t i = 0; i < 500000; i++)
+        for (unique_ptr<DatabaseShard> &shard : shards_)
         {
             ExpenseRecord expense;
-            uint64_t offset = expense_table_start_ + (i * sizeof(ExpenseRecord));
-
-            file_.seekg(offset, ios::beg);
-            file_.read(reinterpret_cast<char *>(&expense), sizeof(ExpenseRecord));
+            if (!shard->read_expense(expense_id, expense) || !shard->delete_expense(expense_id))
+                continue;
 
-            if (expense.expense_id == expense_id)
-            {
-
-                expense.expense_id = 0;
-                file_.seekp(offset, ios::beg);
-                file_.write(reinterpret_cast<const char *>(&expense), sizeof(ExpenseRecord));
-                file_.flush();
-                return true;
-            }
+            if (indexes_)
+                indexes_->remove_primary(4, expense_id, expense.expense_date);
+            return true;
         }
-
         return false;
     }
-    
+
     bool read_expense(uint64_t expense_id, ExpenseRecord &expense)
     {
-        if (!is_open_)
-            return false;
-
-        memset(&expense, 0, sizeof(ExpenseRecord));
-        for (uint32_t i = 0; i < 500000; i++)
-        {
-            uint64_t offset = expense_table_start_ + (i * sizeof(ExpenseRecord));
-            file_.seekg(offset, ios::beg);
-            if (!file_.read(reinterpret_cast<char *>(&expense), sizeof(ExpenseRecord))) break;
-
-            if (expense.expense_id == expense_id)
-            {
-                return true;
-            }
-        }
-        file_.clear();
-        return false;
+        return read_any(expense_id, expense, &DatabaseShard::read_expense);
     }
+
     vector<DriverProfile> get_all_drivers()
     {
         vector<DriverProfile> drivers;
-        lock_guard<mutex> lock(db_mutex_);
-        if (!is_open_)
-            return drivers;
-
-        for (uint32_t i = 0; i < header_.max_drivers; i++)
+        for (unique_ptr<DatabaseShard> &shard : shards_)
         {
-            DriverProfile driver;
-            memset(&driver, 0, sizeof(DriverProfile));
-            uint64_t offset = driver_table_start_ + (i * sizeof(DriverProfile));
-
-            file_.seekg(offset, ios::beg);
-            if (!file_.read(reinterpret_cast<char *>(&driver), sizeof(DriverProfile))) break;
-
-            if (driver.is_active == 1)
-            {
-                drivers.push_back(driver);
-            }
+            vector<DriverProfile> part = shard->get_all_drivers();
+            drivers.insert(drivers.end(), part.begin(), part.end());
         }
-        file_.clear();
         return drivers;
     }
 
     bool create_vehicle(const VehicleInfo &vehicle)
     {
-        lock_guard<mutex> lock(db_mutex_);
-        if (!is_open_)
-            return false;
-
-        for (uint32_t i = 0; i < header_.max_vehicles; i++)
-        {
-            VehicleInfo existing;
-            uint64_t offset = vehicle_table_start_ + (i * sizeof(VehicleInfo));
-
-            file_.seekg(offset, ios::beg);
-            file_.read(reinterpret_cast<char *>(&existing), sizeof(VehicleInfo));
-
-            if (existing.is_active == 0)
-            {
-                file_.seekp(offset, ios::beg);
-                file_.write(reinterpret_cast<const char *>(&vehicle), sizeof(VehicleInfo));
-                file_.flush();
-                return true;
-            }
-        }
-
-        return false;
+        return create_in(shard_of(vehicle.owner_driver_id), DatabaseShard::VEHICLE_TABLE, vehicle,
+                         &DatabaseShard::create_vehicle);
     }
 
     bool read_vehicle(uint64_t vehicle_id, VehicleInfo &vehicle)
     {
-        lock_guard<mutex> lock(db_mutex_);
-        if (!is_open_)
-            return false;
-
-        memset(&vehicle, 0, sizeof(VehicleInfo));
-        for (uint32_t i = 0; i < header_.max_vehicles; i++)
-        {
-            uint64_t offset = vehicle_table_start_ + (i * sizeof(VehicleInfo));
-            file_.seekg(offset, ios::beg);
-            if (!file_.read(reinterpret_cast<char *>(&vehicle), sizeof(VehicleInfo))) break;
-
-            if (vehicle.vehicle_id == vehicle_id && vehicle.is_active == 1)
-            {
-                return true;
-            }
-        }
-        file_.clear();
-        return false;
+        return read_any(vehicle_id, vehicle, &DatabaseShard::read_vehicle);
     }
 
     bool update_vehicle(const VehicleInfo &vehicle)
     {
-        lock_guard<mutex> lock(db_mutex_);
-        if (!is_open_)
-            return false;
-
-        for (uint32_t i = 0; i < header_.max_vehicles; i++)
-        {
-            VehicleInfo existing;
-            uint64_t offset = vehicle_table_start_ + (i * sizeof(VehicleInfo));
-
-            file_.seekg(offset, ios::beg);
-            file_.read(reinterpret_cast<char *>(&existing), sizeof(VehicleInfo));
+        VehicleInfo existing;
+        bool plate_changed = indexes_ && read_vehicle(vehicle.vehicle_id, existing) &&
+                             strncmp(existing.license_plate, vehicle.license_plate, sizeof(vehicle.license_plate)) != 0;
 
-            if (existing.is_active == 1 && existing.vehicle_id == vehicle.vehicle_id)
-            {
-                file_.seekp(offset, ios::beg);
-                file_.write(reinterpret_cast<const char *>(&vehicle), sizeof(VehicleInfo));
-                file_.flush();
-                return true;
-            }
-        }
+        if (!update_routed(shard_of(vehicle.owner_driver_id), DatabaseShard::VEHICLE_TABLE,
+                           &DatabaseShard::vehicle_slots_, vehicle, &DatabaseShard::read_vehicle,
+                           &DatabaseShard::update_vehicle, &DatabaseShard::create_vehicle))
+            return false;
 
-        return false;
+        if (plate_changed)
+            indexes_->update_vehicle_plate(existing.license_plate, vehicle.license_plate, vehicle.vehicle_id);
+        return true;
     }
 
     bool delete_vehicle(uint64_t vehicle_id)
     {
-        if (!is_open_)
-            return false;
-
-        for (uint32_t i = 0; i < header_.max_vehicles; i++)
+        for (unique_ptr<DatabaseShard> &shard : shards_)
         {
             VehicleInfo vehicle;
-            uint64_t offset = vehicle_table_start_ + (i * sizeof(VehicleInfo));
-
-            file_.seekg(offset, ios::beg);
-            file_.read(reinterpret_cast<char *>(&vehicle), sizeof(VehicleInfo));
+            if (!shard->read_vehicle(vehicle_id, vehicle) || !shard->delete_vehicle(vehicle_id))
+                continue;
 
-            if (vehicle.is_active == 1 && vehicle.vehicle_id == vehicle_id)
+            if (indexes_)
             {
-                vehicle.is_active = 0;
-                file_.seekp(offset, ios::beg);
-                file_.write(reinterpret_cast<const char *>(&vehicle), sizeof(VehicleInfo));
-                file_.flush();
-                return true;
+                indexes_->remove_vehicle_plate(vehicle.license_plate, vehicle_id);
+                indexes_->remove_primary(2, vehicle_id, vehicle.created_time);
             }
+            return true;
         }
-
         return false;
     }
 
     vector<VehicleInfo> get_vehicles_by_owner(uint64_t owner_id)
     {
-        vector<VehicleInfo> vehicles;
-        lock_guard<mutex> lock(db_mutex_);
-        if (!is_open_)
-            return vehicles;
-
-        for (uint32_t i = 0; i < header_.max_vehicles; i++)
-        {
-            VehicleInfo vehicle;
-            memset(&vehicle, 0, sizeof(VehicleInfo));
-            uint64_t offset = vehicle_table_start_ + (i * sizeof(VehicleInfo));
-
-            file_.seekg(offset, ios::beg);
-            if (!file_.read(reinterpret_cast<char *>(&vehicle), sizeof(VehicleInfo))) break;
-
-            if (vehicle.owner_driver_id == owner_id && vehicle.is_active == 1)
-            {
-                vehicles.push_back(vehicle);
-            }
-        }
-        file_.clear();
-        return vehicles;
+        return shards_[shard_of(owner_id)]->get_vehicles_by_owner(owner_id);
     }
 
     bool create_trip(const TripRecord &trip)
     {
-        lock_guard<mutex> lock(db_mutex_);
-        if (!is_open_)
-            return false;
-
-        for (uint32_t i = 0; i < header_.max_trips; i++)
-        {
-            TripRecord existing;
-            uint64_t offset = trip_table_start_ + (i * sizeof(TripRecord));
-
-            file_.seekg(offset, ios::beg);
-            file_.read(reinterpret_cast<char *>(&existing), sizeof(TripRecord));
-
-            if (existing.trip_id == 0)
-            {
-                file_.seekp(offset, ios::beg);
-                file_.write(reinterpret_cast<const char *>(&trip), sizeof(TripRecord));
-                file_.flush();
-                return true;
-            }
-        }
-
-        return false;
+        return create_in(shard_of(trip.driver_id), DatabaseShard::TRIP_TABLE, trip, &DatabaseShard::create_trip);
     }
 
     bool read_trip(uint64_t trip_id, TripRecord &trip)
     {
-        lock_guard<mutex> lock(db_mutex_);
-        if (!is_open_)
-            return false;
-
-        memset(&trip, 0, sizeof(TripRecord));
-        for (uint32_t i = 0; i < header_.max_trips; i++)
-        {
-            uint64_t offset = trip_table_start_ + (i * sizeof(TripRecord));
-            file_.seekg(offset, ios::beg);
-            if (!file_.read(reinterpret_cast<char *>(&trip), sizeof(TripRecord))) break;
-
-            if (trip.trip_id == trip_id)
-            {
-                return true;
-            }
-        }
-        file_.clear();
-        return false;
+        return read_any(trip_id, trip, &DatabaseShard::read_trip);
     }
 
     bool update_trip(const TripRecord &trip)
     {
-        lock_guard<mutex> lock(db_mutex_);
-        if (!is_open_)
-            return false;
-
-        for (uint32_t i = 0; i < header_.max_trips; i++)
-        {
-            TripRecord existing;
-            uint64_t offset = trip_table_start_ + (i * sizeof(TripRecord));
-
-            file_.seekg(offset, ios::beg);
-            file_.read(reinterpret_cast<char *>(&existing), sizeof(TripRecord));
-
-            if (existing.trip_id == trip.trip_id)
-            {
-                file_.seekp(offset, ios::beg);
-                file_.write(reinterpret_cast<const char *>(&trip), sizeof(TripRecord));
-                file_.flush();
-                return true;
-            }
-        }
-
-        return false;
+        return update_routed(shard_of(trip.driver_id), DatabaseShard::TRIP_TABLE, &DatabaseShard::trip_slots_, trip,
+                             &DatabaseShard::read_trip, &DatabaseShard::update_trip, &DatabaseShard::create_trip);
     }
 
     vector<TripRecord> get_trips_by_driver(uint64_t driver_id, int limit = 100)
     {
-        vector<TripRecord> trips;
-        lock_guard<mutex> lock(db_mutex_);
-        if (!is_open_)
-            return trips;
+        return shards_[shard_of(driver_id)]->get_trips_by_driver(driver_id, limit);
+    }
 
-        int count = 0;
-        for (uint32_t i = 0; i < header_.max_trips && count < limit; i++)
+    vector<TripRecord> get_all_active_trips()
+    {
+        vector<TripRecord> trips;
+        for (unique_ptr<DatabaseShard> &shard : shards_)
         {
-            TripRecord trip;
-            memset(&trip, 0, sizeof(TripRecord));
-            uint64_t offset = trip_table_start_ + (i * sizeof(TripRecord));
-
-            file_.seekg(offset, ios::beg);
-            if (!file_.read(reinterpret_cast<char *>(&trip), sizeof(TripRecord))) break;
-
-            if (trip.trip_id != 0 && trip.driver_id == driver_id)
-            {
-                trips.push_back(trip);
-                count++;
-            }
+            vector<TripRecord> part = shard->get_all_active_trips();
+            trips.insert(trips.end(), part.begin(), part.end());
         }
-        file_.clear();
         return trips;
     }
 
-    vector<TripRecord> get_all_active_trips()
+    TripTotals get_trip_totals(uint64_t driver_id, uint64_t start_time = 0, uint64_t end_time = UINT64_MAX)
     {
-        vector<TripRecord> active_trips;
-        lock_guard<mutex> lock(db_mutex_);
-        if (!is_open_)
-            return active_trips;
+        return shards_[shard_of(driver_id)]->get_trip_totals(driver_id, start_time, end_time);
+    }
 
-        for (uint32_t i = 0; i < header_.max_trips; i++)
+    // Each driver's trips are in one shard, so the shards' totals only need
+    // to be put together
+    void get_trip_totals_by_driver(HashTable<uint64_t, TripTotals> &totals,
+                                   uint64_t start_time = 0, uint64_t end_time = UINT64_MAX)
+    {
+        shards_[0]->get_trip_totals_by_driver(totals, start_time, end_time);
+        for (uint32_t s = 1; s < shards_.size(); s++)
         {
-            TripRecord trip;
-            memset(&trip, 0, sizeof(TripRecord));
-            uint64_t offset = trip_table_start_ + (i * sizeof(TripRecord));
-
-            file_.seekg(offset, ios::beg);
-            if (!file_.read(reinterpret_cast<char *>(&trip), sizeof(TripRecord))) break;
-
-            if (trip.trip_id != 0 && trip.end_time == 0)
-            {
-                active_trips.push_back(trip);
-            }
+            HashTable<uint64_t, TripTotals> part;
+            shards_[s]->get_trip_totals_by_driver(part, start_time, end_time);
+            merge_totals(totals, part);
         }
-        file_.clear();
-        return active_trips;
     }
 
-    bool create_maintenance(const MaintenanceRecord &record)
+    static uint32_t partition_of(uint64_t timestamp)
     {
-        lock_guard<mutex> lock(db_mutex_);
-        if (!is_open_)
-            return false;
-
-        for (uint32_t i = 0; i < 100000; i++)
-        {
-            MaintenanceRecord existing;
-            uint64_t offset = maintenance_table_start_ + (i * sizeof(MaintenanceRecord));
+        return DatabaseShard::partition_of(timestamp);
+    }
 
-            file_.seekg(offset, ios::beg);
-            file_.read(reinterpret_cast<char *>(&existing), sizeof(MaintenanceRecord));
+    vector<TripRecord> get_trips_by_date_range(uint64_t driver_id, uint64_t start_time, uint64_t end_time)
+    {
+        return shards_[shard_of(driver_id)]->get_trips_by_date_range(driver_id, start_time, end_time);
+    }
 
-            if (existing.maintenance_id == 0)
-            {
-                file_.seekp(offset, ios::beg);
-                file_.write(reinterpret_cast<const char *>(&record), sizeof(MaintenanceRecord));
-                file_.flush();
-                return true;
-            }
-        }
+    uint64_t drop_trip_partition(uint32_t partition)
+    {
+        return sum([this, partition](DatabaseShard &shard)
+                   {
+                       vector<pair<uint64_t, uint64_t>> removed;
+                       uint64_t dropped = shard.drop_trip_partition(partition, &removed);
+                       remove_primary(3, removed);
+                       return dropped;
+                   });
+    }
 
-        return false;
+    bool create_maintenance(const MaintenanceRecord &record)
+    {
+        return create_in(shard_of(record.driver_id), DatabaseShard::MAINTENANCE_TABLE, record,
+                         &DatabaseShard::create_maintenance);
     }
 
+    // A vehicle's maintenance may be recorded by drivers other than its
+    // owner, so every shard is asked
     vector<MaintenanceRecord> get_maintenance_by_vehicle(uint64_t vehicle_id)
     {
-        vector<MaintenanceRecord> records;
-        lock_guard<mutex> lock(db_mutex_);
-        if (!is_open_)
-            return records;
-
-        for (uint32_t i = 0; i < 100000; i++)
-        {
-            MaintenanceRecord record;
-            memset(&record, 0, sizeof(MaintenanceRecord));
-            uint64_t offset = maintenance_table_start_ + (i * sizeof(MaintenanceRecord));
-
-            file_.seekg(offset, ios::beg);
-            if (!file_.read(reinterpret_cast<char *>(&record), sizeof(MaintenanceRecord))) break;
-
-            if (record.maintenance_id != 0 && record.vehicle_id == vehicle_id)
-            {
-                records.push_back(record);
-            }
-        }
-        file_.clear();
-        return records;
+        return gather(vehicle_id, &DatabaseShard::get_maintenance_by_vehicle);
     }
 
     bool create_expense(const ExpenseRecord &expense)
     {
-        lock_guard<mutex> lock(db_mutex_);
-        if (!is_open_)
-            return false;
-
-        for (uint32_t i = 0; i < 500000; i++)
-        {
-            ExpenseRecord existing;
-            uint64_t offset = expense_table_start_ + (i * sizeof(ExpenseRecord));
-
-            file_.seekg(offset, ios::beg);
-            file_.read(reinterpret_cast<char *>(&existing), sizeof(ExpenseRecord));
-
-            if (existing.expense_id == 0)
-            {
-                file_.seekp(offset, ios::beg);
-                file_.write(reinterpret_cast<const char *>(&expense), sizeof(ExpenseRecord));
-                file_.flush();
-                return true;
-            }
-        }
-
-        return false;
+        return create_in(shard_of(expense.driver_id), DatabaseShard::EXPENSE_TABLE, expense,
+                         &DatabaseShard::create_expense);
     }
 
-    
-
     vector<ExpenseRecord> get_expenses_by_driver(uint64_t driver_id, int limit = 100)
     {
-        vector<ExpenseRecord> expenses;
-        lock_guard<mutex> lock(db_mutex_);
-        if (!is_open_)
-            return expenses;
-
-        int count = 0;
-        for (uint32_t i = 0; i < 500000 && count < limit; i++)
-        {
-            ExpenseRecord expense;
-            memset(&expense, 0, sizeof(ExpenseRecord));
-            uint64_t offset = expense_table_start_ + (i * sizeof(ExpenseRecord));
-
-            file_.seekg(offset, ios::beg);
-            if (!file_.read(reinterpret_cast<char *>(&expense), sizeof(ExpenseRecord))) break;
-
-            if (expense.expense_id != 0 && expense.driver_id == driver_id)
-            {
-                expenses.push_back(expense);
-                count++;
-            }
-        }
-        file_.clear();
-        return expenses;
+        return shards_[shard_of(driver_id)]->get_expenses_by_driver(driver_id, limit);
     }
 
     vector<ExpenseRecord> get_expenses_by_category(uint64_t driver_id, ExpenseCategory category)
     {
-        vector<ExpenseRecord> expenses;
-        lock_guard<mutex> lock(db_mutex_);
-        if (!is_open_)
-            return expenses;
-
-        for (uint32_t i = 0; i < 500000; i++)
-        {
-            ExpenseRecord expense;
-            memset(&expense, 0, sizeof(ExpenseRecord));
-            uint64_t offset = expense_table_start_ + (i * sizeof(ExpenseRecord));
-
-            file_.seekg(offset, ios::beg);
-            if (!file_.read(reinterpret_cast<char *>(&expense), sizeof(ExpenseRecord))) break;
-
-            if (expense.expense_id != 0 && expense.driver_id == driver_id &&
-                expense.category == category)
-            {
-                expenses.push_back(expense);
-            }
-        }
-        file_.clear();
-        return expenses;
+        return shards_[shard_of(driver_id)]->get_expenses_by_category(driver_id, category);
     }
 
-    bool create_incident(const IncidentReport &incident)
+    vector<ExpenseRecord> get_expenses_by_date_range(uint64_t driver_id, uint64_t start_date, uint64_t end_date)
     {
-        lock_guard<mutex> lock(db_mutex_);
-        if (!is_open_)
-            return false;
+        return shards_[shard_of(driver_id)]->get_expenses_by_date_range(driver_id, start_date, end_date);
+    }
 
-        for (uint32_t i = 0; i < 50000; i++)
-        {
-            IncidentReport existing;
-            uint64_t offset = incident_table_start_ + (i * sizeof(IncidentReport));
+    uint64_t drop_expense_partition(uint32_t partition)
+    {
+        return sum([this, partition](DatabaseShard &shard)
+                   {
+                       vector<pair<uint64_t, uint64_t>> removed;
+                       uint64_t dropped = shard.drop_expense_partition(partition, &removed);
+                       remove_primary(4, removed);
+                       return dropped;
+                   });
+    }
 
-            file_.seekg(offset, ios::beg);
-            file_.read(reinterpret_cast<char *>(&existing), sizeof(IncidentReport));
+    bool create_trips_batch(const vector<TripRecord> &trips)
+    {
+        return create_routed_batch(DatabaseShard::TRIP_TABLE, trips, &DatabaseShard::create_trips_batch);
+    }
 
-            if (existing.incident_id == 0)
-            {
-                file_.seekp(offset, ios::beg);
-                file_.write(reinterpret_cast<const char *>(&incident), sizeof(IncidentReport));
-                file_.flush();
-                return true;
-            }
-        }
+    bool create_expenses_batch(const vector<ExpenseRecord> &expenses)
+    {
+        return create_routed_batch(DatabaseShard::EXPENSE_TABLE, expenses, &DatabaseShard::create_expenses_batch);
+    }
 
-        return false;
+    bool create_incident(const IncidentReport &incident)
+    {
+        return create_in(shard_of(incident.driver_id), DatabaseShard::INCIDENT_TABLE, incident,
+                         &DatabaseShard::create_incident);
     }
 
     bool read_incident(uint64_t incident_id, IncidentReport &incident)
     {
-        lock_guard<mutex> lock(db_mutex_);
-        if (!is_open_)
-            return false;
-
-        memset(&incident, 0, sizeof(IncidentReport));
-        for (uint32_t i = 0; i < 50000; i++)
-        {
-            uint64_t offset = incident_table_start_ + (i * sizeof(IncidentReport));
-            file_.seekg(offset, ios::beg);
-            if (!file_.read(reinterpret_cast<char *>(&incident), sizeof(IncidentReport))) break;
-
-            if (incident.incident_id == incident_id)
-            {
-                return true;
-            }
-        }
-        file_.clear();
-        return false;
+        return read_any(incident_id, incident, &DatabaseShard::read_incident);
     }
 
     bool update_incident(const IncidentReport &incident)
     {
-        lock_guard<mutex> lock(db_mutex_);
-        if (!is_open_)
-            return false;
-
-        for (uint32_t i = 0; i < 50000; i++)
-        {
-            IncidentReport existing;
-            uint64_t offset = incident_table_start_ + (i * sizeof(IncidentReport));
-
-            file_.seekg(offset, ios::beg);
-            file_.read(reinterpret_cast<char *>(&existing), sizeof(IncidentReport));
-
-            if (existing.incident_id == incident.incident_id)
-            {
-                file_.seekp(offset, ios::beg);
-                file_.write(reinterpret_cast<const char *>(&incident), sizeof(IncidentReport));
-                file_.flush();
-                return true;
-            }
-        }
-
-        return false;
+        return update_routed(shard_of(incident.driver_id), DatabaseShard::INCIDENT_TABLE,
+                             &DatabaseShard::incident_slots_, incident, &DatabaseShard::read_incident,
+                             &DatabaseShard::update_incident, &DatabaseShard::create_incident);
     }
 
     vector<IncidentReport> get_incidents_by_driver(uint64_t driver_id, int limit = 100)
     {
-        vector<IncidentReport> incidents;
-        lock_guard<mutex> lock(db_mutex_);
-        if (!is_open_)
-            return incidents;
-
-        int count = 0;
-        for (uint32_t i = 0; i < 50000 && count < limit; i++)
-        {
-            IncidentReport incident;
-            memset(&incident, 0, sizeof(IncidentReport));
-            uint64_t offset = incident_table_start_ + (i * sizeof(IncidentReport));
-
-            file_.seekg(offset, ios::beg);
-            if (!file_.read(reinterpret_cast<char *>(&incident), sizeof(IncidentReport))) break;
-
-            if (incident.incident_id != 0 && incident.driver_id == driver_id)
-            {
-                incidents.push_back(incident);
-                count++;
-            }
-        }
-        file_.clear();
-        return incidents;
+        return shards_[shard_of(driver_id)]->get_incidents_by_driver(driver_id, limit);
     }
 
     vector<IncidentReport> get_incidents_by_vehicle(uint64_t vehicle_id)
     {
-        vector<IncidentReport> incidents;
-        lock_guard<mutex> lock(db_mutex_);
-        if (!is_open_)
-            return incidents;
-
-        for (uint32_t i = 0; i < 50000; i++)
-        {
-            IncidentReport incident;
-            memset(&incident, 0, sizeof(IncidentReport));
-            uint64_t offset = incident_table_start_ + (i * sizeof(IncidentReport));
-
-            file_.seekg(offset, ios::beg);
-            if (!file_.read(reinterpret_cast<char *>(&incident), sizeof(IncidentReport))) break;
-
-            if (incident.incident_id != 0 && incident.vehicle_id == vehicle_id)
-            {
-                incidents.push_back(incident);
-            }
-        }
-        file_.clear();
-        return incidents;
+        return gather(vehicle_id, &DatabaseShard::get_incidents_by_vehicle);
     }
 
     uint64_t get_current_timestamp() const
     {
-        return static_cast<uint64_t>(time(nullptr));
+        return shards_[0]->get_current_timestamp();
     }
 
+    uint64_t next_driver_id(uint32_t count = 1) { return shards_[0]->next_driver_id(count); }
+    uint64_t next_vehicle_id(uint32_t count = 1) { return shards_[0]->next_vehicle_id(count); }
+    uint64_t next_trip_id(uint32_t count = 1) { return shards_[0]->next_trip_id(count); }
+    uint64_t next_maintenance_id(uint32_t count = 1) { return shards_[0]->next_maintenance_id(count); }
+    uint64_t next_expense_id(uint32_t count = 1) { return shards_[0]->next_expense_id(count); }
+    uint64_t next_incident_id(uint32_t count = 1) { return shards_[0]->next_incident_id(count); }
+
     uint64_t get_max_driver_id()
     {
-        lock_guard<mutex> lock(db_mutex_);
         uint64_t max_id = 0;
-        if (!is_open_) return 0;
-        for (uint32_t i = 0; i < header_.max_drivers; i++) {
-            DriverProfile d;
-            memset(&d, 0, sizeof(DriverProfile));
-            uint64_t offset = driver_table_start_ + (i * sizeof(DriverProfile));
-            file_.seekg(offset, ios::beg);
-            if (!file_.read(reinterpret_cast<char *>(&d), sizeof(DriverProfile))) break;
-            if (d.is_active == 1 && d.driver_id > max_id) max_id = d.driver_id;
-        }
-        file_.clear();
+        for (unique_ptr<DatabaseShard> &shard : shards_)
+            max_id = max(max_id, shard->get_max_driver_id());
         return max_id;
     }
 
     uint64_t get_max_vehicle_id()
     {
-        lock_guard<mutex> lock(db_mutex_);
         uint64_t max_id = 0;
-        if (!is_open_) return 0;
-        for (uint32_t i = 0; i < header_.max_vehicles; i++) {
-            VehicleInfo v;
-            memset(&v, 0, sizeof(VehicleInfo));
-            uint64_t offset = vehicle_table_start_ + (i * sizeof(VehicleInfo));
-            file_.seekg(offset, ios::beg);
-            if (!file_.read(reinterpret_cast<char *>(&v), sizeof(VehicleInfo))) break;
-            if (v.is_active == 1 && v.vehicle_id > max_id) max_id = v.vehicle_id;
-        }
-        file_.clear();
+        for (unique_ptr<DatabaseShard> &shard : shards_)
+            max_id = max(max_id, shard->get_max_vehicle_id());
         return max_id;
     }
 
     uint64_t get_max_trip_id()
     {
-        lock_guard<mutex> lock(db_mutex_);
         uint64_t max_id = 0;
-        if (!is_open_) return 0;
-        for (uint32_t i = 0; i < header_.max_trips; i++) {
-            TripRecord t;
-            memset(&t, 0, sizeof(TripRecord));
-            uint64_t offset = trip_table_start_ + (i * sizeof(TripRecord));
-            file_.seekg(offset, ios::beg);
-            if (!file_.read(reinterpret_cast<char *>(&t), sizeof(TripRecord))) break;
-            if (t.trip_id > max_id) max_id = t.trip_id;
-        }
-        file_.clear();
+        for (unique_ptr<DatabaseShard> &shard : shards_)
+            max_id = max(max_id, shard->get_max_trip_id());
         return max_id;
     }
 
     uint64_t get_max_expense_id()
     {
-        lock_guard<mutex> lock(db_mutex_);
         uint64_t max_id = 0;
-        if (!is_open_) return 0;
-        for (uint32_t i = 0; i < 500000; i++) {
-            ExpenseRecord e;
-            memset(&e, 0, sizeof(ExpenseRecord));
-            uint64_t offset = expense_table_start_ + (i * sizeof(ExpenseRecord));
-            file_.seekg(offset, ios::beg);
-            if (!file_.read(reinterpret_cast<char *>(&e), sizeof(ExpenseRecord))) break;
-            if (e.expense_id > max_id) max_id = e.expense_id;
-        }
-        file_.clear();
+        for (unique_ptr<DatabaseShard> &shard : shards_)
+            max_id = max(max_id, shard->get_max_expense_id());
         return max_id;
     }
 
     uint64_t get_max_incident_id()
     {
-        lock_guard<mutex> lock(db_mutex_);
         uint64_t max_id = 0;
-        if (!is_open_) return 0;
-        for (uint32_t i = 0; i < 50000; i++) {
-            IncidentReport in;
-            memset(&in, 0, sizeof(IncidentReport));
-            uint64_t offset = incident_table_start_ + (i * sizeof(IncidentReport));
-            file_.seekg(offset, ios::beg);
-            if (!file_.read(reinterpret_cast<char *>(&in), sizeof(IncidentReport))) break;
-            if (in.incident_id > max_id) max_id = in.incident_id;
-        }
-        file_.clear();
+        for (unique_ptr<DatabaseShard> &shard : shards_)
+            max_id = max(max_id, shard->get_max_incident_id());
         return max_id;
     }
 
     uint64_t get_max_maintenance_id()
     {
-        lock_guard<mutex> lock(db_mutex_);
         uint64_t max_id = 0;
-        if (!is_open_) return 0;
-        for (uint32_t i = 0; i < 100000; i++) {
-            MaintenanceRecord m;
-            memset(&m, 0, sizeof(MaintenanceRecord));
-            uint64_t offset = maintenance_table_start_ + (i * sizeof(MaintenanceRecord));
-            file_.seekg(offset, ios::beg);
-            if (!file_.read(reinterpret_cast<char *>(&m), sizeof(MaintenanceRecord))) break;
-            if (m.maintenance_id > max_id) max_id = m.maintenance_id;
-        }
-        file_.clear();
+        for (unique_ptr<DatabaseShard> &shard : shards_)
+            max_id = max(max_id, shard->get_max_maintenance_id());
         return max_id;
     }
 
-    const SDMHeader &get_header() const { return header_; }
-    bool is_database_open() const { return is_open_; }
+    // Header of shard 0, which holds the id sequences
+    const SDMHeader &get_header() const { return shards_[0]->get_header(); }
+    bool is_database_open() const { return shards_[0]->is_database_open(); }
 
-    DatabaseStats get_stats()
+    uint64_t compact()
     {
-        DatabaseStats stats;
-        if (!is_open_)
-            return stats;
+        return sum([](DatabaseShard &shard) { return shard.compact(); });
+    }
+
+    // Migrates every shard in turn (see DatabaseShard::migrate)
+    static bool migrate(const SDMConfig &config)
+    {
+        uint32_t count = 1;
+        {
+            DatabaseShard first(config.database_path, config.use_mmap);
+            if (first.open())
+                count = max<uint32_t>(first.header_.shard_count, 1);
+        }
+
+        for (uint32_t k = 0; k < count; k++)
+        {
+            if (!DatabaseShard::migrate(shard_config(config, k)))
+                return false;
+        }
+        return claim_shards(config.database_path, config.use_mmap, count);
+    }
+
+    // Backs up every shard, shard k to path with the shard's suffix. The
+    // shards' change sequences are first brought level, so the sequence
+    // returned (the lowest of theirs) makes the next incremental backup of
+    // each shard start close to where this one ended. Shards are backed up
+    // one after another, each from a snapshot of its own.
+    bool backup(const string &path, uint64_t since, uint64_t &sequence)
+    {
+        if (!is_database_open())
+            return false;
+
+        uint64_t level = 0;
+        for (unique_ptr<DatabaseShard> &shard : shards_)
+            level = max<uint64_t>(level, shard->change_sequence_);
+        for (unique_ptr<DatabaseShard> &shard : shards_)
+            shard->raise_change_sequence(level);
+
+        sequence = UINT64_MAX;
+        for (uint32_t s = 0; s < shards_.size(); s++)
+        {
+            uint64_t shard_sequence;
+            if (!shards_[s]->backup(shard_path(path, s), since, shard_sequence))
+                return false;
+            sequence = min(sequence, shard_sequence);
+        }
+        return true;
+    }
 
-        for (uint32_t i = 0; i < header_.max_drivers; i++)
+    // Restores every shard present in the first backup from its part of each
+    // backup file (see DatabaseShard::restore)
+    static bool restore(const SDMConfig &config, const vector<string> &backups)
+    {
+        uint32_t count = 1;
+        struct stat st;
+        while (!backups.empty() && stat(shard_path(backups[0], count).c_str(), &st) == 0)
+            count++;
+
+        for (uint32_t k = 0; k < count; k++)
         {
-            DriverProfile driver;
-            uint64_t offset = driver_table_start_ + (i * sizeof(DriverProfile));
-            file_.seekg(offset, ios::beg);
-            file_.read(reinterpret_cast<char *>(&driver), sizeof(DriverProfile));
+            vector<string> parts;
+            for (const string &backup : backups)
+                parts.push_back(shard_path(backup, k));
+            if (!DatabaseShard::restore(shard_config(config, k), parts))
+                return false;
+        }
+        return claim_shards(config.database_path, config.use_mmap, count);
+    }
+
+    uint64_t seal_cold_records(uint64_t cutoff)
+    {
+        return sum([cutoff](DatabaseShard &shard) { return shard.seal_cold_records(cutoff); });
+    }
 
-            if (driver.is_active == 1)
+    // The most fragmented shard decides when to compact
+    double get_fragmentation() const
+    {
+        double worst = 0.0;
+        for (const unique_ptr<DatabaseShard> &shard : shards_)
+            worst = max(worst, shard->get_fragmentation());
+        return worst;
+    }
+
+    // A snapshot of every shard, each taken in turn. A driver and everything
+    // recorded for them share a shard, so per-driver reads stay consistent.
+    class Snapshot
+    {
+    private:
+        DatabaseManager &db_;
+        vector<unique_ptr<DatabaseShard::Snapshot>> snapshots_;
+
+    public:
+        explicit Snapshot(DatabaseManager &db) : db_(db)
+        {
+            for (unique_ptr<DatabaseShard> &shard : db_.shards_)
             {
-                stats.total_drivers++;
-                stats.active_drivers++;
-                stats.total_distance += driver.total_distance;
+                snapshots_.push_back(make_unique<DatabaseShard::Snapshot>(*shard));
             }
         }
 
-        for (uint32_t i = 0; i < header_.max_vehicles; i++)
+        Snapshot(const Snapshot &) = delete;
+        Snapshot &operator=(const Snapshot &) = delete;
+
+        vector<DriverProfile> get_all_drivers()
         {
-            VehicleInfo vehicle;
-            uint64_t offset = vehicle_table_start_ + (i * sizeof(VehicleInfo));
-            file_.seekg(offset, ios::beg);
-            file_.read(reinterpret_cast<char *>(&vehicle), sizeof(VehicleInfo));
+            vector<DriverProfile> drivers;
+            for (unique_ptr<DatabaseShard::Snapshot> &snapshot : snapshots_)
+            {
+                vector<DriverProfile> part = snapshot->get_all_drivers();
+                drivers.insert(drivers.end(), part.begin(), part.end());
+            }
+            return drivers;
+        }
 
-            if (vehicle.is_active == 1)
+        void get_trip_totals_by_driver(HashTable<uint64_t, TripTotals> &totals,
+                                       uint64_t start_time = 0, uint64_t end_time = UINT64_MAX)
+        {
+            snapshots_[0]->get_trip_totals_by_driver(totals, start_time, end_time);
+            for (uint32_t s = 1; s < snapshots_.size(); s++)
             {
-                stats.total_vehicles++;
+                HashTable<uint64_t, TripTotals> part;
+                snapshots_[s]->get_trip_totals_by_driver(part, start_time, end_time);
+                merge_totals(totals, part);
             }
         }
 
-        for (uint32_t i = 0; i < header_.max_trips; i++)
+        vector<ExpenseRecord> get_expenses_by_date_range(uint64_t driver_id, uint64_t start_date, uint64_t end_date)
         {
-            TripRecord trip;
-            uint64_t offset = trip_table_start_ + (i * sizeof(TripRecord));
-            file_.seekg(offset, ios::beg);
-            file_.read(reinterpret_cast<char *>(&trip), sizeof(TripRecord));
+            return snapshots_[db_.shard_of(driver_id)]->get_expenses_by_date_range(driver_id, start_date, end_date);
+        }
 
-            if (trip.trip_id != 0)
+        DatabaseStats get_stats()
+        {
+            DatabaseStats stats;
+            for (unique_ptr<DatabaseShard::Snapshot> &snapshot : snapshots_)
             {
-                stats.total_trips++;
+                DatabaseStats part = snapshot->get_stats();
+                stats.total_drivers += part.total_drivers;
+                stats.active_drivers += part.active_drivers;
+                stats.total_vehicles += part.total_vehicles;
+                stats.total_trips += part.total_trips;
+                stats.total_distance += part.total_distance;
+                stats.total_expenses += part.total_expenses;
+                stats.total_maintenance_records += part.total_maintenance_records;
+                stats.total_documents += part.total_documents;
+                stats.total_incidents += part.total_incidents;
+                stats.database_size += part.database_size;
+                stats.used_space += part.used_space;
+                stats.sealed_blocks += part.sealed_blocks;
+                stats.fragmentation = max(stats.fragmentation, part.fragmentation);
             }
+            return stats;
         }
+    };
 
-        stats.database_size = header_.total_size;
-        stats.used_space = stats.database_size;
-
-        return stats;
+    DatabaseStats get_stats()
+    {
+        Snapshot snapshot(*this);
+        return snapshot.get_stats();
     }
 };
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,3730 @@
+#ifndef DATABASESHARD_H
+#define DATABASESHARD_H
+
+#include "../../include/sdm_types.hpp"
+#include "../../include/sdm_config.hpp"
+#include "../../source/data_structures/HashTable.h"
+#include "../../source/data_structures/SlotBitmap.h"
+#include "../../source/data_structures/BufferPool.h"
+#include "WriteAheadLog.h"
+#include "IndexManager.h"
+#include "TripColumnStore.h"
+#include "TextHeap.h"
+#include "BlockCompressor.h"
+#include "IoRing.h"
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <utility>
+#include <stdexcept>
+#include <iostream>
+#include <memory>
+#include <new>
+#include <atomic>
+#include <mutex>
+#include <shared_mutex>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstdlib>
+#include <ctime>
+#include <cstring>
+#include <cstddef>
+
+using namespace std;
+
+#pragma pack(push, 1)
+struct BackupHeader
+{
+    char magic[8];
+    uint64_t since;
+    uint64_t sequence;
+    uint64_t created_time;
+    uint32_t capacity[7];
+    uint64_t last_id[7];
+};
+
+// One block of slots in a backup stream, followed by packed_size bytes: the
+// records of the slots set in live_mask, whole and in slot order, compressed
+// as one. A block with table BACKUP_END closes the stream and carries the
+// number of blocks written.
+struct BackupBlock
+{
+    uint8_t table;
+    uint32_t block;
+    uint64_t live_mask;
+    uint32_t packed_size;
+};
+#pragma pack(pop)
+
+class DatabaseManager;
+
+// One database file with its heap, log, trip columns and secondary index.
+// DatabaseManager spreads records over one or more of these by driver id.
+class DatabaseShard
+{
+private:
+    friend class DatabaseManager;
+
+    enum TableId
+    {
+        DRIVER_TABLE,
+        VEHICLE_TABLE,
+        TRIP_TABLE,
+        MAINTENANCE_TABLE,
+        EXPENSE_TABLE,
+        DOCUMENT_TABLE,
+        INCIDENT_TABLE,
+        TABLE_COUNT
+    };
+
+    static const uint32_t COMPACTION_STEP = 1024;
+    static const uint32_t COLD_BLOCK_SLOTS = 64;
+    static const uint32_t SNAPSHOT_SCAN_STEP = 4096;
+    static const uint8_t BACKUP_END = 0xFF;
+    static const uint32_t IO_RINGS = 4;
+    static const uint32_t IO_RING_ENTRIES = 64;
+    static const uint32_t FETCH_BATCH = 256;
+    static const uint32_t PARTITION_KEY_BITS = 40;
+    static const uint64_t PARTITION_DRIVER_MASK = (1ULL << PARTITION_KEY_BITS) - 1;
+    static const uint32_t PARTITION_LOOKUP_MONTHS = 36;
+    static const uint64_t MAX_PARTITION_TIME = 253402300799ULL;
+
+    // Log segments with this bit set in their offset are text heap appends
+    static const uint64_t HEAP_LOG_FLAG = 1ULL << 63;
+
+    // Slot form of a record type: the fixed byte ranges back to back,
+    // followed by one HeapRef per text field (offset and capacity in the
+    // record)
+    struct RecordLayout
+    {
+        vector<pair<uint32_t, uint32_t>> fixed;
+        vector<pair<uint32_t, uint32_t>> text;
+        uint32_t text_start;
+        uint32_t stored_size;
+    };
+
+    string filename_;
+    SDMHeader header_;
+    bool is_open_;
+
+    bool use_mmap_;
+    int fd_;
+    uint8_t *map_base_;
+    uint64_t map_size_;
+    uint64_t dirty_begin_;
+    uint64_t dirty_end_;
+
+    // With the log enabled the mapping is private, so changed pages reach
+    // the file only through the log's flusher once their frame is durable
+    bool private_map_;
+
+    // Without a mapping, file reads go through the shared page pool when one
+    // is configured. Writes reaching the file go through the pool to it as
+    // well, so checkpoints and batched ring reads see the same bytes.
+    BufferPool *pool_;
+    uint32_t pool_file_;
+    bool pooled_;
+
+    uint64_t driver_table_start_;
+    uint64_t vehicle_table_start_;
+    uint64_t trip_table_start_;
+    uint64_t maintenance_table_start_;
+    uint64_t expense_table_start_;
+    uint64_t document_table_start_;
+    uint64_t incident_table_start_;
+
+    // One reader-writer lock per table; the slot directory, free map and
+    // header counters of a table are only touched under its exclusive lock.
+    mutable shared_mutex table_locks_[TABLE_COUNT];
+    mutex dirty_mutex_;
+
+    WriteAheadLog wal_;
+    TripColumnStore trip_columns_;
+
+    RecordLayout layouts_[TABLE_COUNT];
+    bool compact_records_;
+    TextHeap heap_;
+
+    // Sealed blocks: COLD_BLOCK_SLOTS consecutive slots compressed into the
+    // heap, found through the cold index (one HeapRef per block, {0, 0} when
+    // not sealed) that is kept in the file and mirrored here
+    struct ColdCache
+    {
+        mutex lock;
+        uint32_t block = UINT32_MAX;
+        vector<uint8_t> data;
+    };
+
+    vector<HeapRef> cold_blocks_[TABLE_COUNT];
+    uint32_t sealed_blocks_[TABLE_COUNT];
+    vector<uint32_t> pending_punches_[TABLE_COUNT];
+    ColdCache cold_cache_[TABLE_COUNT];
+
+    // Submission rings for batched reads in pread mode, each used by one
+    // reader at a time; none are open when the file is mapped
+    bool io_uring_enabled_;
+    IoRing io_rings_[IO_RINGS];
+    mutex io_ring_locks_[IO_RINGS];
+
+    // Free maps of every table as a snapshot saw them, and the stored bytes
+    // of its slots changed since (image_slots gives a slot's image index)
+    struct SnapshotState
+    {
+        uint64_t sequence;
+        uint64_t last_id[TABLE_COUNT];
+        SlotBitmap maps[TABLE_COUNT];
+        uint32_t high_water[TABLE_COUNT];
+        HashTable<uint32_t, uint32_t> image_slots[TABLE_COUNT];
+        vector<uint8_t> images[TABLE_COUNT];
+    };
+
+    // Open snapshots; changed only while every table lock is held shared,
+    // so a mutation can walk it under its own exclusive lock
+    vector<shared_ptr<SnapshotState>> snapshots_;
+    mutex snapshot_mutex_;
+
+    // Change map: for each block of COLD_BLOCK_SLOTS slots, the change
+    // sequence of the last mutation that touched it, kept in the file and
+    // mirrored here. A mutation takes one sequence number for all the
+    // blocks it touches; incremental backups copy blocks stamped after the
+    // previous backup's sequence.
+    vector<uint64_t> change_stamps_[TABLE_COUNT];
+    uint64_t mutation_stamp_[TABLE_COUNT];
+    atomic<uint64_t> change_sequence_;
+
+    // Exclusive table lock for one mutation. Its writes are queued to the log
+    // as a single frame before the lock is released; the caller then waits
+    // for the group commit without blocking the table. A mutation that
+    // succeeded returns finish(), so it reports failure when its frame could
+    // not be made durable.
+    class MutationGuard
+    {
+    private:
+        DatabaseShard &db_;
+        unique_lock<shared_mutex> lock_;
+        WriteAheadLog::Staging staging_;
+        bool finished_;
+        bool durable_;
+
+    public:
+        MutationGuard(DatabaseShard &db, int table)
+            : db_(db), lock_(db.table_locks_[table]), finished_(false), durable_(false)
+        {
+            db_.mutation_stamp_[table] = 0;
+            db_.wal_.begin(staging_);
+            if (table == TRIP_TABLE)
+                db_.trip_columns_.begin_update();
+        }
+
+        ~MutationGuard()
+        {
+            finish();
+        }
+
+        // Commits the mutation and releases the table lock; false when the
+        // log could not make its frame durable
+        bool finish()
+        {
+            if (finished_)
+                return durable_;
+            finished_ = true;
+            uint64_t lsn = db_.wal_.commit(staging_);
+            lock_.unlock();
+            durable_ = db_.wal_.wait_durable(lsn);
+            if (db_.wal_.checkpoint_due())
+                db_.sync();
+            return durable_;
+        }
+
+        // Commits the mutation and releases the table lock without waiting:
+        // for writes that only need to be durable before whatever is logged
+        // after them, which the log's order already guarantees
+        void release()
+        {
+            if (finished_)
+                return;
+            finished_ = true;
+            durable_ = true;
+            db_.wal_.commit(staging_);
+            lock_.unlock();
+        }
+    };
+
+    HashTable<uint64_t, uint32_t> driver_slots_;
+    HashTable<uint64_t, uint32_t> vehicle_slots_;
+    HashTable<uint64_t, uint32_t> trip_slots_;
+    HashTable<uint64_t, uint32_t> expense_slots_;
+    HashTable<uint64_t, uint32_t> incident_slots_;
+
+    SlotBitmap slot_maps_[TABLE_COUNT];
+
+    IndexManager *indexes_;
+
+    void calculate_offsets()
+    {
+        uint64_t current_offset = sizeof(SDMHeader);
+
+        header_.driver_table_offset = current_offset;
+        driver_table_start_ = current_offset;
+        current_offset += static_cast<uint64_t>(header_.max_drivers) * layouts_[DRIVER_TABLE].stored_size;
+
+        header_.vehicle_table_offset = current_offset;
+        vehicle_table_start_ = current_offset;
+        current_offset += static_cast<uint64_t>(header_.max_vehicles) * layouts_[VEHICLE_TABLE].stored_size;
+
+        header_.trip_table_offset = current_offset;
+        trip_table_start_ = current_offset;
+        current_offset += static_cast<uint64_t>(header_.max_trips) * layouts_[TRIP_TABLE].stored_size;
+
+        header_.maintenance_table_offset = current_offset;
+        maintenance_table_start_ = current_offset;
+        current_offset += static_cast<uint64_t>(header_.max_maintenance) * layouts_[MAINTENANCE_TABLE].stored_size;
+
+        header_.expense_table_offset = current_offset;
+        expense_table_start_ = current_offset;
+        current_offset += static_cast<uint64_t>(header_.max_expenses) * layouts_[EXPENSE_TABLE].stored_size;
+
+        header_.document_table_offset = current_offset;
+        document_table_start_ = current_offset;
+        current_offset += static_cast<uint64_t>(header_.max_documents) * layouts_[DOCUMENT_TABLE].stored_size;
+
+        header_.incident_table_offset = current_offset;
+        incident_table_start_ = current_offset;
+        current_offset += static_cast<uint64_t>(header_.max_incidents) * layouts_[INCIDENT_TABLE].stored_size;
+
+        header_.free_map_offset = current_offset;
+        header_.cold_index_offset = free_map_table_offset(TABLE_COUNT);
+        header_.change_map_offset = cold_index_table_offset(TABLE_COUNT);
+        current_offset = change_map_table_offset(TABLE_COUNT);
+
+        header_.total_size = current_offset;
+    }
+
+    bool map_file()
+    {
+        fd_ = ::open(filename_.c_str(), O_RDWR);
+        if (fd_ < 0)
+            return false;
+
+        struct stat st;
+        if (fstat(fd_, &st) != 0 || static_cast<uint64_t>(st.st_size) < sizeof(SDMHeader))
+        {
+            ::close(fd_);
+            fd_ = -1;
+            return false;
+        }
+
+        private_map_ = wal_.is_enabled();
+        void *base = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, private_map_ ? MAP_PRIVATE : MAP_SHARED, fd_, 0);
+        if (base == MAP_FAILED)
+        {
+            ::close(fd_);
+            fd_ = -1;
+            return false;
+        }
+
+        map_base_ = static_cast<uint8_t *>(base);
+        map_size_ = st.st_size;
+        dirty_begin_ = map_size_;
+        dirty_end_ = 0;
+        return true;
+    }
+
+    void close_file()
+    {
+        if (pooled_)
+        {
+            pool_->remove_file(pool_file_);
+            pooled_ = false;
+        }
+        if (map_base_)
+        {
+            munmap(map_base_, map_size_);
+            map_base_ = nullptr;
+            map_size_ = 0;
+            private_map_ = false;
+        }
+        if (fd_ >= 0)
+        {
+            ::close(fd_);
+            fd_ = -1;
+        }
+    }
+
+    bool flush_data()
+    {
+        lock_guard<mutex> lock(dirty_mutex_);
+        if (!map_base_)
+            return fd_ >= 0 && fdatasync(fd_) == 0;
+        if (dirty_end_ <= dirty_begin_)
+            return !private_map_ || fdatasync(fd_) == 0;
+
+        // The file holds every change to a private mapping by now, so its
+        // copied pages are dropped and read back from the file
+        uint64_t page = static_cast<uint64_t>(sysconf(_SC_PAGESIZE));
+        uint64_t begin = dirty_begin_ & ~(page - 1);
+        bool ok = private_map_ ? fdatasync(fd_) == 0 && madvise(map_base_ + begin, dirty_end_ - begin, MADV_DONTNEED) == 0
+                               : msync(map_base_ + begin, dirty_end_ - begin, MS_SYNC) == 0;
+        if (ok)
+        {
+            dirty_begin_ = map_size_;
+            dirty_end_ = 0;
+        }
+        return ok;
+    }
+
+    // Side files derived from the tables are stamped with the checkpoint
+    // they were saved at
+    bool checkpoint()
+    {
+        if (!wal_.drain())
+            return false;
+        header_.checkpoint_count++;
+        write_header_field(header_.checkpoint_count);
+        header_.change_sequence = change_sequence_;
+        write_header_field(header_.change_sequence);
+        if (!flush_data() || !heap_.sync() || (indexes_ && !indexes_->sync()))
+            return false;
+        punch_sealed_blocks();
+        return wal_.truncate() && trip_columns_.save(header_.checkpoint_count);
+    }
+
+    // SDMDB001 files hold whole records in their slots; SDMDB002 files keep
+    // text in the heap file
+    bool known_format() const
+    {
+        string magic(header_.magic, 8);
+        return magic == "SDMDB001" || magic == "SDMDB002";
+    }
+
+    bool replay_log()
+    {
+        int frames = wal_.replay([this](uint64_t offset, const uint8_t *data, uint32_t length)
+                                 {
+                                     if (offset & HEAP_LOG_FLAG)
+                                         return heap_.write(offset & ~HEAP_LOG_FLAG, data, length);
+                                     return write_bytes(offset, data, length);
+                                 });
+        if (frames < 0)
+            return false;
+        if (frames > 0)
+        {
+            cout << "      Replayed " << frames << " log frames" << endl;
+            if (!read_record(0, header_))
+                return false;
+            header_.secondary_index_stale = 1;
+            return write_header_field(header_.secondary_index_stale);
+        }
+        return true;
+    }
+
+    void mark_dirty(uint64_t offset, uint64_t length)
+    {
+        lock_guard<mutex> lock(dirty_mutex_);
+        if (offset < dirty_begin_)
+            dirty_begin_ = offset;
+        if (offset + length > dirty_end_)
+            dirty_end_ = offset + length;
+    }
+
+    bool read_bytes(uint64_t offset, void *data, uint64_t length)
+    {
+        if (map_base_)
+        {
+            if (offset + length > map_size_)
+                return false;
+            memcpy(data, map_base_ + offset, length);
+            return true;
+        }
+
+        shared_lock<shared_mutex> hold = wal_.hold_overlay();
+        if (!read_file(offset, data, length))
+            return false;
+        wal_.overlay(offset, data, length);
+        return true;
+    }
+
+    bool read_file(uint64_t offset, void *data, uint64_t length)
+    {
+        if (pooled_)
+            return pool_->read(pool_file_, offset, data, length);
+
+        uint8_t *out = static_cast<uint8_t *>(data);
+        while (length > 0)
+        {
+            ssize_t n = pread(fd_, out, length, offset);
+            if (n <= 0)
+                return false;
+            out += n;
+            offset += n;
+            length -= n;
+        }
+        return true;
+    }
+
+    // A write staged in the log is left to the flusher; any other write
+    // waits for the frames before it to reach the file first
+    bool write_bytes(uint64_t offset, const void *data, uint64_t length)
+    {
+        bool logged = wal_.stage(offset, data, length);
+        if (!logged && !wal_.drain())
+            return false;
+        if (map_base_)
+        {
+            if (offset + length > map_size_)
+                return false;
+            memcpy(map_base_ + offset, data, length);
+            mark_dirty(offset, length);
+            if (!private_map_ || logged)
+                return true;
+        }
+        else if (logged)
+        {
+            return true;
+        }
+        return write_file(offset, data, length);
+    }
+
+    bool write_file(uint64_t offset, const void *data, uint64_t length)
+    {
+        if (pooled_)
+            return pool_->write(pool_file_, offset, data, length, true);
+
+        const uint8_t *in = static_cast<const uint8_t *>(data);
+        while (length > 0)
+        {
+            ssize_t n = pwrite(fd_, in, length, offset);
+            if (n <= 0)
+                return false;
+            in += n;
+            offset += n;
+            length -= n;
+        }
+        return true;
+    }
+
+    template <typename T>
+    bool read_record(uint64_t offset, T &record)
+    {
+        return read_bytes(offset, static_cast<void *>(&record), sizeof(T));
+    }
+
+    template <typename T>
+    bool write_record(uint64_t offset, const T &record)
+    {
+        return write_bytes(offset, static_cast<const void *>(&record), sizeof(T));
+    }
+
+    // Scans read records in place from the mapping; the stream fallback
+    // copies into scratch instead.
+    template <typename T>
+    const T *view_record(uint64_t offset, T &scratch)
+    {
+        if (map_base_)
+        {
+            if (offset + sizeof(T) > map_size_)
+                return nullptr;
+            return reinterpret_cast<const T *>(map_base_ + offset);
+        }
+        return read_record(offset, scratch) ? &scratch : nullptr;
+    }
+
+    template <typename T, typename M>
+    static pair<uint32_t, uint32_t> field(M T::*member)
+    {
+        static const T sample;
+        const uint8_t *base = reinterpret_cast<const uint8_t *>(&sample);
+        const uint8_t *at = reinterpret_cast<const uint8_t *>(&(sample.*member));
+        return make_pair(static_cast<uint32_t>(at - base), static_cast<uint32_t>(sizeof(M)));
+    }
+
+    // Everything outside the text fields and the dropped range is stored as
+    // is; no text fields gives the legacy layout, a slot holding the record
+    static RecordLayout make_layout(uint32_t record_size, const vector<pair<uint32_t, uint32_t>> &text = {},
+                                    pair<uint32_t, uint32_t> dropped = make_pair(0u, 0u))
+    {
+        RecordLayout layout;
+        layout.text = text;
+
+        vector<pair<uint32_t, uint32_t>> skipped = text;
+        if (dropped.second > 0)
+            skipped.push_back(dropped);
+        sort(skipped.begin(), skipped.end());
+
+        uint32_t position = 0;
+        layout.text_start = 0;
+        for (const auto &range : skipped)
+        {
+            if (range.first > position)
+                layout.fixed.push_back(make_pair(position, range.first - position));
+            position = range.first + range.second;
+        }
+        if (position < record_size)
+            layout.fixed.push_back(make_pair(position, record_size - position));
+
+        for (const auto &range : layout.fixed)
+            layout.text_start += range.second;
+        layout.stored_size = layout.text_start + static_cast<uint32_t>(text.size() * sizeof(HeapRef));
+        return layout;
+    }
+
+    // SDMDB002 keeps text fields of 32 bytes or more in the heap and drops
+    // the reserved padding; short fields such as currency stay inline.
+    void configure_layouts(bool compact)
+    {
+        compact_records_ = compact;
+        if (!compact)
+        {
+            layouts_[DRIVER_TABLE] = make_layout(sizeof(DriverProfile));
+            layouts_[VEHICLE_TABLE] = make_layout(sizeof(VehicleInfo));
+            layouts_[TRIP_TABLE] = make_layout(sizeof(TripRecord));
+            layouts_[MAINTENANCE_TABLE] = make_layout(sizeof(MaintenanceRecord));
+            layouts_[EXPENSE_TABLE] = make_layout(sizeof(ExpenseRecord));
+            layouts_[DOCUMENT_TABLE] = make_layout(sizeof(DocumentMetadata));
+            layouts_[INCIDENT_TABLE] = make_layout(sizeof(IncidentReport));
+            return;
+        }
+
+        layouts_[DRIVER_TABLE] = make_layout(sizeof(DriverProfile),
+                                             {field(&DriverProfile::username), field(&DriverProfile::password_hash),
+                                              field(&DriverProfile::full_name), field(&DriverProfile::email),
+                                              field(&DriverProfile::phone), field(&DriverProfile::license_number)},
+                                             field(&DriverProfile::reserved));
+        layouts_[VEHICLE_TABLE] = make_layout(sizeof(VehicleInfo),
+                                              {field(&VehicleInfo::license_plate), field(&VehicleInfo::make),
+                                               field(&VehicleInfo::model), field(&VehicleInfo::color),
+                                               field(&VehicleInfo::vin), field(&VehicleInfo::insurance_provider),
+                                               field(&VehicleInfo::insurance_policy)},
+                                              field(&VehicleInfo::reserved));
+        layouts_[TRIP_TABLE] = make_layout(sizeof(TripRecord),
+                                           {field(&TripRecord::start_address), field(&TripRecord::end_address),
+                                            field(&TripRecord::notes)},
+                                           field(&TripRecord::reserved));
+        layouts_[MAINTENANCE_TABLE] = make_layout(sizeof(MaintenanceRecord),
+                                                  {field(&MaintenanceRecord::service_center), field(&MaintenanceRecord::technician),
+                                                   field(&MaintenanceRecord::description), field(&MaintenanceRecord::parts_replaced),
+                                                   field(&MaintenanceRecord::notes)},
+                                                  field(&MaintenanceRecord::reserved));
+        layouts_[EXPENSE_TABLE] = make_layout(sizeof(ExpenseRecord),
+                                              {field(&ExpenseRecord::description), field(&ExpenseRecord::fuel_station),
+                                               field(&ExpenseRecord::payment_method), field(&ExpenseRecord::receipt_number),
+                                               field(&ExpenseRecord::notes)},
+                                              field(&ExpenseRecord::reserved));
+        layouts_[DOCUMENT_TABLE] = make_layout(sizeof(DocumentMetadata),
+                                               {field(&DocumentMetadata::filename), field(&DocumentMetadata::mime_type),
+                                                field(&DocumentMetadata::description), field(&DocumentMetadata::tags)},
+                                               field(&DocumentMetadata::reserved));
+        layouts_[INCIDENT_TABLE] = make_layout(sizeof(IncidentReport),
+                                               {field(&IncidentReport::location_address), field(&IncidentReport::description),
+                                                field(&IncidentReport::police_report_number), field(&IncidentReport::insurance_claim_number),
+                                                field(&IncidentReport::other_party_info), field(&IncidentReport::witness_info),
+                                                field(&IncidentReport::notes)},
+                                               field(&IncidentReport::reserved));
+    }
+
+    bool heap_append(const void *data, uint32_t length, uint64_t &offset)
+    {
+        offset = heap_.reserve(length);
+        wal_.stage(HEAP_LOG_FLAG | offset, data, length);
+        return heap_.write(offset, data, length);
+    }
+
+    // Packs a record into its slot form. Text equal to what the slot's
+    // previous contents refer to keeps that heap reference; the remaining
+    // text is appended to the heap in one write.
+    template <typename T>
+    bool encode_record(int table, const T &record, uint8_t *stored, const uint8_t *previous)
+    {
+        const RecordLayout &layout = layouts_[table];
+        const uint8_t *bytes = reinterpret_cast<const uint8_t *>(&record);
+        for (const auto &range : layout.fixed)
+        {
+            memcpy(stored, bytes + range.first, range.second);
+            stored += range.second;
+        }
+
+        string appended;
+        vector<size_t> appended_fields;
+        for (size_t f = 0; f < layout.text.size(); f++)
+        {
+            const char *text = reinterpret_cast<const char *>(bytes + layout.text[f].first);
+            HeapRef ref = {0, static_cast<uint32_t>(strnlen(text, layout.text[f].second))};
+            HeapRef old = {0, 0};
+            if (previous)
+                memcpy(&old, previous + layout.text_start + f * sizeof(HeapRef), sizeof(HeapRef));
+
+            if (ref.length > 0 && heap_.equals(old, text, ref.length))
+            {
+                ref = old;
+            }
+            else if (ref.length > 0)
+            {
+                ref.offset = appended.size();
+                appended.append(text, ref.length);
+                appended_fields.push_back(f);
+            }
+            memcpy(stored + f * sizeof(HeapRef), &ref, sizeof(HeapRef));
+        }
+        if (appended.empty())
+            return true;
+
+        uint64_t base;
+        if (!heap_append(appended.data(), appended.size(), base))
+            return false;
+
+        for (size_t f : appended_fields)
+        {
+            HeapRef ref;
+            memcpy(&ref, stored + f * sizeof(HeapRef), sizeof(HeapRef));
+            ref.offset += base;
+            memcpy(stored + f * sizeof(HeapRef), &ref, sizeof(HeapRef));
+        }
+        return true;
+    }
+
+    // Without text the text fields are left empty, which saves the heap
+    // reads for scans that only need numbers
+    template <typename T>
+    bool decode_record(int table, const uint8_t *stored, T &record, bool with_text = true)
+    {
+        const RecordLayout &layout = layouts_[table];
+        uint8_t *bytes = reinterpret_cast<uint8_t *>(&record);
+        if (compact_records_)
+            memset(bytes, 0, sizeof(T));
+        for (const auto &range : layout.fixed)
+        {
+            memcpy(bytes + range.first, stored, range.second);
+            stored += range.second;
+        }
+
+        for (size_t f = 0; with_text && f < layout.text.size(); f++)
+        {
+            HeapRef ref;
+            memcpy(&ref, stored + f * sizeof(HeapRef), sizeof(HeapRef));
+            if (ref.length > layout.text[f].second || !heap_.read(ref, bytes + layout.text[f].first))
+                return false;
+        }
+        return true;
+    }
+
+    uint64_t slot_offset(int table, uint32_t slot) const
+    {
+        return table_start(table) + static_cast<uint64_t>(slot) * layouts_[table].stored_size;
+    }
+
+    template <typename T>
+    bool read_slot(int table, uint32_t slot, T &record)
+    {
+        if (!compact_records_)
+            return read_record(slot_offset(table, slot), record);
+
+        uint8_t stored[sizeof(T)];
+        return read_stored(table, slot, stored) && decode_record(table, stored, record);
+    }
+
+    template <typename T>
+    bool write_slot(int table, uint32_t slot, const T &record)
+    {
+        note_change(table, slot);
+        if (!compact_records_)
+            return write_record(slot_offset(table, slot), record);
+
+        uint8_t previous[sizeof(T)];
+        uint8_t stored[sizeof(T)];
+        uint64_t offset = slot_offset(table, slot);
+        uint32_t size = layouts_[table].stored_size;
+        return ensure_unsealed(table, slot) && read_bytes(offset, previous, size) &&
+               encode_record(table, record, stored, previous) && write_bytes(offset, stored, size);
+    }
+
+    // Compact records are decoded into scratch, straight from the mapping
+    // when there is one
+    template <typename T>
+    const T *view_slot(int table, uint32_t slot, T &scratch)
+    {
+        uint64_t offset = slot_offset(table, slot);
+        if (!compact_records_)
+            return view_record(offset, scratch);
+        if (!map_base_ || is_sealed(table, slot))
+            return read_slot(table, slot, scratch) ? &scratch : nullptr;
+        if (offset + layouts_[table].stored_size > map_size_)
+            return nullptr;
+        return decode_record(table, map_base_ + offset, scratch) ? &scratch : nullptr;
+    }
+
+    // Stops at the first ring the kernel refuses, so a missing or disabled
+    // io_uring leaves every read on pread
+    void open_io_rings()
+    {
+        for (uint32_t r = 0; io_uring_enabled_ && !map_base_ && compact_records_ && r < IO_RINGS; r++)
+        {
+            if (!io_rings_[r].open(IO_RING_ENTRIES))
+                break;
+        }
+    }
+
+    // Reads the records in slots and hands each one to visit(index, record);
+    // slots that fail to read are skipped. With a free ring the stored bytes
+    // of FETCH_BATCH slots are submitted together, then all their text, so a
+    // history page costs two waits instead of a pread per slot and field.
+    template <typename T, typename Visit>
+    void fetch_slots(int table, const vector<uint32_t> &slots, Visit visit)
+    {
+        unique_lock<mutex> ring_lock;
+        IoRing *ring = nullptr;
+        for (uint32_t r = 0; r < IO_RINGS && !ring; r++)
+        {
+            if (!io_rings_[r].is_open())
+                break;
+            ring_lock = unique_lock<mutex>(io_ring_locks_[r], try_to_lock);
+            if (ring_lock.owns_lock())
+                ring = &io_rings_[r];
+        }
+
+        T scratch;
+        if (!ring)
+        {
+            for (size_t i = 0; i < slots.size(); i++)
+            {
+                const T *record = view_slot(table, slots[i], scratch);
+                if (record)
+                    visit(i, *record);
+            }
+            return;
+        }
+
+        const RecordLayout &layout = layouts_[table];
+        uint32_t size = layout.stored_size;
+        vector<uint8_t> stored;
+        vector<T> records;
+        vector<bool> valid;
+        vector<IoRing::Read> reads;
+        for (size_t begin = 0; begin < slots.size(); begin += FETCH_BATCH)
+        {
+            size_t count = min<size_t>(FETCH_BATCH, slots.size() - begin);
+            stored.resize(count * size);
+            valid.assign(count, true);
+            reads.clear();
+            for (size_t i = 0; i < count; i++)
+            {
+                uint32_t slot = slots[begin + i];
+                if (is_sealed(table, slot))
+                    valid[i] = read_stored(table, slot, &stored[i * size]);
+                else
+                    reads.push_back({fd_, slot_offset(table, slot), &stored[i * size], size});
+            }
+            bool ok;
+            {
+                shared_lock<shared_mutex> hold = wal_.hold_overlay();
+                ok = ring->read_all(reads);
+                for (const IoRing::Read &read : reads)
+                {
+                    wal_.overlay(read.offset, read.data, read.length);
+                }
+            }
+
+            records.resize(count);
+            reads.clear();
+            for (size_t i = 0; ok && i < count; i++)
+            {
+                if (!valid[i] || !decode_record(table, &stored[i * size], records[i], false))
+                {
+                    valid[i] = false;
+                    continue;
+                }
+                uint8_t *bytes = reinterpret_cast<uint8_t *>(&records[i]);
+                for (size_t f = 0; f < layout.text.size(); f++)
+                {
+                    HeapRef ref;
+                    memcpy(&ref, &stored[i * size + layout.text_start + f * sizeof(HeapRef)], sizeof(HeapRef));
+                    if (ref.length > layout.text[f].second)
+                        valid[i] = false;
+                    else if (ref.length > 0)
+                        reads.push_back({heap_.fd(), ref.offset, bytes + layout.text[f].first, ref.length});
+                }
+            }
+            ok = ok && ring->read_all(reads);
+
+            for (size_t i = 0; i < count; i++)
+            {
+                if (!ok)
+                {
+                    const T *record = view_slot(table, slots[begin + i], scratch);
+                    if (record)
+                        visit(begin + i, *record);
+                }
+                else if (valid[i])
+                {
+                    visit(begin + i, records[i]);
+                }
+            }
+        }
+    }
+
+    uint32_t cold_block_count(int table) const
+    {
+        return (table_capacity(table) + COLD_BLOCK_SLOTS - 1) / COLD_BLOCK_SLOTS;
+    }
+
+    uint32_t cold_block_slots(int table, uint32_t block) const
+    {
+        return min(COLD_BLOCK_SLOTS, table_capacity(table) - block * COLD_BLOCK_SLOTS);
+    }
+
+    // The cold index stores one HeapRef per block of every table back to
+    // back. Passing TABLE_COUNT gives the region end.
+    uint64_t cold_index_table_offset(int table) const
+    {
+        uint64_t offset = header_.cold_index_offset;
+        for (int t = 0; t < table; t++)
+        {
+            offset += static_cast<uint64_t>(cold_block_count(t)) * sizeof(HeapRef);
+        }
+        return offset;
+    }
+
+    uint64_t change_map_table_offset(int table) const
+    {
+        uint64_t offset = header_.change_map_offset;
+        for (int t = 0; t < table; t++)
+        {
+            offset += static_cast<uint64_t>(cold_block_count(t)) * sizeof(uint64_t);
+        }
+        return offset;
+    }
+
+    // The sequence resumes after the highest stamp or checkpointed value, so
+    // it never goes back past a backup taken before a restart
+    void load_change_map()
+    {
+        uint64_t sequence = header_.change_sequence;
+        for (int t = 0; t < TABLE_COUNT; t++)
+        {
+            change_stamps_[t].clear();
+            mutation_stamp_[t] = 0;
+            if (header_.change_map_offset == 0)
+                continue;
+
+            change_stamps_[t].assign(cold_block_count(t), 0);
+            read_bytes(change_map_table_offset(t), change_stamps_[t].data(), change_stamps_[t].size() * sizeof(uint64_t));
+            for (uint64_t stamp : change_stamps_[t])
+                sequence = max(sequence, stamp);
+        }
+        change_sequence_ = sequence;
+    }
+
+    void load_cold_index()
+    {
+        for (int t = 0; t < TABLE_COUNT; t++)
+        {
+            cold_blocks_[t].clear();
+            sealed_blocks_[t] = 0;
+            cold_cache_[t].block = UINT32_MAX;
+            pending_punches_[t].clear();
+            if (!compact_records_ || header_.cold_index_offset == 0)
+                continue;
+
+            cold_blocks_[t].assign(cold_block_count(t), HeapRef{0, 0});
+            read_bytes(cold_index_table_offset(t), cold_blocks_[t].data(), cold_blocks_[t].size() * sizeof(HeapRef));
+            for (const HeapRef &ref : cold_blocks_[t])
+            {
+                if (ref.length != 0)
+                    sealed_blocks_[t]++;
+            }
+        }
+    }
+
+    bool is_sealed(int table, uint32_t slot) const
+    {
+        return sealed_blocks_[table] > 0 && cold_blocks_[table][slot / COLD_BLOCK_SLOTS].length != 0;
+    }
+
+    bool load_cold_block(int table, uint32_t block, vector<uint8_t> &data)
+    {
+        const HeapRef &ref = cold_blocks_[table][block];
+        vector<uint8_t> packed(ref.length);
+        data.resize(static_cast<size_t>(cold_block_slots(table, block)) * layouts_[table].stored_size);
+        return heap_.read(ref, packed.data()) &&
+               BlockCompressor::decompress(packed.data(), packed.size(), data.data(), data.size());
+    }
+
+    // Copies a slot's stored bytes, out of its decompressed block when sealed.
+    // Readers share one cached block per table.
+    bool read_stored(int table, uint32_t slot, uint8_t *stored)
+    {
+        uint32_t size = layouts_[table].stored_size;
+        if (!is_sealed(table, slot))
+            return read_bytes(slot_offset(table, slot), stored, size);
+
+        ColdCache &cache = cold_cache_[table];
+        lock_guard<mutex> lock(cache.lock);
+        uint32_t block = slot / COLD_BLOCK_SLOTS;
+        if (cache.block != block)
+        {
+            cache.block = UINT32_MAX;
+            if (!load_cold_block(table, block, cache.data))
+                return false;
+            cache.block = block;
+        }
+        memcpy(stored, cache.data.data() + static_cast<size_t>(slot % COLD_BLOCK_SLOTS) * size, size);
+        return true;
+    }
+
+    // Compresses one block into the heap if every slot in it holds a live
+    // record older than cutoff. The slots keep their bytes until the next
+    // checkpoint, when the compressed copy is durable.
+    template <typename T>
+    bool seal_block(int table, uint32_t block, uint64_t cutoff)
+    {
+        uint32_t first = block * COLD_BLOCK_SLOTS;
+        uint32_t count = cold_block_slots(table, block);
+        if (cold_blocks_[table][block].length != 0)
+            return false;
+
+        T record;
+        for (uint32_t slot = first; slot < first + count; slot++)
+        {
+            if (!slot_maps_[table].test(slot) || !read_slot(table, slot, record) ||
+                !is_live(record) || record_time(record) >= cutoff)
+                return false;
+        }
+
+        vector<uint8_t> raw(static_cast<size_t>(count) * layouts_[table].stored_size);
+        vector<uint8_t> packed;
+        if (!read_bytes(slot_offset(table, first), raw.data(), raw.size()))
+            return false;
+        BlockCompressor::compress(raw.data(), raw.size(), packed);
+        if (packed.size() > raw.size() / 2)
+            return false;
+
+        HeapRef ref = {0, static_cast<uint32_t>(packed.size())};
+        if (!heap_append(packed.data(), ref.length, ref.offset) ||
+            !write_record(cold_index_table_offset(table) + block * sizeof(HeapRef), ref))
+            return false;
+
+        cold_blocks_[table][block] = ref;
+        sealed_blocks_[table]++;
+        pending_punches_[table].push_back(block);
+        return true;
+    }
+
+    // Writes a sealed block back to its slots ahead of a change to one of
+    // them; the restored bytes and the cleared index entry share the
+    // mutation's log frame
+    bool ensure_unsealed(int table, uint32_t slot)
+    {
+        if (!is_sealed(table, slot))
+            return true;
+
+        uint32_t block = slot / COLD_BLOCK_SLOTS;
+        vector<uint8_t> data;
+        HeapRef none = {0, 0};
+        if (!load_cold_block(table, block, data) ||
+            !write_bytes(slot_offset(table, block * COLD_BLOCK_SLOTS), data.data(), data.size()) ||
+            !write_record(cold_index_table_offset(table) + block * sizeof(HeapRef), none))
+            return false;
+
+        cold_blocks_[table][block] = none;
+        sealed_blocks_[table]--;
+        lock_guard<mutex> lock(cold_cache_[table].lock);
+        cold_cache_[table].block = UINT32_MAX;
+        return true;
+    }
+
+    // Called under the table's exclusive lock before a slot's stored bytes
+    // change (write_slot, batch creation, compaction moves and partition
+    // drops): open snapshots keep the old bytes and the slot's block is
+    // stamped in the change map
+    void note_change(int table, uint32_t slot)
+    {
+        preserve_slot(table, slot);
+        if (change_stamps_[table].empty())
+            return;
+
+        if (mutation_stamp_[table] == 0)
+            mutation_stamp_[table] = ++change_sequence_;
+        uint32_t block = slot / COLD_BLOCK_SLOTS;
+        if (change_stamps_[table][block] == mutation_stamp_[table])
+            return;
+        change_stamps_[table][block] = mutation_stamp_[table];
+        write_record(change_map_table_offset(table) + block * sizeof(uint64_t), mutation_stamp_[table]);
+    }
+
+    // Keeps the current stored bytes of a slot for every open snapshot that
+    // saw a record there and has no image of it yet. Heap text is never
+    // rewritten, so the references inside an image stay readable.
+    void preserve_slot(int table, uint32_t slot)
+    {
+        uint32_t size = layouts_[table].stored_size;
+        for (const shared_ptr<SnapshotState> &state : snapshots_)
+        {
+            uint32_t image;
+            if (!state->maps[table].test(slot) || state->image_slots[table].get(slot, image))
+                continue;
+
+            vector<uint8_t> &images = state->images[table];
+            size_t at = images.size();
+            images.resize(at + size);
+            if (read_stored(table, slot, &images[at]))
+                state->image_slots[table].insert(slot, static_cast<uint32_t>(at / size));
+            else
+                images.resize(at);
+        }
+    }
+
+    void register_snapshot(const shared_ptr<SnapshotState> &state)
+    {
+        shared_lock<shared_mutex> locks[TABLE_COUNT];
+        for (int t = 0; t < TABLE_COUNT; t++)
+        {
+            locks[t] = shared_lock<shared_mutex>(table_locks_[t]);
+            state->maps[t] = slot_maps_[t];
+            state->high_water[t] = header_.table_high_water[t];
+            state->last_id[t] = header_.table_last_id[t];
+        }
+        state->sequence = change_sequence_;
+        lock_guard<mutex> lock(snapshot_mutex_);
+        snapshots_.push_back(state);
+    }
+
+    void unregister_snapshot(const shared_ptr<SnapshotState> &state)
+    {
+        shared_lock<shared_mutex> locks[TABLE_COUNT];
+        for (int t = 0; t < TABLE_COUNT; t++)
+        {
+            locks[t] = shared_lock<shared_mutex>(table_locks_[t]);
+        }
+        lock_guard<mutex> lock(snapshot_mutex_);
+        snapshots_.erase(remove(snapshots_.begin(), snapshots_.end(), state), snapshots_.end());
+    }
+
+    // Visits the live records a snapshot saw in one table. The table's shared
+    // lock is held for SNAPSHOT_SCAN_STEP slots at a time, so writers get in
+    // between; slots they changed are read from the snapshot's images.
+    // Reads a slot as a snapshot saw it; the caller holds the table's
+    // shared lock and has checked the slot is set in the snapshot's map
+    template <typename T>
+    bool read_snapshot_slot(const SnapshotState &state, int table, uint32_t slot, T &record, bool with_text = true)
+    {
+        uint32_t size = layouts_[table].stored_size;
+        uint32_t image;
+        if (state.image_slots[table].get(slot, image))
+            return decode_record(table, state.images[table].data() + static_cast<size_t>(image) * size, record, with_text);
+
+        uint8_t stored[sizeof(T)];
+        return read_stored(table, slot, stored) && decode_record(table, stored, record, with_text);
+    }
+
+    template <typename T, typename Visit>
+    void scan_snapshot(const SnapshotState &state, int table, bool with_text, Visit visit)
+    {
+        const SlotBitmap &map = state.maps[table];
+        T record;
+        uint32_t slot = 0;
+        bool more = true;
+        while (more)
+        {
+            shared_lock<shared_mutex> lock(table_locks_[table]);
+            if (!is_open_)
+                return;
+
+            for (uint32_t n = 0; n < SNAPSHOT_SCAN_STEP; n++, slot++)
+            {
+                more = map.next_used(slot);
+                if (!more)
+                    break;
+
+                if (read_snapshot_slot(state, table, slot, record, with_text) && is_live(record))
+                    visit(record);
+            }
+        }
+    }
+
+    // Runs inside a checkpoint once the heap and the cold index are durable.
+    // Filesystems without hole punching keep the bytes; reads still go to
+    // the compressed copy.
+    void punch_sealed_blocks()
+    {
+        for (int t = 0; t < TABLE_COUNT; t++)
+        {
+            for (uint32_t block : pending_punches_[t])
+            {
+                if (cold_blocks_[t][block].length == 0)
+                    continue;
+                uint64_t length = static_cast<uint64_t>(cold_block_slots(t, block)) * layouts_[t].stored_size;
+                fallocate(fd_, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                          slot_offset(t, block * COLD_BLOCK_SLOTS), length);
+                if (pooled_)
+                    pool_->discard(pool_file_, slot_offset(t, block * COLD_BLOCK_SLOTS), length);
+            }
+            pending_punches_[t].clear();
+        }
+    }
+
+    // One mutation per candidate block; candidates are picked under the
+    // shared lock so the scan does not hold writers off
+    template <typename T>
+    uint32_t seal_table(int table, uint64_t cutoff)
+    {
+        vector<uint32_t> candidates;
+        {
+            shared_lock<shared_mutex> lock(table_locks_[table]);
+            if (!is_open_ || cold_blocks_[table].empty())
+                return 0;
+
+            uint32_t blocks = (header_.table_high_water[table] + COLD_BLOCK_SLOTS - 1) / COLD_BLOCK_SLOTS;
+            T scratch;
+            for (uint32_t block = 0; block < blocks; block++)
+            {
+                uint32_t first = block * COLD_BLOCK_SLOTS;
+                uint32_t last = first + cold_block_slots(table, block) - 1;
+                if (cold_blocks_[table][block].length != 0 || !slot_maps_[table].test(first) ||
+                    !slot_maps_[table].test(last))
+                    continue;
+                const T *r = view_slot(table, last, scratch);
+                if (r && is_live(*r) && record_time(*r) < cutoff)
+                    candidates.push_back(block);
+            }
+        }
+
+        uint32_t sealed = 0;
+        for (uint32_t block : candidates)
+        {
+            MutationGuard guard(*this, table);
+            if (is_open_ && seal_block<T>(table, block, cutoff) && guard.finish())
+                sealed++;
+        }
+        return sealed;
+    }
+
+    uint64_t table_start(int table) const
+    {
+        switch (table)
+        {
+        case DRIVER_TABLE:
+            return driver_table_start_;
+        case VEHICLE_TABLE:
+            return vehicle_table_start_;
+        case TRIP_TABLE:
+            return trip_table_start_;
+        case MAINTENANCE_TABLE:
+            return maintenance_table_start_;
+        case EXPENSE_TABLE:
+            return expense_table_start_;
+        case DOCUMENT_TABLE:
+            return document_table_start_;
+        default:
+            return incident_table_start_;
+        }
+    }
+
+    uint32_t table_capacity(int table) const
+    {
+        switch (table)
+        {
+        case DRIVER_TABLE:
+            return header_.max_drivers;
+        case VEHICLE_TABLE:
+            return header_.max_vehicles;
+        case TRIP_TABLE:
+            return header_.max_trips;
+        case MAINTENANCE_TABLE:
+            return header_.max_maintenance;
+        case EXPENSE_TABLE:
+            return header_.max_expenses;
+        case DOCUMENT_TABLE:
+            return header_.max_documents;
+        default:
+            return header_.max_incidents;
+        }
+    }
+
+    // The free map region stores one bitmap per table back to back, each
+    // padded to whole 64-bit words. Passing TABLE_COUNT gives the region end.
+    uint64_t free_map_table_offset(int table) const
+    {
+        uint64_t offset = header_.free_map_offset;
+        for (int t = 0; t < table; t++)
+        {
+            offset += ((static_cast<uint64_t>(table_capacity(t)) + 63) / 64) * sizeof(uint64_t);
+        }
+        return offset;
+    }
+
+    bool persist_slot_word(int table, uint32_t slot)
+    {
+        if (header_.free_map_offset == 0)
+            return true;
+
+        const uint64_t &word = slot_maps_[table].word(slot / 64);
+        return write_record(free_map_table_offset(table) + (slot / 64) * sizeof(uint64_t), word);
+    }
+
+    template <typename T>
+    bool write_header_field(const T &field)
+    {
+        uint64_t offset = reinterpret_cast<const uint8_t *>(&field) - reinterpret_cast<const uint8_t *>(&header_);
+        return write_record(offset, field);
+    }
+
+    bool raise_high_water(int table, uint32_t slot)
+    {
+        if (slot < header_.table_high_water[table])
+            return true;
+
+        header_.table_high_water[table] = slot + 1;
+        return write_header_field(header_.table_high_water[table]);
+    }
+
+    uint32_t record_count(int table) const
+    {
+        shared_lock<shared_mutex> lock(table_locks_[table]);
+        return header_.table_record_count[table];
+    }
+
+    bool update_record_count(int table)
+    {
+        if (header_.table_record_count[table] == slot_maps_[table].used())
+            return true;
+
+        header_.table_record_count[table] = slot_maps_[table].used();
+        return write_header_field(header_.table_record_count[table]);
+    }
+
+    // Keeps the sequence ahead of ids supplied by callers or found on disk
+    void observe_id(int table, uint64_t id)
+    {
+        if (id <= header_.table_last_id[table])
+            return;
+
+        header_.table_last_id[table] = id;
+        write_header_field(header_.table_last_id[table]);
+    }
+
+    // Keeps this file's sequence ahead of an id taken for a record that went
+    // to another shard
+    void reserve_id(int table, uint64_t id)
+    {
+        {
+            shared_lock<shared_mutex> lock(table_locks_[table]);
+            if (id <= header_.table_last_id[table])
+                return;
+        }
+        MutationGuard guard(*this, table);
+        observe_id(table, id);
+        guard.release();
+    }
+
+    // Records the file's place in a sharded database, or checks it against
+    // the one recorded
+    bool claim_shard(uint32_t count, uint32_t index)
+    {
+        if (header_.shard_count == 0)
+        {
+            MutationGuard guard(*this, DRIVER_TABLE);
+            header_.shard_count = count;
+            header_.shard_index = index;
+            return write_header_field(header_.shard_count) && write_header_field(header_.shard_index) &&
+                   guard.finish();
+        }
+        return header_.shard_count == count && header_.shard_index == index;
+    }
+
+    // Lets shards backed up together agree on a starting point for the next
+    // incremental backup
+    void raise_change_sequence(uint64_t sequence)
+    {
+        uint64_t current = change_sequence_;
+        if (current >= sequence)
+            return;
+
+        MutationGuard guard(*this, DRIVER_TABLE);
+        while (current < sequence && !change_sequence_.compare_exchange_weak(current, sequence))
+        {
+        }
+        header_.change_sequence = change_sequence_;
+        write_header_field(header_.change_sequence);
+        guard.finish();
+    }
+
+    // Reserves count consecutive ids and returns the first one. A record
+    // given one of them is logged after the sequence, so the sequence need
+    // not be waited for.
+    uint64_t advance_sequence(int table, uint32_t count = 1)
+    {
+        if (!is_open_ || count == 0)
+            return 0;
+
+        MutationGuard guard(*this, table);
+        uint64_t first = header_.table_last_id[table] + 1;
+        header_.table_last_id[table] += count;
+        write_header_field(header_.table_last_id[table]);
+        guard.release();
+        return first;
+    }
+
+    bool allocate_slot(int table, uint32_t &slot)
+    {
+        if (slot_maps_[table].full() || !slot_maps_[table].allocate(slot))
+            return false;
+
+        if (!persist_slot_word(table, slot) || !raise_high_water(table, slot))
+        {
+            slot_maps_[table].release(slot);
+            return false;
+        }
+        update_record_count(table);
+        return true;
+    }
+
+    // Allocates count slots in ascending order, persisting each touched free
+    // map word once; fails without allocating if the table lacks room.
+    bool allocate_slots(int table, size_t count, vector<uint32_t> &slots)
+    {
+        SlotBitmap &map = slot_maps_[table];
+        if (map.capacity() - map.used() < count)
+            return false;
+
+        slots.clear();
+        slots.reserve(count);
+        uint32_t slot;
+        while (slots.size() < count && map.allocate(slot))
+        {
+            slots.push_back(slot);
+        }
+
+        bool ok = slots.size() == count;
+        for (size_t i = 0; ok && i < slots.size(); i++)
+        {
+            if (i == 0 || slots[i] / 64 != slots[i - 1] / 64)
+                ok = persist_slot_word(table, slots[i]);
+        }
+        ok = ok && raise_high_water(table, slots.back());
+
+        if (!ok)
+        {
+            for (uint32_t s : slots)
+                release_slot(table, s);
+            return false;
+        }
+        update_record_count(table);
+        return true;
+    }
+
+    void release_slot(int table, uint32_t slot)
+    {
+        slot_maps_[table].release(slot);
+        persist_slot_word(table, slot);
+        update_record_count(table);
+    }
+
+    static bool is_live(const DriverProfile &r) { return r.is_active == 1; }
+    static bool is_live(const VehicleInfo &r) { return r.is_active == 1; }
+    static bool is_live(const TripRecord &r) { return r.trip_id != 0; }
+    static bool is_live(const MaintenanceRecord &r) { return r.maintenance_id != 0; }
+    static bool is_live(const ExpenseRecord &r) { return r.expense_id != 0; }
+    static bool is_live(const DocumentMetadata &r) { return r.document_id != 0; }
+    static bool is_live(const IncidentReport &r) { return r.incident_id != 0; }
+
+    static uint64_t record_id(const DriverProfile &r) { return r.driver_id; }
+    static uint64_t record_id(const VehicleInfo &r) { return r.vehicle_id; }
+    static uint64_t record_id(const TripRecord &r) { return r.trip_id; }
+    static uint64_t record_id(const MaintenanceRecord &r) { return r.maintenance_id; }
+    static uint64_t record_id(const ExpenseRecord &r) { return r.expense_id; }
+    static uint64_t record_id(const DocumentMetadata &r) { return r.document_id; }
+    static uint64_t record_id(const IncidentReport &r) { return r.incident_id; }
+
+    // Age of a record for sealing cold ranges
+    static uint64_t record_time(const VehicleInfo &r) { return r.created_time; }
+    static uint64_t record_time(const TripRecord &r) { return r.start_time; }
+    static uint64_t record_time(const ExpenseRecord &r) { return r.expense_date; }
+    static uint64_t record_time(const IncidentReport &r) { return r.incident_time; }
+
+    // A record's entries in the secondary index
+    struct IndexEntry
+    {
+        uint8_t index_type;
+        uint64_t key;
+        uint64_t record_id;
+
+        bool operator==(const IndexEntry &other) const
+        {
+            return index_type == other.index_type && key == other.key && record_id == other.record_id;
+        }
+    };
+
+    static vector<IndexEntry> index_entries(const DriverProfile &) { return {}; }
+    static vector<IndexEntry> index_entries(const VehicleInfo &) { return {}; }
+    static vector<IndexEntry> index_entries(const DocumentMetadata &) { return {}; }
+
+    static vector<IndexEntry> index_entries(const TripRecord &r)
+    {
+        return {{IndexManager::TRIPS_BY_DRIVER, r.driver_id, r.trip_id},
+                {IndexManager::TRIPS_BY_MONTH, partition_key(partition_of(r.start_time), r.driver_id), r.trip_id}};
+    }
+
+    static vector<IndexEntry> index_entries(const MaintenanceRecord &r)
+    {
+        return {{IndexManager::MAINTENANCE_BY_VEHICLE, r.vehicle_id, r.maintenance_id}};
+    }
+
+    static vector<IndexEntry> index_entries(const ExpenseRecord &r)
+    {
+        return {{IndexManager::EXPENSES_BY_DRIVER, r.driver_id, r.expense_id},
+                {IndexManager::EXPENSES_BY_MONTH, partition_key(partition_of(r.expense_date), r.driver_id), r.expense_id}};
+    }
+
+    static vector<IndexEntry> index_entries(const IncidentReport &r)
+    {
+        return {{IndexManager::INCIDENTS_BY_DRIVER, r.driver_id, r.incident_id},
+                {IndexManager::INCIDENTS_BY_VEHICLE, r.vehicle_id, r.incident_id}};
+    }
+
+    void set_columns(const TripRecord &r, uint32_t slot) { trip_columns_.set(slot, r); }
+    template <typename T>
+    void set_columns(const T &, uint32_t) {}
+
+    // Secondary index and trip column maintenance; called under the table's
+    // exclusive lock after a record is written to its slot
+    template <typename T>
+    void index_record(const T &r, uint32_t slot, bool fresh = false)
+    {
+        set_columns(r, slot);
+        if (!indexes_)
+            return;
+        for (const IndexEntry &entry : index_entries(r))
+        {
+            indexes_->insert_secondary(entry.index_type, entry.key, entry.record_id, slot, fresh);
+        }
+    }
+
+    // Removes the entries of a record leaving slot, or, when replacement is
+    // the record overwriting it, only the entries the replacement lacks
+    template <typename T>
+    void unindex_record(const T &r, uint32_t slot, const T *replacement = nullptr)
+    {
+        if (!indexes_)
+            return;
+        vector<IndexEntry> kept;
+        if (replacement)
+            kept = index_entries(*replacement);
+        for (const IndexEntry &entry : index_entries(r))
+        {
+            if (find(kept.begin(), kept.end(), entry) == kept.end())
+                indexes_->remove_secondary(entry.index_type, entry.key, entry.record_id, slot);
+        }
+    }
+
+    template <typename T>
+    void reindex_table(int table, bool fresh = true)
+    {
+        T scratch;
+        for (uint32_t i = 0; slot_maps_[table].next_used(i); i++)
+        {
+            const T *r = view_slot(table, i, scratch);
+            if (r && is_live(*r))
+                index_record(*r, i, fresh);
+        }
+    }
+
+    template <typename T>
+    void collect_primary(int table, uint8_t entity_type, vector<pair<CompositeKey, BTreeValue>> &entries)
+    {
+        shared_lock<shared_mutex> lock(table_locks_[table]);
+        T scratch;
+        for (uint32_t i = 0; slot_maps_[table].next_used(i); i++)
+        {
+            const T *r = view_slot(table, i, scratch);
+            if (r && is_live(*r))
+                entries.push_back(IndexManager::primary_entry(entity_type, record_id(*r), record_time(*r)));
+        }
+    }
+
+    // Months of trips and expenses, keyed with the driver so one driver's
+    // share of a month is a single key and a whole month a single key range
+    static uint64_t partition_key(uint32_t partition, uint64_t driver_id)
+    {
+        return (static_cast<uint64_t>(partition) << PARTITION_KEY_BITS) | (driver_id & PARTITION_DRIVER_MASK);
+    }
+
+    static uint32_t key_partition(uint64_t key)
+    {
+        return static_cast<uint32_t>(key >> PARTITION_KEY_BITS);
+    }
+
+    // Records in [start_time, end_time] found through the month partitions,
+    // for one driver or for all drivers. Only the months the range overlaps
+    // are visited; entries are checked against the record's current month,
+    // so a record whose date moved is reported once. Caller holds the
+    // table's shared lock.
+    template <typename T>
+    vector<T> lookup_partitions(int table, uint8_t index_type, uint64_t driver_id, bool all_drivers,
+                                uint64_t start_time, uint64_t end_time)
+    {
+        uint32_t first = partition_of(start_time);
+        uint32_t last = partition_of(end_time);
+        vector<SecondaryEntry> entries;
+        if (all_drivers)
+        {
+            entries = indexes_->lookup_secondary_range(index_type, partition_key(first, 0),
+                                                       partition_key(last, PARTITION_DRIVER_MASK));
+        }
+        else
+        {
+            for (uint32_t p = first; p <= last; p++)
+            {
+                vector<SecondaryEntry> month = indexes_->lookup_secondary(index_type, partition_key(p, driver_id));
+                entries.insert(entries.end(), month.begin(), month.end());
+            }
+        }
+
+        vector<SecondaryEntry> used;
+        vector<uint32_t> slots;
+        for (const SecondaryEntry &entry : entries)
+        {
+            if (!slot_maps_[table].test(entry.slot))
+                continue;
+            used.push_back(entry);
+            slots.push_back(entry.slot);
+        }
+
+        vector<T> results;
+        fetch_slots<T>(table, slots,
+                       [&](size_t i, const T &r)
+                       {
+                           if (is_live(r) && record_id(r) == used[i].record_id &&
+                               partition_of(record_time(r)) == key_partition(used[i].key) &&
+                               (all_drivers || r.driver_id == driver_id) &&
+                               record_time(r) >= start_time && record_time(r) <= end_time)
+                               results.push_back(r);
+                       });
+        return results;
+    }
+
+    // Full scan for date ranges when no index is attached
+    template <typename T>
+    vector<T> scan_date_range(int table, uint64_t driver_id, uint64_t start_time, uint64_t end_time)
+    {
+        vector<T> results;
+        T scratch;
+        for (uint32_t i = 0; slot_maps_[table].next_used(i); i++)
+        {
+            const T *r = view_slot(table, i, scratch);
+            if (r && is_live(*r) && r->driver_id == driver_id &&
+                record_time(*r) >= start_time && record_time(*r) <= end_time)
+                results.push_back(*r);
+        }
+        return results;
+    }
+
+    // Deletes every record of one month, COMPACTION_STEP records per
+    // mutation. The slots are zeroed like compaction leaves them. The id and
+    // time of each record dropped are added to removed when given, for the
+    // primary index kept outside the shard.
+    template <typename T>
+    uint64_t drop_partition(int table, HashTable<uint64_t, uint32_t> *directory, uint8_t index_type, uint32_t partition,
+                            vector<pair<uint64_t, uint64_t>> *removed)
+    {
+        vector<uint32_t> slots;
+        {
+            shared_lock<shared_mutex> lock(table_locks_[table]);
+            if (!is_open_)
+                return 0;
+            if (indexes_)
+            {
+                for (const SecondaryEntry &entry : indexes_->lookup_secondary_range(
+                         index_type, partition_key(partition, 0), partition_key(partition, PARTITION_DRIVER_MASK)))
+                    slots.push_back(entry.slot);
+                sort(slots.begin(), slots.end());
+                slots.erase(unique(slots.begin(), slots.end()), slots.end());
+            }
+            else
+            {
+                for (uint32_t i = 0; slot_maps_[table].next_used(i); i++)
+                    slots.push_back(i);
+            }
+        }
+
+        uint64_t dropped = 0;
+        vector<uint8_t> cleared(layouts_[table].stored_size, 0);
+        for (size_t begin = 0; begin < slots.size(); begin += COMPACTION_STEP)
+        {
+            MutationGuard guard(*this, table);
+            if (!is_open_)
+                break;
+
+            size_t end = min(slots.size(), begin + COMPACTION_STEP);
+            uint64_t step = 0;
+            T record;
+            for (size_t i = begin; i < end; i++)
+            {
+                uint32_t slot = slots[i];
+                if (!slot_maps_[table].test(slot) || !read_slot(table, slot, record) || !is_live(record) ||
+                    partition_of(record_time(record)) != partition)
+                    continue;
+                note_change(table, slot);
+                if (!ensure_unsealed(table, slot) || !write_bytes(slot_offset(table, slot), cleared.data(), cleared.size()))
+                    break;
+
+                if (directory)
+                    directory->remove(record_id(record));
+                unindex_record(record, slot);
+                release_slot(table, slot);
+                if (table == TRIP_TABLE)
+                    trip_columns_.clear(slot);
+                if (removed)
+                    removed->push_back(make_pair(record_id(record), record_time(record)));
+                step++;
+            }
+            if (!guard.finish())
+                break;
+            dropped += step;
+        }
+        return dropped;
+    }
+
+    // Deletes one record by id; used when an update moves it to another
+    // shard. The slot is zeroed like drop_partition leaves it.
+    template <typename T>
+    bool remove_record(int table, HashTable<uint64_t, uint32_t> *directory, uint64_t id)
+    {
+        MutationGuard guard(*this, table);
+        uint32_t slot;
+        T record;
+        if (!is_open_ || !directory->get(id, slot) || !read_slot(table, slot, record) ||
+            !is_live(record) || record_id(record) != id)
+            return false;
+
+        vector<uint8_t> cleared(layouts_[table].stored_size, 0);
+        note_change(table, slot);
+        if (!ensure_unsealed(table, slot) || !write_bytes(slot_offset(table, slot), cleared.data(), cleared.size()))
+            return false;
+
+        directory->remove(id);
+        unindex_record(record, slot);
+        release_slot(table, slot);
+        if (table == TRIP_TABLE)
+            trip_columns_.clear(slot);
+        return guard.finish();
+    }
+
+    // Records reachable from the secondary index under one foreign key, in
+    // record id order. Each entry is checked against its slot (match must
+    // re-test the key), so stale entries cost a read but never show up in
+    // the result. Caller holds the table's shared lock; limit is SIZE_MAX
+    // for all records.
+    template <typename T, typename Match>
+    vector<T> lookup_indexed(int table, uint8_t index_type, uint64_t key, size_t limit, Match match)
+    {
+        vector<T> results;
+        vector<uint32_t> slots;
+        vector<uint64_t> ids;
+        uint64_t from_id = 0;
+        uint32_t from_slot = 0;
+        while (results.size() < limit)
+        {
+            size_t wanted = limit - results.size();
+            vector<SecondaryEntry> entries = indexes_->lookup_secondary(index_type, key, from_id, from_slot, wanted);
+            slots.clear();
+            ids.clear();
+            for (const SecondaryEntry &entry : entries)
+            {
+                if (!slot_maps_[table].test(entry.slot))
+                    continue;
+                slots.push_back(entry.slot);
+                ids.push_back(entry.record_id);
+            }
+            fetch_slots<T>(table, slots,
+                           [&](size_t i, const T &r)
+                           {
+                               if (is_live(r) && record_id(r) == ids[i] && match(r))
+                                   results.push_back(r);
+                           });
+
+            if (entries.size() < wanted)
+                break;
+            from_id = entries.back().record_id;
+            from_slot = entries.back().slot + 1;
+        }
+        return results;
+    }
+
+    void rebuild_trip_columns()
+    {
+        TripRecord scratch;
+        for (uint32_t i = 0; slot_maps_[TRIP_TABLE].next_used(i); i++)
+        {
+            const TripRecord *trip = view_slot(TRIP_TABLE, i, scratch);
+            if (trip && is_live(*trip))
+                trip_columns_.set(i, *trip);
+        }
+    }
+
+    static void accumulate_trip(const TripRecord &trip, TripTotals &totals)
+    {
+        totals.trip_count++;
+        totals.total_distance += trip.distance;
+        totals.total_duration += trip.duration;
+        totals.total_fuel += trip.fuel_consumed;
+        totals.harsh_events += trip.harsh_braking_count + trip.rapid_acceleration_count +
+                               trip.speeding_count + trip.sharp_turn_count;
+        if (trip.max_speed > totals.max_speed)
+            totals.max_speed = trip.max_speed;
+    }
+
+    // Moves up to max_moves live records from the end of the table into its
+    // lowest free slots, then lowers the high-water mark. Slot directory,
+    // free map, secondary index and trip columns are updated in the same
+    // mutation. Returns the number of records moved.
+    template <typename T>
+    uint32_t compact_table(int table, HashTable<uint64_t, uint32_t> *directory, uint32_t max_moves)
+    {
+        SlotBitmap &map = slot_maps_[table];
+        uint32_t stored_size = layouts_[table].stored_size;
+        vector<uint8_t> cleared(stored_size, 0);
+        vector<uint8_t> stored(stored_size);
+        uint32_t moved = 0;
+        uint32_t hole = 0;
+        uint32_t last = header_.table_high_water[table];
+        while (moved < max_moves && map.next_free(hole) && map.prev_used(last) && hole < last)
+        {
+            // The slot bytes move as they are, so heap references carry over
+            T record;
+            uint64_t from = slot_offset(table, last);
+            uint64_t to = slot_offset(table, hole);
+            if (!read_stored(table, last, stored.data()) || !decode_record(table, stored.data(), record) ||
+                !ensure_unsealed(table, hole) || !ensure_unsealed(table, last))
+                break;
+            note_change(table, hole);
+            if (!write_bytes(to, stored.data(), stored_size))
+                break;
+
+            map.set(hole);
+            persist_slot_word(table, hole);
+            if (directory)
+                directory->insert(record_id(record), hole);
+            index_record(record, hole, true);
+            unindex_record(record, last);
+
+            note_change(table, last);
+            write_bytes(from, cleared.data(), cleared.size());
+            release_slot(table, last);
+            if (table == TRIP_TABLE)
+                trip_columns_.clear(last);
+            moved++;
+        }
+
+        uint32_t top = header_.table_high_water[table];
+        uint32_t high_water = map.prev_used(top) ? top + 1 : 0;
+        if (high_water != header_.table_high_water[table])
+        {
+            header_.table_high_water[table] = high_water;
+            write_header_field(header_.table_high_water[table]);
+        }
+        return moved;
+    }
+
+    // Each step is one mutation holding the table lock for at most
+    // COMPACTION_STEP moves, so other requests interleave with compaction
+    template <typename T>
+    uint64_t compact_online(int table, HashTable<uint64_t, uint32_t> *directory)
+    {
+        uint64_t total = 0;
+        uint32_t moved;
+        do
+        {
+            MutationGuard guard(*this, table);
+            if (!is_open_)
+                break;
+            moved = compact_table<T>(table, directory, COMPACTION_STEP);
+            if (!guard.finish())
+                break;
+            total += moved;
+        } while (moved == COMPACTION_STEP);
+        return total;
+    }
+
+    // Loads the table's free map (or derives it by a full scan for files
+    // created before the map existed), then walks only the used slots to
+    // fill the id directory and drop bits left behind by an interrupted write.
+    // The high-water mark is raised to cover every used slot found.
+    template <typename T>
+    void rebuild_table(int table, HashTable<uint64_t, uint32_t> *directory)
+    {
+        SlotBitmap &map = slot_maps_[table];
+        map.reset(table_capacity(table));
+        if (directory)
+            directory->clear();
+
+        T scratch;
+        if (header_.free_map_offset != 0)
+        {
+            read_bytes(free_map_table_offset(table), map.data(), map.word_count() * sizeof(uint64_t));
+            map.refresh();
+        }
+        else
+        {
+            for (uint32_t i = 0; i < map.capacity(); i++)
+            {
+                const T *r = view_slot(table, i, scratch);
+                if (!r)
+                    break;
+                if (is_live(*r))
+                {
+                    map.set(i);
+                    raise_high_water(table, i);
+                }
+            }
+        }
+
+        for (uint32_t i = 0; map.next_used(i); i++)
+        {
+            raise_high_water(table, i);
+            const T *r = view_slot(table, i, scratch);
+            uint32_t existing;
+            if (r && is_live(*r) && !(directory && directory->get(record_id(*r), existing)))
+            {
+                observe_id(table, record_id(*r));
+                if (directory)
+                    directory->insert(record_id(*r), i);
+            }
+            else
+            {
+                // Not live, or the older copy of a record whose compaction
+                // move was interrupted before its source slot was cleared
+                release_slot(table, i);
+            }
+        }
+        update_record_count(table);
+    }
+
+    // Writes records into freshly allocated slots; runs of adjacent slots go
+    // to disk as one contiguous write instead of one write per record.
+    template <typename T>
+    bool create_batch(int table, const vector<T> &records, HashTable<uint64_t, uint32_t> *directory)
+    {
+        if (!is_open_)
+            return false;
+        if (records.empty())
+            return true;
+
+        vector<uint32_t> slots;
+        if (!allocate_slots(table, records.size(), slots))
+            return false;
+
+        size_t begin = 0;
+        while (begin < slots.size())
+        {
+            size_t end = begin + 1;
+            while (end < slots.size() && slots[end] == slots[end - 1] + 1)
+                end++;
+
+            uint32_t stored_size = layouts_[table].stored_size;
+            vector<uint8_t> stored((end - begin) * stored_size);
+            bool ok = true;
+            for (size_t i = begin; ok && i < end; i++)
+            {
+                note_change(table, slots[i]);
+                ok = ensure_unsealed(table, slots[i]) &&
+                     encode_record(table, records[i], &stored[(i - begin) * stored_size], nullptr);
+            }
+
+            if (!ok || !write_bytes(slot_offset(table, slots[begin]), stored.data(), stored.size()))
+            {
+                for (uint32_t slot : slots)
+                    release_slot(table, slot);
+                return false;
+            }
+            begin = end;
+        }
+
+        uint64_t max_id = 0;
+        for (size_t i = 0; i < records.size(); i++)
+        {
+            if (directory)
+                directory->insert(record_id(records[i]), slots[i]);
+            index_record(records[i], slots[i], true);
+            max_id = max(max_id, record_id(records[i]));
+        }
+        observe_id(table, max_id);
+        return true;
+    }
+
+    // Appends every live record of source's table in slot order, keeping
+    // record ids
+    template <typename T>
+    bool copy_table(DatabaseShard &source, int table, HashTable<uint64_t, uint32_t> *directory)
+    {
+        vector<T> records;
+        T scratch;
+        for (uint32_t i = 0; source.slot_maps_[table].next_used(i); i++)
+        {
+            const T *r = source.view_slot(table, i, scratch);
+            if (!r)
+                return false;
+            if (!is_live(*r))
+                continue;
+
+            records.push_back(*r);
+            if (records.size() == COMPACTION_STEP)
+            {
+                if (!create_batch(table, records, directory))
+                    return false;
+                records.clear();
+            }
+        }
+        return create_batch(table, records, directory);
+    }
+
+    static bool write_fully(int fd, const void *data, size_t length)
+    {
+        const uint8_t *in = static_cast<const uint8_t *>(data);
+        while (length > 0)
+        {
+            ssize_t n = ::write(fd, in, length);
+            if (n <= 0)
+                return false;
+            in += n;
+            length -= n;
+        }
+        return true;
+    }
+
+    static bool read_fully(int fd, void *data, size_t length)
+    {
+        uint8_t *out = static_cast<uint8_t *>(data);
+        while (length > 0)
+        {
+            ssize_t n = ::read(fd, out, length);
+            if (n <= 0)
+                return false;
+            out += n;
+            length -= n;
+        }
+        return true;
+    }
+
+    // Streams the blocks of one table a snapshot saw. A full backup skips
+    // blocks without records; an incremental one writes every block stamped
+    // after since, empty or not, so a restore also drops deleted records.
+    // Each block is read under the table's shared lock on its own.
+    template <typename T>
+    bool backup_table(const SnapshotState &state, int table, uint64_t since, int fd, uint32_t &written)
+    {
+        uint32_t blocks = since == 0 ? (state.high_water[table] + COLD_BLOCK_SLOTS - 1) / COLD_BLOCK_SLOTS
+                                     : cold_block_count(table);
+        vector<uint8_t> raw;
+        vector<uint8_t> packed;
+        T record;
+        for (uint32_t block = 0; block < blocks; block++)
+        {
+            BackupBlock entry = {static_cast<uint8_t>(table), block, 0, 0};
+            raw.clear();
+            {
+                shared_lock<shared_mutex> lock(table_locks_[table]);
+                if (!is_open_)
+                    return false;
+                if (since != 0 && !change_stamps_[table].empty() && change_stamps_[table][block] <= since)
+                    continue;
+
+                uint32_t first = block * COLD_BLOCK_SLOTS;
+                for (uint32_t i = 0; i < cold_block_slots(table, block); i++)
+                {
+                    if (!state.maps[table].test(first + i) ||
+                        !read_snapshot_slot(state, table, first + i, record) || !is_live(record))
+                        continue;
+                    entry.live_mask |= 1ULL << i;
+                    const uint8_t *bytes = reinterpret_cast<const uint8_t *>(&record);
+                    raw.insert(raw.end(), bytes, bytes + sizeof(T));
+                }
+            }
+            if (since == 0 && entry.live_mask == 0)
+                continue;
+
+            BlockCompressor::compress(raw.data(), raw.size(), packed);
+            entry.packed_size = static_cast<uint32_t>(packed.size());
+            if (!write_fully(fd, &entry, sizeof(entry)) || !write_fully(fd, packed.data(), packed.size()))
+                return false;
+            written++;
+        }
+        return true;
+    }
+
+    // Makes a block's slots match a backup block: records no longer there
+    // are removed and the backup's records written to their original slots.
+    // Runs offline, on a database no one else has open.
+    template <typename T>
+    bool restore_block(int table, HashTable<uint64_t, uint32_t> *directory, const BackupBlock &entry,
+                       const vector<uint8_t> &packed)
+    {
+        uint32_t first = entry.block * COLD_BLOCK_SLOTS;
+        uint32_t count = cold_block_slots(table, entry.block);
+        if (count < 64 && (entry.live_mask >> count) != 0)
+            return false;
+
+        vector<uint8_t> raw(static_cast<size_t>(__builtin_popcountll(entry.live_mask)) * sizeof(T));
+        if (!BlockCompressor::decompress(packed.data(), packed.size(), raw.data(), raw.size()))
+            return false;
+
+        vector<uint8_t> cleared(layouts_[table].stored_size, 0);
+        const uint8_t *next = raw.data();
+        T record;
+        for (uint32_t i = 0; i < count; i++)
+        {
+            uint32_t slot = first + i;
+            if (slot_maps_[table].test(slot))
+            {
+                // A record moved by compaction may already sit in its new slot
+                uint32_t current;
+                if (read_slot(table, slot, record) && directory &&
+                    directory->get(record_id(record), current) && current == slot)
+                    directory->remove(record_id(record));
+                if (!ensure_unsealed(table, slot) || !write_bytes(slot_offset(table, slot), cleared.data(), cleared.size()))
+                    return false;
+                release_slot(table, slot);
+            }
+            if (!(entry.live_mask & (1ULL << i)))
+                continue;
+
+            memcpy(static_cast<void *>(&record), next, sizeof(T));
+            next += sizeof(T);
+            slot_maps_[table].set(slot);
+            if (!persist_slot_word(table, slot) || !raise_high_water(table, slot) || !write_slot(table, slot, record))
+                return false;
+            update_record_count(table);
+            observe_id(table, record_id(record));
+            if (directory)
+                directory->insert(record_id(record), slot);
+        }
+        return true;
+    }
+
+    // Applies the blocks of a backup stream positioned after its header
+    bool apply_backup(int fd)
+    {
+        BackupBlock entry;
+        vector<uint8_t> packed;
+        uint32_t blocks = 0;
+        while (read_fully(fd, &entry, sizeof(entry)))
+        {
+            if (entry.table == BACKUP_END)
+                return entry.block == blocks;
+            if (entry.table >= TABLE_COUNT || entry.block >= cold_block_count(entry.table))
+                return false;
+
+            packed.resize(entry.packed_size);
+            if (!read_fully(fd, packed.data(), packed.size()))
+                return false;
+
+            bool ok;
+            switch (entry.table)
+            {
+            case DRIVER_TABLE:
+                ok = restore_block<DriverProfile>(DRIVER_TABLE, &driver_slots_, entry, packed);
+                break;
+            case VEHICLE_TABLE:
+                ok = restore_block<VehicleInfo>(VEHICLE_TABLE, &vehicle_slots_, entry, packed);
+                break;
+            case TRIP_TABLE:
+                ok = restore_block<TripRecord>(TRIP_TABLE, &trip_slots_, entry, packed);
+                break;
+            case MAINTENANCE_TABLE:
+                ok = restore_block<MaintenanceRecord>(MAINTENANCE_TABLE, nullptr, entry, packed);
+                break;
+            case EXPENSE_TABLE:
+                ok = restore_block<ExpenseRecord>(EXPENSE_TABLE, &expense_slots_, entry, packed);
+                break;
+            case DOCUMENT_TABLE:
+                ok = restore_block<DocumentMetadata>(DOCUMENT_TABLE, nullptr, entry, packed);
+                break;
+            default:
+                ok = restore_block<IncidentReport>(INCIDENT_TABLE, &incident_slots_, entry, packed);
+                break;
+            }
+            if (!ok)
+                return false;
+            blocks++;
+        }
+        return false;
+    }
+
+    void rebuild_slot_directories()
+    {
+        rebuild_table<DriverProfile>(DRIVER_TABLE, &driver_slots_);
+        rebuild_table<VehicleInfo>(VEHICLE_TABLE, &vehicle_slots_);
+        rebuild_table<TripRecord>(TRIP_TABLE, &trip_slots_);
+        rebuild_table<MaintenanceRecord>(MAINTENANCE_TABLE, nullptr);
+        rebuild_table<ExpenseRecord>(EXPENSE_TABLE, &expense_slots_);
+        rebuild_table<DocumentMetadata>(DOCUMENT_TABLE, nullptr);
+        rebuild_table<IncidentReport>(INCIDENT_TABLE, &incident_slots_);
+    }
+
+public:
+    DatabaseShard(const string &filename, bool use_mmap = true)
+        : filename_(filename), is_open_(false), use_mmap_(use_mmap), fd_(-1),
+          map_base_(nullptr), map_size_(0), dirty_begin_(0), dirty_end_(0), private_map_(false),
+          pool_(nullptr), pool_file_(0), pooled_(false), compact_records_(false), io_uring_enabled_(true),
+          change_sequence_(0), indexes_(nullptr)
+    {
+        configure_layouts(false);
+        for (int t = 0; t < TABLE_COUNT; t++)
+        {
+            sealed_blocks_[t] = 0;
+            mutation_stamp_[t] = 0;
+        }
+        wal_.set_apply([this](uint64_t offset, const uint8_t *data, uint32_t length)
+                       { return (offset & HEAP_LOG_FLAG) || write_file(offset, data, length); });
+    }
+
+    bool isOpen()
+    {
+        return is_open_;
+    }
+
+    ~DatabaseShard()
+    {
+        close();
+    }
+    bool create(const SDMConfig &config)
+    {
+        close();
+        unlink((filename_ + ".wal").c_str());
+        unlink((filename_ + ".cols").c_str());
+
+        cout << "      Creating database: " << filename_ << endl;
+
+        size_t last_slash = filename_.find_last_of('/');
+        if (last_slash != string::npos)
+        {
+            string directory = filename_.substr(0, last_slash);
+            struct stat st;
+            if (stat(directory.c_str(), &st) != 0)
+            {
+                cout << "      Creating directory: " << directory << endl;
+                string cmd = "mkdir -p \"" + directory + "\"";
+                if (system(cmd.c_str()) != 0)
+                {
+                    cerr << "      ERROR: Failed to create directory!" << endl;
+                }
+            }
+        }
+
+        header_ = SDMHeader();
+        header_.created_time = get_current_timestamp();
+        header_.last_modified = header_.created_time;
+        header_.max_drivers = config.max_drivers;
+        header_.max_vehicles = config.max_vehicles;
+        header_.max_trips = config.max_trips;
+        header_.max_maintenance = config.max_maintenance;
+        header_.max_expenses = config.max_expenses;
+        header_.max_documents = config.max_documents;
+        header_.max_incidents = config.max_incidents;
+        memcpy(header_.magic, "SDMDB002", 8);
+
+        configure_layouts(true);
+        calculate_offsets();
+
+        // Size the file with ftruncate so empty slots are zero-filled holes
+        // rather than records written one by one.
+        int fd = ::open(filename_.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0)
+        {
+            cerr << "      ERROR: Cannot create file: " << filename_ << endl;
+            return false;
+        }
+
+        // Laundered so gcc does not take the header for its first field
+        const SDMHeader *header = launder(&header_);
+        bool ok = ftruncate(fd, header_.total_size) == 0 &&
+                  pwrite(fd, header, sizeof(SDMHeader), 0) == static_cast<ssize_t>(sizeof(SDMHeader));
+        ::close(fd);
+        if (!ok || !TextHeap::create(filename_ + ".heap"))
+        {
+            cerr << "      ERROR: Cannot size file: " << filename_ << endl;
+            return false;
+        }
+
+        cout << "      Database created (" << (header_.total_size / 1024 / 1024) << " MB)" << endl;
+
+        return true;
+    }
+    bool open()
+    {
+        if (use_mmap_ && map_file())
+        {
+            memcpy(static_cast<void *>(&header_), map_base_, sizeof(SDMHeader));
+            if (!known_format() || header_.total_size > map_size_)
+            {
+                close_file();
+                return false;
+            }
+        }
+        else
+        {
+            fd_ = ::open(filename_.c_str(), O_RDWR);
+            if (fd_ < 0)
+            {
+                return false;
+            }
+            if (pool_)
+            {
+                pool_file_ = pool_->add_file(fd_);
+                pooled_ = true;
+            }
+
+            if (!read_record(0, header_) || !known_format())
+            {
+                close_file();
+                return false;
+            }
+        }
+
+        configure_layouts(string(header_.magic, 8) == "SDMDB002");
+        if ((compact_records_ && !heap_.open(filename_ + ".heap", use_mmap_)) ||
+            !wal_.open(filename_ + ".wal") || !replay_log())
+        {
+            heap_.close();
+            close_file();
+            return false;
+        }
+
+        driver_table_start_ = header_.driver_table_offset;
+        vehicle_table_start_ = header_.vehicle_table_offset;
+        trip_table_start_ = header_.trip_table_offset;
+        maintenance_table_start_ = header_.maintenance_table_offset;
+        expense_table_start_ = header_.expense_table_offset;
+        document_table_start_ = header_.document_table_offset;
+        incident_table_start_ = header_.incident_table_offset;
+
+        if (header_.max_incidents == 0)
+        {
+            SDMHeader defaults;
+            header_.max_maintenance = defaults.max_maintenance;
+            header_.max_expenses = defaults.max_expenses;
+            header_.max_documents = defaults.max_documents;
+            header_.max_incidents = defaults.max_incidents;
+        }
+
+        load_cold_index();
+        load_change_map();
+        rebuild_slot_directories();
+        open_io_rings();
+
+        bool columns_valid = false;
+        if (trip_columns_.open(filename_ + ".cols", table_capacity(TRIP_TABLE),
+                               header_.checkpoint_count, columns_valid) && !columns_valid)
+        {
+            rebuild_trip_columns();
+        }
+
+        checkpoint();
+        is_open_ = true;
+        return true;
+    }
+
+    void close()
+    {
+        if (!is_open_)
+            return;
+
+        header_.last_modified = get_current_timestamp();
+        write_record(0, header_);
+        sync();
+
+        wal_.close();
+        trip_columns_.close();
+        for (IoRing &ring : io_rings_)
+            ring.close();
+        heap_.close();
+        close_file();
+        is_open_ = false;
+    }
+
+    // Checkpoint: forces the database file to disk and restarts the log.
+    // Mutations are already durable once their log frame is synced.
+    bool sync()
+    {
+        unique_lock<shared_mutex> locks[TABLE_COUNT];
+        for (int t = 0; t < TABLE_COUNT; t++)
+        {
+            locks[t] = unique_lock<shared_mutex>(table_locks_[t]);
+        }
+        return checkpoint();
+    }
+
+    bool is_memory_mapped() const { return map_base_ != nullptr; }
+
+    void configure_wal(bool enabled, uint32_t group_commit_ms, uint32_t group_commit_bytes)
+    {
+        wal_.configure(enabled, group_commit_ms, group_commit_bytes);
+    }
+
+    // Only takes effect in pread mode, at the next open
+    void configure_io(bool use_io_uring)
+    {
+        io_uring_enabled_ = use_io_uring;
+    }
+
+    // Page pool for pread mode, taking effect at the next open; it must
+    // outlive the database
+    void configure_buffer_pool(BufferPool *pool)
+    {
+        pool_ = pool;
+    }
+
+    // Routes foreign-key queries through the secondary index. An empty index
+    // (new, or from before secondary indexes existed) is built from the
+    // tables, as is one left stale by log replay.
+    void attach_indexes(IndexManager *indexes)
+    {
+        unique_lock<shared_mutex> locks[TABLE_COUNT];
+        for (int t = 0; t < TABLE_COUNT; t++)
+        {
+            locks[t] = unique_lock<shared_mutex>(table_locks_[t]);
+        }
+
+        indexes_ = indexes;
+        if (!indexes_ || !is_open_)
+            return;
+
+        // Also the case after a restore or migration, which drop the index
+        if (indexes_->get_secondary_record_count() == 0 || header_.secondary_index_stale)
+        {
+            indexes_->begin_secondary_load();
+            reindex_table<TripRecord>(TRIP_TABLE);
+            reindex_table<MaintenanceRecord>(MAINTENANCE_TABLE);
+            reindex_table<ExpenseRecord>(EXPENSE_TABLE);
+            reindex_table<IncidentReport>(INCIDENT_TABLE);
+            if (indexes_->finish_secondary_load() && header_.secondary_index_stale)
+            {
+                header_.secondary_index_stale = 0;
+                write_header_field(header_.secondary_index_stale);
+            }
+            return;
+        }
+
+        // Indexes from before month partitions existed
+        if (slot_maps_[TRIP_TABLE].used() > 0 &&
+            indexes_->lookup_secondary_range(IndexManager::TRIPS_BY_MONTH, 0, UINT64_MAX, 1).empty())
+            reindex_table<TripRecord>(TRIP_TABLE, false);
+        if (slot_maps_[EXPENSE_TABLE].used() > 0 &&
+            indexes_->lookup_secondary_range(IndexManager::EXPENSES_BY_MONTH, 0, UINT64_MAX, 1).empty())
+            reindex_table<ExpenseRecord>(EXPENSE_TABLE, false);
+    }
+
+    bool create_driver(const DriverProfile &driver)
+    {
+        MutationGuard guard(*this, DRIVER_TABLE);
+        if (!is_open_)
+            return false;
+
+        uint32_t slot;
+        if (!allocate_slot(DRIVER_TABLE, slot))
+            return false;
+
+        if (!write_slot(DRIVER_TABLE, slot, driver))
+        {
+            release_slot(DRIVER_TABLE, slot);
+            return false;
+        }
+        observe_id(DRIVER_TABLE, record_id(driver));
+        driver_slots_.insert(driver.driver_id, slot);
+        return guard.finish();
+    }
+
+    bool read_driver(uint64_t driver_id, DriverProfile &driver)
+    {
+        shared_lock<shared_mutex> lock(table_locks_[DRIVER_TABLE]);
+        if (!is_open_)
+            return false;
+
+        memset(&driver, 0, sizeof(DriverProfile));
+        uint32_t slot;
+        if (driver_id == 0 || !driver_slots_.get(driver_id, slot))
+            return false;
+
+        return read_slot(DRIVER_TABLE, slot, driver) && driver.driver_id == driver_id && driver.is_active == 1;
+    }
+
+    bool update_driver(const DriverProfile &driver)
+    {
+        MutationGuard guard(*this, DRIVER_TABLE);
+        if (!is_open_)
+            return false;
+
+        uint32_t slot;
+        if (!driver_slots_.get(driver.driver_id, slot))
+            return false;
+
+        DriverProfile existing;
+        if (!read_slot(DRIVER_TABLE, slot, existing) || existing.is_active != 1 || existing.driver_id != driver.driver_id)
+            return false;
+
+        return write_slot(DRIVER_TABLE, slot, driver) && guard.finish();
+    }
+
+    bool delete_driver(uint64_t driver_id)
+    {
+        MutationGuard guard(*this, DRIVER_TABLE);
+        if (!is_open_)
+            return false;
+
+        uint32_t slot;
+        if (!driver_slots_.get(driver_id, slot))
+            return false;
+
+        DriverProfile driver;
+        if (!read_slot(DRIVER_TABLE, slot, driver) || driver.is_active != 1 || driver.driver_id != driver_id)
+            return false;
+
+        driver.is_active = 0;
+        if (!write_slot(DRIVER_TABLE, slot, driver))
+            return false;
+        driver_slots_.remove(driver_id);
+        release_slot(DRIVER_TABLE, slot);
+        return guard.finish();
+    }
+    bool update_expense(const ExpenseRecord &expense)
+    {
+        MutationGuard guard(*this, EXPENSE_TABLE);
+        if (!is_open_)
+            return false;
+
+        uint32_t slot;
+        if (!expense_slots_.get(expense.expense_id, slot))
+            return false;
+
+        ExpenseRecord existing;
+        if (!read_slot(EXPENSE_TABLE, slot, existing) || existing.expense_id != expense.expense_id)
+            return false;
+
+        if (!write_slot(EXPENSE_TABLE, slot, expense))
+            return false;
+        unindex_record(existing, slot, &expense);
+        index_record(expense, slot);
+        return guard.finish();
+    }
+
+    bool delete_expense(uint64_t expense_id)
+    {
+        MutationGuard guard(*this, EXPENSE_TABLE);
+        if (!is_open_)
+            return false;
+
+        uint32_t slot;
+        if (!expense_slots_.get(expense_id, slot))
+            return false;
+
+        ExpenseRecord expense;
+        if (!read_slot(EXPENSE_TABLE, slot, expense) || expense.expense_id != expense_id)
+            return false;
+
+        unindex_record(expense, slot);
+        expense.expense_id = 0;
+        if (!write_slot(EXPENSE_TABLE, slot, expense))
+            return false;
+        expense_slots_.remove(expense_id);
+        release_slot(EXPENSE_TABLE, slot);
+        return guard.finish();
+    }
+    
+    bool read_expense(uint64_t expense_id, ExpenseRecord &expense)
+    {
+        shared_lock<shared_mutex> lock(table_locks_[EXPENSE_TABLE]);
+        if (!is_open_)
+            return false;
+
+        memset(&expense, 0, sizeof(ExpenseRecord));
+        uint32_t slot;
+        if (expense_id == 0 || !expense_slots_.get(expense_id, slot))
+            return false;
+
+        return read_slot(EXPENSE_TABLE, slot, expense) && expense.expense_id == expense_id;
+    }
+    vector<VehicleInfo> get_all_vehicles()
+    {
+        vector<VehicleInfo> vehicles;
+        shared_lock<shared_mutex> lock(table_locks_[VEHICLE_TABLE]);
+        if (!is_open_)
+            return vehicles;
+
+        VehicleInfo scratch;
+
+        for (uint32_t i = 0; slot_maps_[VEHICLE_TABLE].next_used(i); i++)
+        {
+            const VehicleInfo *vehicle = view_slot(VEHICLE_TABLE, i, scratch);
+            if (!vehicle)
+                break;
+
+            if (vehicle->is_active == 1)
+            {
+                vehicles.push_back(*vehicle);
+            }
+        }
+        return vehicles;
+    }
+
+    // Entries of the primary index for the vehicles, trips and expenses
+    // held here
+    void collect_primary_entries(vector<pair<CompositeKey, BTreeValue>> &entries)
+    {
+        if (!is_open_)
+            return;
+        collect_primary<VehicleInfo>(VEHICLE_TABLE, 2, entries);
+        collect_primary<TripRecord>(TRIP_TABLE, 3, entries);
+        collect_primary<ExpenseRecord>(EXPENSE_TABLE, 4, entries);
+    }
+
+    bool lookup_indexes_stale() const { return header_.lookup_indexes_stale != 0; }
+
+    void clear_lookup_indexes_stale()
+    {
+        if (!header_.lookup_indexes_stale)
+            return;
+        header_.lookup_indexes_stale = 0;
+        write_header_field(header_.lookup_indexes_stale);
+    }
+
+    vector<DriverProfile> get_all_drivers()
+    {
+        vector<DriverProfile> drivers;
+        shared_lock<shared_mutex> lock(table_locks_[DRIVER_TABLE]);
+        if (!is_open_)
+            return drivers;
+
+        DriverProfile scratch;
+
+        for (uint32_t i = 0; slot_maps_[DRIVER_TABLE].next_used(i); i++)
+        {
+            const DriverProfile *driver = view_slot(DRIVER_TABLE, i, scratch);
+            if (!driver)
+                break;
+
+            if (driver->is_active == 1)
+            {
+                drivers.push_back(*driver);
+            }
+        }
+        return drivers;
+    }
+
+    bool create_vehicle(const VehicleInfo &vehicle)
+    {
+        MutationGuard guard(*this, VEHICLE_TABLE);
+        if (!is_open_)
+            return false;
+
+        uint32_t slot;
+        if (!allocate_slot(VEHICLE_TABLE, slot))
+            return false;
+
+        if (!write_slot(VEHICLE_TABLE, slot, vehicle))
+        {
+            release_slot(VEHICLE_TABLE, slot);
+            return false;
+        }
+        observe_id(VEHICLE_TABLE, record_id(vehicle));
+        vehicle_slots_.insert(vehicle.vehicle_id, slot);
+        return guard.finish();
+    }
+
+    bool read_vehicle(uint64_t vehicle_id, VehicleInfo &vehicle)
+    {
+        shared_lock<shared_mutex> lock(table_locks_[VEHICLE_TABLE]);
+        if (!is_open_)
+            return false;
+
+        memset(&vehicle, 0, sizeof(VehicleInfo));
+        uint32_t slot;
+        if (vehicle_id == 0 || !vehicle_slots_.get(vehicle_id, slot))
+            return false;
+
+        return read_slot(VEHICLE_TABLE, slot, vehicle) && vehicle.vehicle_id == vehicle_id && vehicle.is_active == 1;
+    }
+
+    bool update_vehicle(const VehicleInfo &vehicle)
+    {
+        MutationGuard guard(*this, VEHICLE_TABLE);
+        if (!is_open_)
+            return false;
+
+        uint32_t slot;
+        if (!vehicle_slots_.get(vehicle.vehicle_id, slot))
+            return false;
+
+        VehicleInfo existing;
+        if (!read_slot(VEHICLE_TABLE, slot, existing) || existing.is_active != 1 || existing.vehicle_id != vehicle.vehicle_id)
+            return false;
+
+        return write_slot(VEHICLE_TABLE, slot, vehicle) && guard.finish();
+    }
+
+    bool delete_vehicle(uint64_t vehicle_id)
+    {
+        MutationGuard guard(*this, VEHICLE_TABLE);
+        if (!is_open_)
+            return false;
+
+        uint32_t slot;
+        if (!vehicle_slots_.get(vehicle_id, slot))
+            return false;
+
+        VehicleInfo vehicle;
+        if (!read_slot(VEHICLE_TABLE, slot, vehicle) || vehicle.is_active != 1 || vehicle.vehicle_id != vehicle_id)
+            return false;
+
+        vehicle.is_active = 0;
+        if (!write_slot(VEHICLE_TABLE, slot, vehicle))
+            return false;
+        vehicle_slots_.remove(vehicle_id);
+        release_slot(VEHICLE_TABLE, slot);
+        return guard.finish();
+    }
+
+    vector<VehicleInfo> get_vehicles_by_owner(uint64_t owner_id)
+    {
+        vector<VehicleInfo> vehicles;
+        shared_lock<shared_mutex> lock(table_locks_[VEHICLE_TABLE]);
+        if (!is_open_)
+            return vehicles;
+
+        VehicleInfo scratch;
+
+        for (uint32_t i = 0; slot_maps_[VEHICLE_TABLE].next_used(i); i++)
+        {
+            const VehicleInfo *vehicle = view_slot(VEHICLE_TABLE, i, scratch);
+            if (!vehicle)
+                break;
+
+            if (vehicle->owner_driver_id == owner_id && vehicle->is_active == 1)
+            {
+                vehicles.push_back(*vehicle);
+            }
+        }
+        return vehicles;
+    }
+
+    bool create_trip(const TripRecord &trip)
+    {
+        MutationGuard guard(*this, TRIP_TABLE);
+        if (!is_open_)
+            return false;
+
+        uint32_t slot;
+        if (!allocate_slot(TRIP_TABLE, slot))
+            return false;
+
+        if (!write_slot(TRIP_TABLE, slot, trip))
+        {
+            release_slot(TRIP_TABLE, slot);
+            return false;
+        }
+        observe_id(TRIP_TABLE, record_id(trip));
+        trip_slots_.insert(trip.trip_id, slot);
+        index_record(trip, slot, true);
+        return guard.finish();
+    }
+
+    bool read_trip(uint64_t trip_id, TripRecord &trip)
+    {
+        shared_lock<shared_mutex> lock(table_locks_[TRIP_TABLE]);
+        if (!is_open_)
+            return false;
+
+        memset(&trip, 0, sizeof(TripRecord));
+        uint32_t slot;
+        if (trip_id == 0 || !trip_slots_.get(trip_id, slot))
+            return false;
+
+        return read_slot(TRIP_TABLE, slot, trip) && trip.trip_id == trip_id;
+    }
+
+    bool update_trip(const TripRecord &trip)
+    {
+        MutationGuard guard(*this, TRIP_TABLE);
+        if (!is_open_)
+            return false;
+
+        uint32_t slot;
+        if (!trip_slots_.get(trip.trip_id, slot))
+            return false;
+
+        TripRecord existing;
+        if (!read_slot(TRIP_TABLE, slot, existing) || existing.trip_id != trip.trip_id)
+            return false;
+
+        if (!write_slot(TRIP_TABLE, slot, trip))
+            return false;
+        unindex_record(existing, slot, &trip);
+        index_record(trip, slot);
+        return guard.finish();
+    }
+
+    vector<TripRecord> get_trips_by_driver(uint64_t driver_id, int limit = 100)
+    {
+        vector<TripRecord> trips;
+        shared_lock<shared_mutex> lock(table_locks_[TRIP_TABLE]);
+        if (!is_open_)
+            return trips;
+
+        if (indexes_)
+            return lookup_indexed<TripRecord>(TRIP_TABLE, IndexManager::TRIPS_BY_DRIVER, driver_id, max(limit, 0),
+                                              [driver_id](const TripRecord &t) { return t.driver_id == driver_id; });
+
+        int count = 0;
+        TripRecord scratch;
+        for (uint32_t i = 0; count < limit && slot_maps_[TRIP_TABLE].next_used(i); i++)
+        {
+            const TripRecord *trip = view_slot(TRIP_TABLE, i, scratch);
+            if (!trip)
+                break;
+
+            if (trip->trip_id != 0 && trip->driver_id == driver_id)
+            {
+                trips.push_back(*trip);
+                count++;
+            }
+        }
+        return trips;
+    }
+
+    vector<TripRecord> get_all_active_trips()
+    {
+        vector<TripRecord> active_trips;
+        shared_lock<shared_mutex> lock(table_locks_[TRIP_TABLE]);
+        if (!is_open_)
+            return active_trips;
+
+        TripRecord scratch;
+
+        for (uint32_t i = 0; slot_maps_[TRIP_TABLE].next_used(i); i++)
+        {
+            const TripRecord *trip = view_slot(TRIP_TABLE, i, scratch);
+            if (!trip)
+                break;
+
+            if (trip->trip_id != 0 && trip->end_time == 0)
+            {
+                active_trips.push_back(*trip);
+            }
+        }
+        return active_trips;
+    }
+
+    // Trip aggregates for one driver over trips starting in [start_time,
+    // end_time]. Reads the trip columns, and only the driver's slots when the
+    // secondary index is attached; whole records are read only when the
+    // column file could not be mapped.
+    TripTotals get_trip_totals(uint64_t driver_id, uint64_t start_time = 0, uint64_t end_time = UINT64_MAX)
+    {
+        TripTotals totals;
+        shared_lock<shared_mutex> lock(table_locks_[TRIP_TABLE]);
+        if (!is_open_)
+            return totals;
+
+        const SlotBitmap &map = slot_maps_[TRIP_TABLE];
+        if (trip_columns_.is_open() && indexes_)
+        {
+            for (const SecondaryEntry &entry : indexes_->lookup_secondary(IndexManager::TRIPS_BY_DRIVER, driver_id))
+            {
+                if (map.test(entry.slot) && trip_columns_.trip_id(entry.slot) == entry.record_id &&
+                    trip_columns_.driver_id(entry.slot) == driver_id &&
+                    trip_columns_.start_time(entry.slot) >= start_time &&
+                    trip_columns_.start_time(entry.slot) <= end_time)
+                {
+                    trip_columns_.accumulate(entry.slot, totals);
+                }
+            }
+        }
+        else if (trip_columns_.is_open())
+        {
+            for (uint32_t i = 0; map.next_used(i); i++)
+            {
+                if (trip_columns_.driver_id(i) == driver_id &&
+                    trip_columns_.start_time(i) >= start_time && trip_columns_.start_time(i) <= end_time)
+                {
+                    trip_columns_.accumulate(i, totals);
+                }
+            }
+        }
+        else
+        {
+            TripRecord scratch;
+            for (uint32_t i = 0; map.next_used(i); i++)
+            {
+                const TripRecord *trip = view_slot(TRIP_TABLE, i, scratch);
+                if (trip && trip->trip_id != 0 && trip->driver_id == driver_id &&
+                    trip->start_time >= start_time && trip->start_time <= end_time)
+                {
+                    accumulate_trip(*trip, totals);
+                }
+            }
+        }
+        return totals;
+    }
+
+    // Trip aggregates for every driver in one pass over the columns
+    void get_trip_totals_by_driver(HashTable<uint64_t, TripTotals> &totals,
+                                   uint64_t start_time = 0, uint64_t end_time = UINT64_MAX)
+    {
+        totals.clear();
+        shared_lock<shared_mutex> lock(table_locks_[TRIP_TABLE]);
+        if (!is_open_)
+            return;
+
+        const SlotBitmap &map = slot_maps_[TRIP_TABLE];
+        if (indexes_ && trip_columns_.is_open() && (start_time != 0 || end_time != UINT64_MAX))
+        {
+            // A time window only visits the month partitions it overlaps
+            for (const SecondaryEntry &entry : indexes_->lookup_secondary_range(
+                     IndexManager::TRIPS_BY_MONTH, partition_key(partition_of(start_time), 0),
+                     partition_key(partition_of(end_time), PARTITION_DRIVER_MASK)))
+            {
+                uint64_t started = trip_columns_.start_time(entry.slot);
+                if (!map.test(entry.slot) || trip_columns_.trip_id(entry.slot) != entry.record_id ||
+                    partition_of(started) != key_partition(entry.key) || started < start_time || started > end_time)
+                    continue;
+
+                TripTotals driver_totals;
+                totals.get(trip_columns_.driver_id(entry.slot), driver_totals);
+                trip_columns_.accumulate(entry.slot, driver_totals);
+                totals.insert(trip_columns_.driver_id(entry.slot), driver_totals);
+            }
+            return;
+        }
+
+        TripRecord scratch;
+        for (uint32_t i = 0; map.next_used(i); i++)
+        {
+            TripTotals driver_totals;
+            if (trip_columns_.is_open())
+            {
+                uint64_t started = trip_columns_.start_time(i);
+                if (started < start_time || started > end_time)
+                    continue;
+                totals.get(trip_columns_.driver_id(i), driver_totals);
+                trip_columns_.accumulate(i, driver_totals);
+                totals.insert(trip_columns_.driver_id(i), driver_totals);
+            }
+            else
+            {
+                const TripRecord *trip = view_slot(TRIP_TABLE, i, scratch);
+                if (!trip || trip->trip_id == 0 || trip->start_time < start_time || trip->start_time > end_time)
+                    continue;
+                totals.get(trip->driver_id, driver_totals);
+                accumulate_trip(*trip, driver_totals);
+                totals.insert(trip->driver_id, driver_totals);
+            }
+        }
+    }
+
+    // Calendar month (UTC) of a unix time as year * 12 + month - 1; trips
+    // are partitioned by start time and expenses by expense date
+    static uint32_t partition_of(uint64_t timestamp)
+    {
+        time_t t = static_cast<time_t>(min(timestamp, MAX_PARTITION_TIME));
+        struct tm parts;
+        if (!gmtime_r(&t, &parts))
+            return 0;
+        return static_cast<uint32_t>(parts.tm_year + 1900) * 12 + parts.tm_mon;
+    }
+
+    // One driver's trips starting in [start_time, end_time]. Ranges of more
+    // than PARTITION_LOOKUP_MONTHS go through the driver's index instead.
+    vector<TripRecord> get_trips_by_date_range(uint64_t driver_id, uint64_t start_time, uint64_t end_time)
+    {
+        shared_lock<shared_mutex> lock(table_locks_[TRIP_TABLE]);
+        if (!is_open_ || start_time > end_time)
+            return vector<TripRecord>();
+        if (!indexes_)
+            return scan_date_range<TripRecord>(TRIP_TABLE, driver_id, start_time, end_time);
+        if (partition_of(end_time) - partition_of(start_time) < PARTITION_LOOKUP_MONTHS)
+            return lookup_partitions<TripRecord>(TRIP_TABLE, IndexManager::TRIPS_BY_MONTH, driver_id, false,
+                                                 start_time, end_time);
+
+        return lookup_indexed<TripRecord>(TRIP_TABLE, IndexManager::TRIPS_BY_DRIVER, driver_id, SIZE_MAX,
+                                          [driver_id, start_time, end_time](const TripRecord &t)
+                                          { return t.driver_id == driver_id && t.start_time >= start_time && t.start_time <= end_time; });
+    }
+
+    // Deletes all trips that started in the given month (see partition_of)
+    uint64_t drop_trip_partition(uint32_t partition, vector<pair<uint64_t, uint64_t>> *removed = nullptr)
+    {
+        return drop_partition<TripRecord>(TRIP_TABLE, &trip_slots_, IndexManager::TRIPS_BY_MONTH, partition, removed);
+    }
+
+    bool create_maintenance(const MaintenanceRecord &record)
+    {
+        MutationGuard guard(*this, MAINTENANCE_TABLE);
+        if (!is_open_)
+            return false;
+
+        uint32_t slot;
+        if (!allocate_slot(MAINTENANCE_TABLE, slot))
+            return false;
+
+        if (!write_slot(MAINTENANCE_TABLE, slot, record))
+        {
+            release_slot(MAINTENANCE_TABLE, slot);
+            return false;
+        }
+        observe_id(MAINTENANCE_TABLE, record_id(record));
+        index_record(record, slot, true);
+        return guard.finish();
+    }
+
+    vector<MaintenanceRecord> get_maintenance_by_vehicle(uint64_t vehicle_id)
+    {
+        vector<MaintenanceRecord> records;
+        shared_lock<shared_mutex> lock(table_locks_[MAINTENANCE_TABLE]);
+        if (!is_open_)
+            return records;
+
+        if (indexes_)
+            return lookup_indexed<MaintenanceRecord>(MAINTENANCE_TABLE, IndexManager::MAINTENANCE_BY_VEHICLE,
+                                                     vehicle_id, SIZE_MAX, [vehicle_id](const MaintenanceRecord &m) { return m.vehicle_id == vehicle_id; });
+
+        MaintenanceRecord scratch;
+
+        for (uint32_t i = 0; slot_maps_[MAINTENANCE_TABLE].next_used(i); i++)
+        {
+            const MaintenanceRecord *record = view_slot(MAINTENANCE_TABLE, i, scratch);
+            if (!record)
+                break;
+
+            if (record->maintenance_id != 0 && record->vehicle_id == vehicle_id)
+            {
+                records.push_back(*record);
+            }
+        }
+        return records;
+    }
+
+    bool create_expense(const ExpenseRecord &expense)
+    {
+        MutationGuard guard(*this, EXPENSE_TABLE);
+        if (!is_open_)
+            return false;
+
+        uint32_t slot;
+        if (!allocate_slot(EXPENSE_TABLE, slot))
+            return false;
+
+        if (!write_slot(EXPENSE_TABLE, slot, expense))
+        {
+            release_slot(EXPENSE_TABLE, slot);
+            return false;
+        }
+        observe_id(EXPENSE_TABLE, record_id(expense));
+        expense_slots_.insert(expense.expense_id, slot);
+        index_record(expense, slot, true);
+        return guard.finish();
+    }
+
+    
+
+    vector<ExpenseRecord> get_expenses_by_driver(uint64_t driver_id, int limit = 100)
+    {
+        vector<ExpenseRecord> expenses;
+        shared_lock<shared_mutex> lock(table_locks_[EXPENSE_TABLE]);
+        if (!is_open_)
+            return expenses;
+
+        if (indexes_)
+            return lookup_indexed<ExpenseRecord>(EXPENSE_TABLE, IndexManager::EXPENSES_BY_DRIVER, driver_id, max(limit, 0),
+                                                 [driver_id](const ExpenseRecord &e) { return e.driver_id == driver_id; });
+
+        int count = 0;
+        ExpenseRecord scratch;
+        for (uint32_t i = 0; count < limit && slot_maps_[EXPENSE_TABLE].next_used(i); i++)
+        {
+            const ExpenseRecord *expense = view_slot(EXPENSE_TABLE, i, scratch);
+            if (!expense)
+                break;
+
+            if (expense->expense_id != 0 && expense->driver_id == driver_id)
+            {
+                expenses.push_back(*expense);
+                count++;
+            }
+        }
+        return expenses;
+    }
+
+    vector<ExpenseRecord> get_expenses_by_category(uint64_t driver_id, ExpenseCategory category)
+    {
+        vector<ExpenseRecord> expenses;
+        shared_lock<shared_mutex> lock(table_locks_[EXPENSE_TABLE]);
+        if (!is_open_)
+            return expenses;
+
+        if (indexes_)
+            return lookup_indexed<ExpenseRecord>(EXPENSE_TABLE, IndexManager::EXPENSES_BY_DRIVER, driver_id, SIZE_MAX,
+                                                 [driver_id, category](const ExpenseRecord &e)
+                                                 { return e.driver_id == driver_id && e.category == category; });
+
+        ExpenseRecord scratch;
+
+        for (uint32_t i = 0; slot_maps_[EXPENSE_TABLE].next_used(i); i++)
+        {
+            const ExpenseRecord *expense = view_slot(EXPENSE_TABLE, i, scratch);
+            if (!expense)
+                break;
+
+            if (expense->expense_id != 0 && expense->driver_id == driver_id &&
+                expense->category == category)
+            {
+                expenses.push_back(*expense);
+            }
+        }
+        return expenses;
+    }
+
+    vector<ExpenseRecord> get_expenses_by_date_range(uint64_t driver_id, uint64_t start_date, uint64_t end_date)
+    {
+        shared_lock<shared_mutex> lock(table_locks_[EXPENSE_TABLE]);
+        if (!is_open_ || start_date > end_date)
+            return vector<ExpenseRecord>();
+        if (!indexes_)
+            return scan_date_range<ExpenseRecord>(EXPENSE_TABLE, driver_id, start_date, end_date);
+        if (partition_of(end_date) - partition_of(start_date) < PARTITION_LOOKUP_MONTHS)
+            return lookup_partitions<ExpenseRecord>(EXPENSE_TABLE, IndexManager::EXPENSES_BY_MONTH, driver_id, false,
+                                                    start_date, end_date);
+
+        return lookup_indexed<ExpenseRecord>(EXPENSE_TABLE, IndexManager::EXPENSES_BY_DRIVER, driver_id, SIZE_MAX,
+                                             [driver_id, start_date, end_date](const ExpenseRecord &e)
+                                             { return e.driver_id == driver_id && e.expense_date >= start_date && e.expense_date <= end_date; });
+    }
+
+    // Deletes all expenses dated in the given month (see partition_of)
+    uint64_t drop_expense_partition(uint32_t partition, vector<pair<uint64_t, uint64_t>> *removed = nullptr)
+    {
+        return drop_partition<ExpenseRecord>(EXPENSE_TABLE, &expense_slots_, IndexManager::EXPENSES_BY_MONTH, partition,
+                                             removed);
+    }
+
+    bool create_trips_batch(const vector<TripRecord> &trips)
+    {
+        MutationGuard guard(*this, TRIP_TABLE);
+        return create_batch(TRIP_TABLE, trips, &trip_slots_) && guard.finish();
+    }
+
+    bool create_expenses_batch(const vector<ExpenseRecord> &expenses)
+    {
+        MutationGuard guard(*this, EXPENSE_TABLE);
+        return create_batch(EXPENSE_TABLE, expenses, &expense_slots_) && guard.finish();
+    }
+
+    bool create_incident(const IncidentReport &incident)
+    {
+        MutationGuard guard(*this, INCIDENT_TABLE);
+        if (!is_open_)
+            return false;
+
+        uint32_t slot;
+        if (!allocate_slot(INCIDENT_TABLE, slot))
+            return false;
+
+        if (!write_slot(INCIDENT_TABLE, slot, incident))
+        {
+            release_slot(INCIDENT_TABLE, slot);
+            return false;
+        }
+        observe_id(INCIDENT_TABLE, record_id(incident));
+        incident_slots_.insert(incident.incident_id, slot);
+        index_record(incident, slot, true);
+        return guard.finish();
+    }
+
+    bool read_incident(uint64_t incident_id, IncidentReport &incident)
+    {
+        shared_lock<shared_mutex> lock(table_locks_[INCIDENT_TABLE]);
+        if (!is_open_)
+            return false;
+
+        memset(&incident, 0, sizeof(IncidentReport));
+        uint32_t slot;
+        if (incident_id == 0 || !incident_slots_.get(incident_id, slot))
+            return false;
+
+        return read_slot(INCIDENT_TABLE, slot, incident) && incident.incident_id == incident_id;
+    }
+
+    bool update_incident(const IncidentReport &incident)
+    {
+        MutationGuard guard(*this, INCIDENT_TABLE);
+        if (!is_open_)
+            return false;
+
+        uint32_t slot;
+        if (!incident_slots_.get(incident.incident_id, slot))
+            return false;
+
+        IncidentReport existing;
+        if (!read_slot(INCIDENT_TABLE, slot, existing) || existing.incident_id != incident.incident_id)
+            return false;
+
+        if (!write_slot(INCIDENT_TABLE, slot, incident))
+            return false;
+        unindex_record(existing, slot, &incident);
+        index_record(incident, slot);
+        return guard.finish();
+    }
+
+    vector<IncidentReport> get_incidents_by_driver(uint64_t driver_id, int limit = 100)
+    {
+        vector<IncidentReport> incidents;
+        shared_lock<shared_mutex> lock(table_locks_[INCIDENT_TABLE]);
+        if (!is_open_)
+            return incidents;
+
+        if (indexes_)
+            return lookup_indexed<IncidentReport>(INCIDENT_TABLE, IndexManager::INCIDENTS_BY_DRIVER, driver_id, max(limit, 0),
+                                                  [driver_id](const IncidentReport &r) { return r.driver_id == driver_id; });
+
+        int count = 0;
+        IncidentReport scratch;
+        for (uint32_t i = 0; count < limit && slot_maps_[INCIDENT_TABLE].next_used(i); i++)
+        {
+            const IncidentReport *incident = view_slot(INCIDENT_TABLE, i, scratch);
+            if (!incident)
+                break;
+
+            if (incident->incident_id != 0 && incident->driver_id == driver_id)
+            {
+                incidents.push_back(*incident);
+                count++;
+            }
+        }
+        return incidents;
+    }
+
+    vector<IncidentReport> get_incidents_by_vehicle(uint64_t vehicle_id)
+    {
+        vector<IncidentReport> incidents;
+        shared_lock<shared_mutex> lock(table_locks_[INCIDENT_TABLE]);
+        if (!is_open_)
+            return incidents;
+
+        if (indexes_)
+            return lookup_indexed<IncidentReport>(INCIDENT_TABLE, IndexManager::INCIDENTS_BY_VEHICLE, vehicle_id, SIZE_MAX,
+                                                  [vehicle_id](const IncidentReport &r) { return r.vehicle_id == vehicle_id; });
+
+        IncidentReport scratch;
+
+        for (uint32_t i = 0; slot_maps_[INCIDENT_TABLE].next_used(i); i++)
+        {
+            const IncidentReport *incident = view_slot(INCIDENT_TABLE, i, scratch);
+            if (!incident)
+                break;
+
+            if (incident->incident_id != 0 && incident->vehicle_id == vehicle_id)
+            {
+                incidents.push_back(*incident);
+            }
+        }
+        return incidents;
+    }
+
+    uint64_t get_current_timestamp() const
+    {
+        return static_cast<uint64_t>(time(nullptr));
+    }
+
+    uint64_t next_driver_id(uint32_t count = 1)
+    {
+        return advance_sequence(DRIVER_TABLE, count);
+    }
+
+    uint64_t next_vehicle_id(uint32_t count = 1)
+    {
+        return advance_sequence(VEHICLE_TABLE, count);
+    }
+
+    uint64_t next_trip_id(uint32_t count = 1)
+    {
+        return advance_sequence(TRIP_TABLE, count);
+    }
+
+    uint64_t next_maintenance_id(uint32_t count = 1)
+    {
+        return advance_sequence(MAINTENANCE_TABLE, count);
+    }
+
+    uint64_t next_expense_id(uint32_t count = 1)
+    {
+        return advance_sequence(EXPENSE_TABLE, count);
+    }
+
+    uint64_t next_incident_id(uint32_t count = 1)
+    {
+        return advance_sequence(INCIDENT_TABLE, count);
+    }
+
+    uint64_t get_max_driver_id()
+    {
+        shared_lock<shared_mutex> lock(table_locks_[DRIVER_TABLE]);
+        uint64_t max_id = 0;
+        if (!is_open_) return 0;
+        DriverProfile scratch;
+        for (uint32_t i = 0; slot_maps_[DRIVER_TABLE].next_used(i); i++) {
+            const DriverProfile *d = view_slot(DRIVER_TABLE, i, scratch);
+            if (!d) break;
+            if (d->is_active == 1 && d->driver_id > max_id) max_id = d->driver_id;
+        }
+        return max_id;
+    }
+
+    uint64_t get_max_vehicle_id()
+    {
+        shared_lock<shared_mutex> lock(table_locks_[VEHICLE_TABLE]);
+        uint64_t max_id = 0;
+        if (!is_open_) return 0;
+        VehicleInfo scratch;
+        for (uint32_t i = 0; slot_maps_[VEHICLE_TABLE].next_used(i); i++) {
+            const VehicleInfo *v = view_slot(VEHICLE_TABLE, i, scratch);
+            if (!v) break;
+            if (v->is_active == 1 && v->vehicle_id > max_id) max_id = v->vehicle_id;
+        }
+        return max_id;
+    }
+
+    uint64_t get_max_trip_id()
+    {
+        shared_lock<shared_mutex> lock(table_locks_[TRIP_TABLE]);
+        uint64_t max_id = 0;
+        if (!is_open_) return 0;
+        TripRecord scratch;
+        for (uint32_t i = 0; slot_maps_[TRIP_TABLE].next_used(i); i++) {
+            const TripRecord *t = view_slot(TRIP_TABLE, i, scratch);
+            if (!t) break;
+            if (t->trip_id > max_id) max_id = t->trip_id;
+        }
+        return max_id;
+    }
+
+    uint64_t get_max_expense_id()
+    {
+        shared_lock<shared_mutex> lock(table_locks_[EXPENSE_TABLE]);
+        uint64_t max_id = 0;
+        if (!is_open_) return 0;
+        ExpenseRecord scratch;
+        for (uint32_t i = 0; slot_maps_[EXPENSE_TABLE].next_used(i); i++) {
+            const ExpenseRecord *e = view_slot(EXPENSE_TABLE, i, scratch);
+            if (!e) break;
+            if (e->expense_id > max_id) max_id = e->expense_id;
+        }
+        return max_id;
+    }
+
+    uint64_t get_max_incident_id()
+    {
+        shared_lock<shared_mutex> lock(table_locks_[INCIDENT_TABLE]);
+        uint64_t max_id = 0;
+        if (!is_open_) return 0;
+        IncidentReport scratch;
+        for (uint32_t i = 0; slot_maps_[INCIDENT_TABLE].next_used(i); i++) {
+            const IncidentReport *in = view_slot(INCIDENT_TABLE, i, scratch);
+            if (!in) break;
+            if (in->incident_id > max_id) max_id = in->incident_id;
+        }
+        return max_id;
+    }
+
+    uint64_t get_max_maintenance_id()
+    {
+        shared_lock<shared_mutex> lock(table_locks_[MAINTENANCE_TABLE]);
+        uint64_t max_id = 0;
+        if (!is_open_) return 0;
+        MaintenanceRecord scratch;
+        for (uint32_t i = 0; slot_maps_[MAINTENANCE_TABLE].next_used(i); i++) {
+            const MaintenanceRecord *m = view_slot(MAINTENANCE_TABLE, i, scratch);
+            if (!m) break;
+            if (m->maintenance_id > max_id) max_id = m->maintenance_id;
+        }
+        return max_id;
+    }
+
+    const SDMHeader &get_header() const { return header_; }
+    bool is_database_open() const { return is_open_; }
+
+    // Relocates live records into the holes left by deletes, table by table
+    uint64_t compact()
+    {
+        uint64_t moved = 0;
+        moved += compact_online<DriverProfile>(DRIVER_TABLE, &driver_slots_);
+        moved += compact_online<VehicleInfo>(VEHICLE_TABLE, &vehicle_slots_);
+        moved += compact_online<TripRecord>(TRIP_TABLE, &trip_slots_);
+        moved += compact_online<MaintenanceRecord>(MAINTENANCE_TABLE, nullptr);
+        moved += compact_online<ExpenseRecord>(EXPENSE_TABLE, &expense_slots_);
+        moved += compact_online<DocumentMetadata>(DOCUMENT_TABLE, nullptr);
+        moved += compact_online<IncidentReport>(INCIDENT_TABLE, &incident_slots_);
+        return moved;
+    }
+
+    // Rewrites the configured database into the current format: text moves
+    // to the heap file and slots shrink to their compact size. Record ids,
+    // sequences and capacities are kept. On a file already in the current
+    // format it reclaims heap space left behind by updates and deletes. The
+    // old files are kept with a .bak suffix and the secondary index, which
+    // refers to slots, is dropped so it is rebuilt at the next start, as are
+    // the primary and lookup indexes. Run it while the database is not open
+    // anywhere else.
+    static bool migrate(const SDMConfig &config)
+    {
+        const string &path = config.database_path;
+        DatabaseShard source(path, config.use_mmap);
+        if (!source.open())
+        {
+            cerr << "      ERROR: Cannot open database: " << path << endl;
+            return false;
+        }
+
+        SDMConfig sized = config;
+        sized.max_drivers = source.header_.max_drivers;
+        sized.max_vehicles = source.header_.max_vehicles;
+        sized.max_trips = source.header_.max_trips;
+        sized.max_maintenance = source.header_.max_maintenance;
+        sized.max_expenses = source.header_.max_expenses;
+        sized.max_documents = source.header_.max_documents;
+        sized.max_incidents = source.header_.max_incidents;
+
+        string target_path = path + ".migrating";
+        DatabaseShard target(target_path, config.use_mmap);
+        bool ok = target.create(sized) && target.open() &&
+                  target.copy_table<DriverProfile>(source, DRIVER_TABLE, &target.driver_slots_) &&
+                  target.copy_table<VehicleInfo>(source, VEHICLE_TABLE, &target.vehicle_slots_) &&
+                  target.copy_table<TripRecord>(source, TRIP_TABLE, &target.trip_slots_) &&
+                  target.copy_table<MaintenanceRecord>(source, MAINTENANCE_TABLE, nullptr) &&
+                  target.copy_table<ExpenseRecord>(source, EXPENSE_TABLE, &target.expense_slots_) &&
+                  target.copy_table<DocumentMetadata>(source, DOCUMENT_TABLE, nullptr) &&
+                  target.copy_table<IncidentReport>(source, INCIDENT_TABLE, &target.incident_slots_);
+        for (int t = 0; ok && t < TABLE_COUNT; t++)
+        {
+            target.observe_id(t, source.header_.table_last_id[t]);
+        }
+        target.header_.lookup_indexes_stale = 1;
+        ok = ok && target.write_header_field(target.header_.lookup_indexes_stale) && target.sync();
+
+        bool had_heap = source.compact_records_;
+        source.close();
+        target.close();
+
+        vector<string> suffixes = {".wal", ".cols"};
+        for (const string &suffix : suffixes)
+        {
+            unlink((target_path + suffix).c_str());
+            unlink((path + suffix).c_str());
+        }
+        if (!ok)
+        {
+            unlink(target_path.c_str());
+            unlink((target_path + ".heap").c_str());
+            cerr << "      ERROR: Migration failed; " << path << " is unchanged" << endl;
+            return false;
+        }
+
+        if (rename(path.c_str(), (path + ".bak").c_str()) != 0 ||
+            (had_heap && rename((path + ".heap").c_str(), (path + ".heap.bak").c_str()) != 0) ||
+            rename((target_path + ".heap").c_str(), (path + ".heap").c_str()) != 0 ||
+            rename(target_path.c_str(), path.c_str()) != 0)
+        {
+            cerr << "      ERROR: Cannot replace " << path << " with " << target_path << endl;
+            return false;
+        }
+        unlink((config.index_path + "/secondary.idx").c_str());
+
+        cout << "      Migrated " << path << " (previous version kept as " << path << ".bak)" << endl;
+        return true;
+    }
+
+    // Online backup of a consistent snapshot into a compact stream at path:
+    // only blocks of slots holding records, each compressed, and writers
+    // keep running meanwhile. since = 0 gives a full backup; otherwise only
+    // blocks changed after that change sequence are written, normally the
+    // sequence returned by the previous backup. Files from before the change
+    // map existed always yield every block.
+    bool backup(const string &path, uint64_t since, uint64_t &sequence)
+    {
+        if (!is_open_)
+            return false;
+
+        string temp_path = path + ".tmp";
+        bool ok;
+        {
+            Snapshot snapshot(*this);
+            const SnapshotState &state = *snapshot.state_;
+
+            BackupHeader header;
+            memset(&header, 0, sizeof(header));
+            memcpy(header.magic, "SDMBAK01", 8);
+            header.since = since;
+            header.sequence = state.sequence;
+            header.created_time = get_current_timestamp();
+            for (int t = 0; t < TABLE_COUNT; t++)
+            {
+                header.capacity[t] = table_capacity(t);
+                header.last_id[t] = state.last_id[t];
+            }
+
+            int fd = ::open(temp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (fd < 0)
+            {
+                cerr << "      ERROR: Cannot create backup: " << temp_path << endl;
+                return false;
+            }
+
+            uint32_t written = 0;
+            ok = write_fully(fd, &header, sizeof(header)) &&
+                 backup_table<DriverProfile>(state, DRIVER_TABLE, since, fd, written) &&
+                 backup_table<VehicleInfo>(state, VEHICLE_TABLE, since, fd, written) &&
+                 backup_table<TripRecord>(state, TRIP_TABLE, since, fd, written) &&
+                 backup_table<MaintenanceRecord>(state, MAINTENANCE_TABLE, since, fd, written) &&
+                 backup_table<ExpenseRecord>(state, EXPENSE_TABLE, since, fd, written) &&
+                 backup_table<DocumentMetadata>(state, DOCUMENT_TABLE, since, fd, written) &&
+                 backup_table<IncidentReport>(state, INCIDENT_TABLE, since, fd, written);
+            BackupBlock end = {BACKUP_END, written, 0, 0};
+            ok = ok && write_fully(fd, &end, sizeof(end)) && fdatasync(fd) == 0;
+            ::close(fd);
+            sequence = state.sequence;
+        }
+
+        if (!ok || rename(temp_path.c_str(), path.c_str()) != 0)
+        {
+            unlink(temp_path.c_str());
+            return false;
+        }
+        // Checkpoints the change sequence so it stays ahead of this backup
+        return sync();
+    }
+
+    // Rebuilds the configured database from a full backup followed by the
+    // incremental backups taken after it, in order; each must start at or
+    // before the sequence of the one before. The result replaces the database file,
+    // whose previous version is kept with a .bak suffix, and the secondary
+    // index is dropped so it is rebuilt at the next start, as are the
+    // primary and lookup indexes. Run it while the database is not open
+    // anywhere else.
+    static bool restore(const SDMConfig &config, const vector<string> &backups)
+    {
+        const string &path = config.database_path;
+        string target_path = path + ".restoring";
+        DatabaseShard target(target_path, config.use_mmap);
+        uint64_t sequence = 0;
+        bool ok = !backups.empty();
+        for (size_t i = 0; ok && i < backups.size(); i++)
+        {
+            int fd = ::open(backups[i].c_str(), O_RDONLY);
+            BackupHeader header;
+            ok = fd >= 0 && read_fully(fd, &header, sizeof(header)) && memcmp(header.magic, "SDMBAK01", 8) == 0 &&
+                 header.since <= sequence && (i == 0 || header.since != 0);
+            if (ok && i == 0)
+            {
+                SDMConfig sized = config;
+                sized.max_drivers = header.capacity[DRIVER_TABLE];
+                sized.max_vehicles = header.capacity[VEHICLE_TABLE];
+                sized.max_trips = header.capacity[TRIP_TABLE];
+                sized.max_maintenance = header.capacity[MAINTENANCE_TABLE];
+                sized.max_expenses = header.capacity[EXPENSE_TABLE];
+                sized.max_documents = header.capacity[DOCUMENT_TABLE];
+                sized.max_incidents = header.capacity[INCIDENT_TABLE];
+                ok = target.create(sized) && target.open();
+            }
+            for (int t = 0; ok && t < TABLE_COUNT; t++)
+            {
+                ok = header.capacity[t] == target.table_capacity(t);
+            }
+
+            ok = ok && target.apply_backup(fd);
+            for (int t = 0; ok && t < TABLE_COUNT; t++)
+            {
+                target.observe_id(t, header.last_id[t]);
+            }
+            if (!ok)
+                cerr << "      ERROR: Cannot apply backup: " << backups[i] << endl;
+            if (fd >= 0)
+                ::close(fd);
+            sequence = header.sequence;
+        }
+        target.header_.lookup_indexes_stale = 1;
+        ok = ok && target.write_header_field(target.header_.lookup_indexes_stale) && target.sync();
+        target.close();
+
+        unlink((target_path + ".wal").c_str());
+        unlink((target_path + ".cols").c_str());
+        if (!ok)
+        {
+            unlink(target_path.c_str());
+            unlink((target_path + ".heap").c_str());
+            cerr << "      ERROR: Restore failed; " << path << " is unchanged" << endl;
+            return false;
+        }
+
+        // The replaced file keeps its log, which may hold changes not yet
+        // checkpointed into it
+        struct stat st;
+        bool had_database = stat(path.c_str(), &st) == 0;
+        bool had_heap = stat((path + ".heap").c_str(), &st) == 0;
+        bool had_log = stat((path + ".wal").c_str(), &st) == 0;
+        unlink((path + ".cols").c_str());
+        if ((had_database && rename(path.c_str(), (path + ".bak").c_str()) != 0) ||
+            (had_heap && rename((path + ".heap").c_str(), (path + ".heap.bak").c_str()) != 0) ||
+            (had_log && rename((path + ".wal").c_str(), (path + ".wal.bak").c_str()) != 0) ||
+            rename((target_path + ".heap").c_str(), (path + ".heap").c_str()) != 0 ||
+            rename(target_path.c_str(), path.c_str()) != 0)
+        {
+            cerr << "      ERROR: Cannot replace " << path << " with " << target_path << endl;
+            return false;
+        }
+        unlink((config.index_path + "/secondary.idx").c_str());
+
+        cout << "      Restored " << path << " from " << backups.size() << " backup(s)" << endl;
+        return true;
+    }
+
+    // Compresses full blocks of trips, expenses and incidents dated before
+    // cutoff (unix time) into the heap and releases their space in the
+    // database file at the next checkpoint. Sealed blocks are decompressed
+    // on read and written back on the first change to one of their records.
+    // Returns the number of blocks sealed; files from before sealing existed
+    // have no cold index and need --migrate first.
+    uint64_t seal_cold_records(uint64_t cutoff)
+    {
+        uint64_t sealed = 0;
+        sealed += seal_table<TripRecord>(TRIP_TABLE, cutoff);
+        sealed += seal_table<ExpenseRecord>(EXPENSE_TABLE, cutoff);
+        sealed += seal_table<IncidentReport>(INCIDENT_TABLE, cutoff);
+        if (sealed > 0)
+            sync();
+        return sealed;
+    }
+
+    // Fraction of slots below the tables' high-water marks that are free
+    double get_fragmentation() const
+    {
+        uint64_t used = 0;
+        uint64_t high_water = 0;
+        for (int t = 0; t < TABLE_COUNT; t++)
+        {
+            shared_lock<shared_mutex> lock(table_locks_[t]);
+            used += slot_maps_[t].used();
+            high_water += header_.table_high_water[t];
+        }
+        return high_water > used ? static_cast<double>(high_water - used) / high_water : 0.0;
+    }
+
+    // Point-in-time view of the database for reports that read a lot of it.
+    // Opening one copies the free maps under every table's shared lock;
+    // from then on writers keep the old bytes of each slot they change for
+    // it, so its reads see the tables as they were without holding writers
+    // off for the length of a scan. Reads check the slots' records, not the
+    // secondary index or trip columns, which only describe the present.
+    class Snapshot
+    {
+    private:
+        friend class DatabaseShard;
+
+        DatabaseShard &db_;
+        shared_ptr<SnapshotState> state_;
+
+    public:
+        explicit Snapshot(DatabaseShard &db) : db_(db), state_(make_shared<SnapshotState>())
+        {
+            db_.register_snapshot(state_);
+        }
+
+        ~Snapshot()
+        {
+            db_.unregister_snapshot(state_);
+        }
+
+        Snapshot(const Snapshot &) = delete;
+        Snapshot &operator=(const Snapshot &) = delete;
+
+        vector<DriverProfile> get_all_drivers()
+        {
+            vector<DriverProfile> drivers;
+            db_.scan_snapshot<DriverProfile>(*state_, DRIVER_TABLE, true,
+                                             [&drivers](const DriverProfile &d) { drivers.push_back(d); });
+            return drivers;
+        }
+
+        void get_trip_totals_by_driver(HashTable<uint64_t, TripTotals> &totals,
+                                       uint64_t start_time = 0, uint64_t end_time = UINT64_MAX)
+        {
+            totals.clear();
+            db_.scan_snapshot<TripRecord>(*state_, TRIP_TABLE, false,
+                                          [&totals, start_time, end_time](const TripRecord &trip)
+                                          {
+                                              if (trip.start_time < start_time || trip.start_time > end_time)
+                                                  return;
+                                              TripTotals driver_totals;
+                                              totals.get(trip.driver_id, driver_totals);
+                                              accumulate_trip(trip, driver_totals);
+                                              totals.insert(trip.driver_id, driver_totals);
+                                          });
+        }
+
+        vector<ExpenseRecord> get_expenses_by_date_range(uint64_t driver_id, uint64_t start_date, uint64_t end_date)
+        {
+            vector<ExpenseRecord> expenses;
+            db_.scan_snapshot<ExpenseRecord>(*state_, EXPENSE_TABLE, true,
+                                             [&expenses, driver_id, start_date, end_date](const ExpenseRecord &e)
+                                             {
+                                                 if (e.driver_id == driver_id && e.expense_date >= start_date &&
+                                                     e.expense_date <= end_date)
+                                                     expenses.push_back(e);
+                                             });
+            return expenses;
+        }
+
+        DatabaseStats get_stats()
+        {
+            DatabaseStats stats;
+            if (!db_.is_open_)
+                return stats;
+
+            const SnapshotState &state = *state_;
+            stats.total_drivers = state.maps[DRIVER_TABLE].used();
+            stats.active_drivers = stats.total_drivers;
+            stats.total_vehicles = state.maps[VEHICLE_TABLE].used();
+            stats.total_trips = state.maps[TRIP_TABLE].used();
+            stats.total_maintenance_records = state.maps[MAINTENANCE_TABLE].used();
+            stats.total_expenses = state.maps[EXPENSE_TABLE].used();
+            stats.total_documents = state.maps[DOCUMENT_TABLE].used();
+            stats.total_incidents = state.maps[INCIDENT_TABLE].used();
+
+            uint64_t used = 0;
+            uint64_t high_water = 0;
+            for (int t = 0; t < TABLE_COUNT; t++)
+            {
+                used += state.maps[t].used();
+                high_water += state.high_water[t];
+                shared_lock<shared_mutex> lock(db_.table_locks_[t]);
+                stats.sealed_blocks += db_.sealed_blocks_[t];
+            }
+            stats.fragmentation = high_water > used ? static_cast<double>(high_water - used) / high_water : 0.0;
+
+            db_.scan_snapshot<DriverProfile>(state, DRIVER_TABLE, false,
+                                             [&stats](const DriverProfile &d) { stats.total_distance += d.total_distance; });
+
+            stats.database_size = db_.header_.total_size + db_.heap_.size();
+            stats.used_space = stats.database_size;
+            struct stat st;
+            if (fstat(db_.fd_, &st) == 0)
+                stats.used_space = static_cast<uint64_t>(st.st_blocks) * 512 + db_.heap_.size();
+            return stats;
+        }
+    };
+
+    // Counts and totals from one snapshot, so they agree with each other
+    DatabaseStats get_stats()
+    {
+        Snapshot snapshot(*this);
+        return snapshot.get_stats();
+    }
+};
+
+#endif
@@ -33,12 +33,17 @@ public:
             return false;
         }
 
+        std::string old_email = driver.email;
         strncpy(driver.full_name, full_name.c_str(), sizeof(driver.full_name) - 1);
         strncpy(driver.email, email.c_str(), sizeof(driver.email) - 1);
         strncpy(driver.phone, phone.c_str(), sizeof(driver.phone) - 1);
 
         if (db_.update_driver(driver))
         {
+            if (old_email != driver.email)
+            {
+                index_.update_driver_email(old_email, driver.email, driver_id);
+            }
             cache_.invalidate_driver(driver_id);
             return true;
         }
@@ -182,7 +187,12 @@ public:
     {
         std::vector<DriverRanking> rankings;
 
-        auto all_drivers = db_.get_all_drivers();
+        // Drivers and trip totals from the same point in time
+        DatabaseManager::Snapshot snapshot(db_);
+        auto all_drivers = snapshot.get_all_drivers();
+
+        HashTable<uint64_t, TripTotals> trip_totals;
+        snapshot.get_trip_totals_by_driver(trip_totals);
 
         for (const auto &driver : all_drivers)
         {
@@ -194,11 +204,9 @@ public:
             rank.total_trips = driver.total_trips;
             
 
-            auto trips = db_.get_trips_by_driver(driver.driver_id, 100);
-            double total_duration = 0;
-            for (const auto& trip : trips) {
-                total_duration += trip.duration;
-            }
+            TripTotals totals;
+            trip_totals.get(driver.driver_id, totals);
+            double total_duration = totals.total_duration;
             if (total_duration > 0) {
                 rank.avg_speed = (driver.total_distance / total_duration) * 3600;
             } else {
@@ -21,7 +21,6 @@ private:
     CacheManager &cache_;
     IndexManager &index_;
     class TripManager *trip_mgr_;
-    uint64_t next_expense_id_;
 
     struct BudgetLimit
     {
@@ -38,7 +37,6 @@ public:
     ExpenseManager(DatabaseManager &db, CacheManager &cache, IndexManager &index)
         : db_(db), cache_(cache), index_(index), trip_mgr_(nullptr)
     {
-        next_expense_id_ = db_.get_max_expense_id() + 1;
     }
 
     void set_trip_manager(class TripManager *trip_mgr) {
@@ -122,6 +120,51 @@ public:
         return expense_id;
     }
 
+    // Assigns ids to the given expenses and stores them in one database write.
+    // Returns the new ids, or an empty vector if nothing was stored.
+    vector<uint64_t> add_expenses_batch(uint64_t driver_id, vector<ExpenseRecord> expenses)
+    {
+        vector<uint64_t> ids;
+        if (expenses.empty())
+            return ids;
+
+        uint64_t first_id = db_.next_expense_id(expenses.size());
+        uint64_t now = get_current_timestamp();
+        vector<pair<uint64_t, uint64_t>> index_entries;
+        map<ExpenseCategory, double> totals;
+
+        for (size_t i = 0; i < expenses.size(); i++)
+        {
+            ExpenseRecord &expense = expenses[i];
+            expense.expense_id = first_id + i;
+            expense.driver_id = driver_id;
+            if (expense.expense_date == 0)
+                expense.expense_date = now;
+            if (expense.currency[0] == '\0')
+                strncpy(expense.currency, "USD", sizeof(expense.currency) - 1);
+
+            ids.push_back(expense.expense_id);
+            index_entries.push_back({expense.expense_id, expense.expense_date});
+            totals[expense.category] += expense.amount;
+        }
+
+        if (!db_.create_expenses_batch(expenses))
+        {
+            return vector<uint64_t>();
+        }
+
+        index_.insert_primary_batch(4, index_entries);
+
+        for (const auto &total : totals)
+        {
+            check_budget_alert(driver_id, total.first, total.second);
+        }
+
+        cache_.clear_query_cache();
+
+        return ids;
+    }
+
     vector<ExpenseRecord> get_driver_expenses(uint64_t driver_id, int limit = 100)
     {
         return db_.get_expenses_by_driver(driver_id, limit);
@@ -137,18 +180,7 @@ public:
                                                           uint64_t start_date,
                                                           uint64_t end_date)
     {
-        auto all_expenses = db_.get_expenses_by_driver(driver_id, 100000);
-
-        vector<ExpenseRecord> filtered;
-        for (const auto &expense : all_expenses)
-        {
-            if (expense.expense_date >= start_date && expense.expense_date <= end_date)
-            {
-                filtered.push_back(expense);
-            }
-        }
-
-        return filtered;
+        return db_.get_expenses_by_date_range(driver_id, start_date, end_date);
     }
 
     bool set_budget_limit(uint64_t driver_id,
@@ -338,21 +370,29 @@ public:
                                                           int num_months = 12)
     {
         vector<MonthlyExpenseReport> reports;
+        if (num_months <= 0)
+            return reports;
 
         auto current = get_current_timestamp();
+        uint64_t span = num_months * 30ULL * 86400ULL;
+
+        // One read of the whole span from a snapshot, so every month is
+        // taken from the same state of the table
+        DatabaseManager::Snapshot snapshot(db_);
+        auto expenses = snapshot.get_expenses_by_date_range(driver_id, current > span ? current - span : 0, current);
 
         for (int i = 0; i < num_months; i++)
         {
             MonthlyExpenseReport report;
 
-            uint64_t month_start = current - (i * 30ULL * 86400ULL * 1000000000ULL);
-            uint64_t month_end = month_start + (30ULL * 86400ULL * 1000000000ULL);
-
-            auto expenses = get_expenses_by_date_range(driver_id, month_start, month_end);
+            uint64_t month_end = current - (i * 30ULL * 86400ULL);
+            uint64_t month_start = month_end - (30ULL * 86400ULL);
 
             report.total = 0;
             for (const auto &expense : expenses)
             {
+                if (expense.expense_date < month_start || expense.expense_date > month_end)
+                    continue;
                 report.total += expense.amount;
                 report.by_category[expense.category] += expense.amount;
             }
@@ -578,7 +618,7 @@ public:
 private:
     uint64_t generate_expense_id()
     {
-        return next_expense_id_++;
+        return db_.next_expense_id();
     }
 
     uint64_t get_current_timestamp()
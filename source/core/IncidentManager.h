@@ -18,8 +18,6 @@ private:
     DatabaseManager &db_;
     CacheManager &cache_;
 
-    uint64_t next_incident_id_;
-
     void update_driver_safety_after_incident(uint64_t driver_id, IncidentType type)
     {
         DriverProfile driver;
@@ -72,7 +70,6 @@ public:
     IncidentManager(DatabaseManager &db, CacheManager &cache)
         : db_(db), cache_(cache)
     {
-        next_incident_id_ = db_.get_max_incident_id() + 1;
     }
 
     uint64_t report_incident(uint64_t driver_id,
@@ -84,7 +81,7 @@ public:
                              const string &description,
                              uint64_t trip_id = 0)
     {
-        uint64_t incident_id = next_incident_id_++;
+        uint64_t incident_id = db_.next_incident_id();
 
         IncidentReport incident;
         memset(&incident, 0, sizeof(IncidentReport));
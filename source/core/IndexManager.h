@@ -5,21 +5,54 @@
 #include "../../source/data_structures/BPlusTree.h"
 #include "../../include/sdm_types.hpp"
 #include <memory>
+#include <vector>
+#include <set>
+#include <algorithm>
 #include <string>
 #include <sys/stat.h>
 #include <iostream>
+#include <mutex>
 using namespace std;
 
+struct SecondaryEntry
+{
+    uint64_t record_id;
+    uint32_t slot;
+    uint64_t key;
+};
+
 class IndexManager
 {
+public:
+    // Secondary index types; entries map a foreign key to the table slots
+    // of the records that reference it
+    static constexpr uint8_t TRIPS_BY_DRIVER = 16;
+    static constexpr uint8_t EXPENSES_BY_DRIVER = 17;
+    static constexpr uint8_t INCIDENTS_BY_DRIVER = 18;
+    static constexpr uint8_t MAINTENANCE_BY_VEHICLE = 19;
+    static constexpr uint8_t INCIDENTS_BY_VEHICLE = 20;
+
+    // Month partitions; the key packs the month above the driver id (see
+    // DatabaseShard::partition_key)
+    static constexpr uint8_t TRIPS_BY_MONTH = 21;
+    static constexpr uint8_t EXPENSES_BY_MONTH = 22;
+
 private:
     unique_ptr<BTree> primary_index_;
+    unique_ptr<BTree> secondary_index_;
     
     unique_ptr<BPlusTree> driver_email_index_;
     unique_ptr<BPlusTree> vehicle_plate_index_;
     unique_ptr<BPlusTree> driver_username_index_;
 
     string index_dir_;
+    BufferPool *pool_;
+    mutable mutex mutex_;
+
+    bool loading_secondary_;
+    vector<pair<CompositeKey, BTreeValue>> secondary_load_;
+    // Entries removed during the load, dropped from it when it finishes
+    set<CompositeKey> secondary_unload_;
 
     bool ensure_directory_exists(const string& path) {
         struct stat st;
@@ -35,7 +68,9 @@ private:
     }
 
 public:
-    IndexManager(const string &index_dir) : index_dir_(index_dir) {}
+    // With a pool, every index file reads and writes its nodes through it
+    IndexManager(const string &index_dir, BufferPool *pool = nullptr)
+        : index_dir_(index_dir), pool_(pool), loading_secondary_(false) {}
 
     ~IndexManager()
     {
@@ -45,7 +80,7 @@ public:
     bool create_indexes()
     {
         cout << "      Creating primary B-Tree index..." << flush;
-        primary_index_ = make_unique<BTree>(index_dir_ + "/primary.idx");
+        primary_index_ = make_unique<BTree>(index_dir_ + "/primary.idx", pool_);
         if (!primary_index_->create()) {
             cerr << endl << "      ERROR: Failed to create primary index!" << endl;
             return false;
@@ -56,9 +91,17 @@ public:
         }
         cout << " ✓" << endl;
 
+        cout << "      Creating secondary B-Tree index..." << flush;
+        secondary_index_ = make_unique<BTree>(index_dir_ + "/secondary.idx", pool_);
+        if (!secondary_index_->create() || !secondary_index_->open()) {
+            cerr << endl << "      ERROR: Failed to create secondary index!" << endl;
+            return false;
+        }
+        cout << " ✓" << endl;
+
         cout << "      Creating driver email B+ Tree..." << flush;
         driver_email_index_ = make_unique<BPlusTree>(
-            index_dir_ + "/driver_email.idx", "driver_email");
+            index_dir_ + "/driver_email.idx", "driver_email", pool_);
         if (!driver_email_index_->create()) {
             cerr << endl << "      ERROR: Failed to create email index!" << endl;
             return false;
@@ -71,7 +114,7 @@ public:
 
         cout << "      Creating vehicle plate B+ Tree..." << flush;
         vehicle_plate_index_ = make_unique<BPlusTree>(
-            index_dir_ + "/vehicle_plate.idx", "vehicle_plate");
+            index_dir_ + "/vehicle_plate.idx", "vehicle_plate", pool_);
         if (!vehicle_plate_index_->create()) {
             cerr << endl << "      ERROR: Failed to create plate index!" << endl;
             return false;
@@ -84,7 +127,7 @@ public:
 
         cout << "      Creating driver username B+ Tree..." << flush;
         driver_username_index_ = make_unique<BPlusTree>(
-            index_dir_ + "/driver_username.idx", "driver_username");
+            index_dir_ + "/driver_username.idx", "driver_username", pool_);
         if (!driver_username_index_->create()) {
             cerr << endl << "      ERROR: Failed to create username index!" << endl;
             return false;
@@ -101,16 +144,19 @@ public:
     bool open_indexes()
     {
         cout << "      Opening primary index..." << flush;
-        primary_index_ = make_unique<BTree>(index_dir_ + "/primary.idx");
+        primary_index_ = make_unique<BTree>(index_dir_ + "/primary.idx", pool_);
         if (!primary_index_->open()) {
             cout << " NOT FOUND" << endl;
             return false;
         }
         cout << " ✓" << endl;
 
+        if (!open_secondary_index())
+            return false;
+
         cout << "      Opening email index..." << flush;
         driver_email_index_ = make_unique<BPlusTree>(
-            index_dir_ + "/driver_email.idx", "driver_email");
+            index_dir_ + "/driver_email.idx", "driver_email", pool_);
         if (!driver_email_index_->open()) {
             cout << " NOT FOUND" << endl;
             return false;
@@ -119,7 +165,7 @@ public:
 
         cout << "      Opening plate index..." << flush;
         vehicle_plate_index_ = make_unique<BPlusTree>(
-            index_dir_ + "/vehicle_plate.idx", "vehicle_plate");
+            index_dir_ + "/vehicle_plate.idx", "vehicle_plate", pool_);
         if (!vehicle_plate_index_->open()) {
             cout << " NOT FOUND" << endl;
             return false;
@@ -128,7 +174,7 @@ public:
 
         cout << "      Opening username index..." << flush;
         driver_username_index_ = make_unique<BPlusTree>(
-            index_dir_ + "/driver_username.idx", "driver_username");
+            index_dir_ + "/driver_username.idx", "driver_username", pool_);
         if (!driver_username_index_->open()) {
             cout << " NOT FOUND" << endl;
             return false;
@@ -138,10 +184,35 @@ public:
         return true;
     }
 
+    // Index directories from before the secondary index get an empty one;
+    // DatabaseManager fills it from the tables when attached. Database shards
+    // after the first open only this index, in a directory of their own.
+    bool open_secondary_index()
+    {
+        if (!ensure_directory_exists(index_dir_))
+            return false;
+
+        cout << "      Opening secondary index..." << flush;
+        secondary_index_ = make_unique<BTree>(index_dir_ + "/secondary.idx", pool_);
+        if (!secondary_index_->open() &&
+            (!secondary_index_->create() || !secondary_index_->open())) {
+            cout << " FAILED" << endl;
+            return false;
+        }
+        cout << " ✓" << endl;
+        return true;
+    }
+
+    const string &get_index_dir() const { return index_dir_; }
+    BufferPool *get_pool() const { return pool_; }
+
     void close_all()
     {
+        lock_guard<mutex> lock(mutex_);
         if (primary_index_)
             primary_index_->close();
+        if (secondary_index_)
+            secondary_index_->close();
         if (driver_email_index_)
             driver_email_index_->close();
         if (vehicle_plate_index_)
@@ -150,9 +221,29 @@ public:
             driver_username_index_->close();
     }
 
+    // Forces every open index to disk; a checkpoint does so before it drops
+    // the log that would otherwise rebuild the secondary index
+    bool sync()
+    {
+        lock_guard<mutex> lock(mutex_);
+        bool ok = true;
+        if (primary_index_)
+            ok = primary_index_->sync() && ok;
+        if (secondary_index_)
+            ok = secondary_index_->sync() && ok;
+        if (driver_email_index_)
+            ok = driver_email_index_->sync() && ok;
+        if (vehicle_plate_index_)
+            ok = vehicle_plate_index_->sync() && ok;
+        if (driver_username_index_)
+            ok = driver_username_index_->sync() && ok;
+        return ok;
+    }
+
     bool insert_primary(uint8_t entity_type, uint64_t entity_id,
                         uint64_t timestamp, uint64_t record_offset)
     {
+        lock_guard<mutex> lock(mutex_);
         if (!primary_index_)
             return false;
 
@@ -162,9 +253,29 @@ public:
         return primary_index_->insert(key, value);
     }
 
+    // entries are (entity_id, timestamp); inserting in key order keeps the
+    // B-Tree's node cache warm across the batch
+    bool insert_primary_batch(uint8_t entity_type, vector<pair<uint64_t, uint64_t>> entries)
+    {
+        lock_guard<mutex> lock(mutex_);
+        if (!primary_index_)
+            return false;
+
+        sort(entries.begin(), entries.end());
+        bool ok = true;
+        for (const auto &entry : entries)
+        {
+            CompositeKey key(entity_type, entry.first, entry.second, 0);
+            BTreeValue value(0, 1, 1024);
+            ok = primary_index_->insert(key, value) && ok;
+        }
+        return ok;
+    }
+
     bool search_primary(uint8_t entity_type, uint64_t entity_id,
                         uint64_t timestamp, uint64_t &record_offset)
     {
+        lock_guard<mutex> lock(mutex_);
         if (!primary_index_)
             return false;
 
@@ -180,9 +291,30 @@ public:
         return false;
     }
 
+    bool update_primary(uint8_t entity_type, uint64_t entity_id,
+                        uint64_t timestamp, uint64_t record_offset)
+    {
+        lock_guard<mutex> lock(mutex_);
+        if (!primary_index_)
+            return false;
+
+        CompositeKey key(entity_type, entity_id, timestamp, 0);
+        return primary_index_->update(key, BTreeValue(record_offset, 1, 1024));
+    }
+
+    bool remove_primary(uint8_t entity_type, uint64_t entity_id, uint64_t timestamp)
+    {
+        lock_guard<mutex> lock(mutex_);
+        if (!primary_index_)
+            return false;
+
+        return primary_index_->remove(CompositeKey(entity_type, entity_id, timestamp, 0));
+    }
+
     vector<uint64_t> range_query_primary(uint8_t entity_type, uint64_t entity_id,
                                               uint64_t start_time, uint64_t end_time)
     {
+        lock_guard<mutex> lock(mutex_);
         vector<uint64_t> offsets;
         if (!primary_index_)
             return offsets;
@@ -200,8 +332,123 @@ public:
         return offsets;
     }
 
+    // Keys are (type, foreign key, record id, slot), so one key's entries are
+    // contiguous and ordered by record id. Callers verify each entry against
+    // the record in its slot; entries left behind by deletes or moves are
+    // simply skipped. Pass fresh for records that cannot be indexed yet.
+    bool insert_secondary(uint8_t index_type, uint64_t key, uint64_t record_id,
+                          uint32_t slot, bool fresh = false)
+    {
+        lock_guard<mutex> lock(mutex_);
+        if (!secondary_index_)
+            return false;
+
+        CompositeKey entry(index_type, key, record_id, slot);
+        BTreeValue value(slot, 1, 1024);
+        if (loading_secondary_)
+        {
+            secondary_unload_.erase(entry);
+            secondary_load_.push_back({entry, value});
+            return true;
+        }
+        if (!fresh && secondary_index_->search(entry, value))
+            return true;
+
+        return secondary_index_->insert(entry, value);
+    }
+
+    bool remove_secondary(uint8_t index_type, uint64_t key, uint64_t record_id, uint32_t slot)
+    {
+        lock_guard<mutex> lock(mutex_);
+        if (!secondary_index_)
+            return false;
+
+        CompositeKey entry(index_type, key, record_id, slot);
+        if (loading_secondary_)
+        {
+            secondary_unload_.insert(entry);
+            return true;
+        }
+        return secondary_index_->remove(entry);
+    }
+
+    // Between these two calls insert_secondary and remove_secondary only
+    // collect entries, and the secondary index is then rebuilt from them in
+    // one bulk load, replacing what it held. Used to fill the index from the
+    // tables.
+    void begin_secondary_load()
+    {
+        lock_guard<mutex> lock(mutex_);
+        loading_secondary_ = true;
+        secondary_load_.clear();
+        secondary_unload_.clear();
+    }
+
+    bool finish_secondary_load()
+    {
+        lock_guard<mutex> lock(mutex_);
+        loading_secondary_ = false;
+        vector<pair<CompositeKey, BTreeValue>> entries;
+        entries.swap(secondary_load_);
+        if (!secondary_unload_.empty())
+        {
+            entries.erase(remove_if(entries.begin(), entries.end(),
+                                    [this](const pair<CompositeKey, BTreeValue> &entry)
+                                    { return secondary_unload_.count(entry.first) != 0; }),
+                          entries.end());
+            secondary_unload_.clear();
+        }
+        return secondary_index_ && secondary_index_->bulk_load(move(entries));
+    }
+
+    // Entries of one key starting at (from_id, from_slot); max_results of 0
+    // returns all of them
+    vector<SecondaryEntry> lookup_secondary(uint8_t index_type, uint64_t key,
+                                            uint64_t from_id = 0, uint32_t from_slot = 0,
+                                            size_t max_results = 0)
+    {
+        lock_guard<mutex> lock(mutex_);
+        vector<SecondaryEntry> entries;
+        if (!secondary_index_)
+            return entries;
+
+        CompositeKey start_key(index_type, key, from_id, from_slot);
+        CompositeKey end_key(index_type, key, UINT64_MAX, UINT32_MAX);
+
+        for (const auto &result : secondary_index_->range_query(start_key, end_key, max_results))
+        {
+            entries.push_back({result.first.timestamp, result.first.sequence, result.first.primary_id});
+        }
+        return entries;
+    }
+
+    // Entries of every key in [first_key, last_key], ordered by key
+    vector<SecondaryEntry> lookup_secondary_range(uint8_t index_type, uint64_t first_key, uint64_t last_key,
+                                                  size_t max_results = 0)
+    {
+        lock_guard<mutex> lock(mutex_);
+        vector<SecondaryEntry> entries;
+        if (!secondary_index_)
+            return entries;
+
+        CompositeKey start_key(index_type, first_key, 0, 0);
+        CompositeKey end_key(index_type, last_key, UINT64_MAX, UINT32_MAX);
+        for (const auto &result : secondary_index_->range_query(start_key, end_key, max_results))
+        {
+            entries.push_back({result.first.timestamp, result.first.sequence, result.first.primary_id});
+        }
+        return entries;
+    }
+
+    uint64_t get_secondary_record_count() const
+    {
+        lock_guard<mutex> lock(mutex_);
+        return secondary_index_ ? secondary_index_->get_total_records() : 0;
+    }
+
     bool insert_driver_email(const string &email, uint64_t driver_id)
     {
+        lock_guard<mutex> lock(mutex_);
         if (!driver_email_index_)
             return false;
 
@@ -212,6 +459,7 @@ public:
 
     bool search_by_email(const string &email, uint64_t &driver_id)
     {
+        lock_guard<mutex> lock(mutex_);
         if (!driver_email_index_)
             return false;
 
@@ -227,8 +475,29 @@ public:
         return false;
     }
 
+    bool remove_driver_email(const string &email, uint64_t driver_id)
+    {
+        lock_guard<mutex> lock(mutex_);
+        if (!driver_email_index_)
+            return false;
+
+        return driver_email_index_->remove(BPlusKey(email), driver_id);
+    }
+
+    // Moves a driver's entry from old_email to new_email
+    bool update_driver_email(const string &old_email, const string &new_email, uint64_t driver_id)
+    {
+        lock_guard<mutex> lock(mutex_);
+        if (!driver_email_index_)
+            return false;
+
+        driver_email_index_->remove(BPlusKey(old_email), driver_id);
+        return driver_email_index_->insert(BPlusKey(new_email), BPlusValue(driver_id, 1));
+    }
+
     bool insert_driver_username(const string &username, uint64_t driver_id)
     {
+        lock_guard<mutex> lock(mutex_);
         if (!driver_username_index_)
             return false;
 
@@ -240,6 +509,7 @@ public:
 
     bool search_by_username(const string &username, uint64_t &driver_id)
     {
+        lock_guard<mutex> lock(mutex_);
         if (!driver_username_index_)
             return false;
 
@@ -255,8 +525,18 @@ public:
         return false;
     }
 
+    bool remove_driver_username(const string &username, uint64_t driver_id)
+    {
+        lock_guard<mutex> lock(mutex_);
+        if (!driver_username_index_)
+            return false;
+
+        return driver_username_index_->remove(BPlusKey(username), driver_id);
+    }
+
     bool insert_vehicle_plate(const string &plate, uint64_t vehicle_id)
     {
+        lock_guard<mutex> lock(mutex_);
         if (!vehicle_plate_index_)
             return false;
 
@@ -268,6 +548,7 @@ public:
 
     bool search_by_plate(const string &plate, uint64_t &vehicle_id)
     {
+        lock_guard<mutex> lock(mutex_);
         if (!vehicle_plate_index_)
             return false;
 
@@ -283,37 +564,88 @@ public:
         return false;
     }
 
+    bool remove_vehicle_plate(const string &plate, uint64_t vehicle_id)
+    {
+        lock_guard<mutex> lock(mutex_);
+        if (!vehicle_plate_index_)
+            return false;
+
+        return vehicle_plate_index_->remove(BPlusKey(plate), vehicle_id);
+    }
+
+    // Moves a vehicle's entry from old_plate to new_plate
+    bool update_vehicle_plate(const string &old_plate, const string &new_plate, uint64_t vehicle_id)
+    {
+        lock_guard<mutex> lock(mutex_);
+        if (!vehicle_plate_index_)
+            return false;
+
+        vehicle_plate_index_->remove(BPlusKey(old_plate), vehicle_id);
+        return vehicle_plate_index_->insert(BPlusKey(new_plate), BPlusValue(vehicle_id, 2));
+    }
+
+    // Replace the indexes' contents, bulk-loaded from the records
     bool rebuild_driver_indexes(const vector<DriverProfile> &drivers)
     {
+        lock_guard<mutex> lock(mutex_);
+        if (!driver_email_index_ || !driver_username_index_)
+            return false;
+
+        vector<pair<BPlusKey, BPlusValue>> emails;
+        vector<pair<BPlusKey, BPlusValue>> usernames;
+        emails.reserve(drivers.size());
+        usernames.reserve(drivers.size());
         for (const auto &driver : drivers)
         {
-            insert_driver_email(driver.email, driver.driver_id);
-            insert_driver_username(driver.username, driver.driver_id);
+            emails.push_back({BPlusKey(driver.email), BPlusValue(driver.driver_id, 1)});
+            usernames.push_back({BPlusKey(driver.username), BPlusValue(driver.driver_id, 1)});
         }
-        return true;
+        return driver_email_index_->bulk_load(move(emails)) && driver_username_index_->bulk_load(move(usernames));
+    }
+
+    static pair<CompositeKey, BTreeValue> primary_entry(uint8_t entity_type, uint64_t entity_id, uint64_t timestamp)
+    {
+        return make_pair(CompositeKey(entity_type, entity_id, timestamp, 0), BTreeValue(0, 1, 1024));
+    }
+
+    bool rebuild_primary_index(vector<pair<CompositeKey, BTreeValue>> entries)
+    {
+        lock_guard<mutex> lock(mutex_);
+        if (!primary_index_)
+            return false;
+        return primary_index_->bulk_load(move(entries));
     }
 
     bool rebuild_vehicle_indexes(const vector<VehicleInfo> &vehicles)
     {
+        lock_guard<mutex> lock(mutex_);
+        if (!vehicle_plate_index_)
+            return false;
+
+        vector<pair<BPlusKey, BPlusValue>> plates;
+        plates.reserve(vehicles.size());
         for (const auto &vehicle : vehicles)
         {
-            insert_vehicle_plate(vehicle.license_plate, vehicle.vehicle_id);
+            plates.push_back({BPlusKey(vehicle.license_plate), BPlusValue(vehicle.vehicle_id, 2)});
         }
-        return true;
+        return vehicle_plate_index_->bulk_load(move(plates));
     }
 
     uint64_t get_primary_record_count() const
     {
+        lock_guard<mutex> lock(mutex_);
         return primary_index_ ? primary_index_->get_total_records() : 0;
     }
 
     uint64_t get_driver_email_count() const
     {
+        lock_guard<mutex> lock(mutex_);
         return driver_email_index_ ? driver_email_index_->get_total_entries() : 0;
     }
 
     uint64_t get_vehicle_plate_count() const
     {
+        lock_guard<mutex> lock(mutex_);
         return vehicle_plate_index_ ? vehicle_plate_index_->get_total_entries() : 0;
     }
 };
@@ -0,0 +1,226 @@
+#ifndef IORING_H
+#define IORING_H
+
+#include <vector>
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+using namespace std;
+
+// Minimal io_uring submission queue for batches of positional reads. The
+// database's pread path hands it all the reads of a multi-record operation
+// at once, so the device sees them together instead of one per blocking
+// call. Not thread-safe: each user owns a ring while it submits. open()
+// fails on kernels without io_uring (or where it is disabled), and callers
+// then stay with pread.
+class IoRing
+{
+public:
+    struct Read
+    {
+        int fd;
+        uint64_t offset;
+        void *data;
+        uint32_t length;
+    };
+
+private:
+    int ring_fd_;
+    unsigned entries_;
+
+    uint8_t *sq_ring_;
+    size_t sq_ring_size_;
+    uint8_t *cq_ring_;
+    size_t cq_ring_size_;
+    io_uring_sqe *sqes_;
+    size_t sqes_size_;
+
+    unsigned *sq_tail_;
+    unsigned *sq_mask_;
+    unsigned *sq_array_;
+    unsigned *cq_head_;
+    unsigned *cq_tail_;
+    unsigned *cq_mask_;
+    io_uring_cqe *cqes_;
+
+    static bool read_rest(const Read &read, uint32_t done)
+    {
+        uint8_t *out = static_cast<uint8_t *>(read.data) + done;
+        uint64_t offset = read.offset + done;
+        uint32_t length = read.length - done;
+        while (length > 0)
+        {
+            ssize_t n = pread(read.fd, out, length, offset);
+            if (n <= 0)
+                return false;
+            out += n;
+            offset += n;
+            length -= n;
+        }
+        return true;
+    }
+
+    // Submits reads[first, first + count) and waits for all of them
+    bool run(vector<Read> &reads, size_t first, unsigned count)
+    {
+        unsigned tail = *sq_tail_;
+        for (unsigned i = 0; i < count; i++)
+        {
+            const Read &read = reads[first + i];
+            unsigned index = tail & *sq_mask_;
+            io_uring_sqe *sqe = &sqes_[index];
+            memset(sqe, 0, sizeof(*sqe));
+            sqe->opcode = IORING_OP_READ;
+            sqe->fd = read.fd;
+            sqe->off = read.offset;
+            sqe->addr = reinterpret_cast<uint64_t>(read.data);
+            sqe->len = read.length;
+            sqe->user_data = first + i;
+            sq_array_[index] = index;
+            tail++;
+        }
+        __atomic_store_n(sq_tail_, tail, __ATOMIC_RELEASE);
+
+        bool ok = true;
+        unsigned to_submit = count;
+        unsigned completed = 0;
+        while (completed < count)
+        {
+            int entered = static_cast<int>(syscall(__NR_io_uring_enter, ring_fd_, to_submit, 1,
+                                                   IORING_ENTER_GETEVENTS, nullptr, 0));
+            if (entered < 0 && errno != EINTR)
+                return false;
+            if (entered > 0)
+                to_submit -= min(to_submit, static_cast<unsigned>(entered));
+
+            unsigned head = *cq_head_;
+            unsigned ready = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+            for (; head != ready; head++)
+            {
+                const io_uring_cqe &cqe = cqes_[head & *cq_mask_];
+                const Read &read = reads[cqe.user_data];
+                // Short reads are finished synchronously
+                if (cqe.res < 0 || (static_cast<uint32_t>(cqe.res) < read.length &&
+                                    !read_rest(read, static_cast<uint32_t>(cqe.res))))
+                    ok = false;
+                completed++;
+            }
+            __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+        }
+        return ok;
+    }
+
+public:
+    IoRing()
+        : ring_fd_(-1), entries_(0), sq_ring_(nullptr), sq_ring_size_(0), cq_ring_(nullptr),
+          cq_ring_size_(0), sqes_(nullptr), sqes_size_(0) {}
+
+    ~IoRing()
+    {
+        close();
+    }
+
+    IoRing(const IoRing &) = delete;
+    IoRing &operator=(const IoRing &) = delete;
+
+    bool open(unsigned entries)
+    {
+        close();
+        io_uring_params params;
+        memset(&params, 0, sizeof(params));
+        ring_fd_ = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+        if (ring_fd_ < 0)
+            return false;
+        entries_ = params.sq_entries;
+
+        sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cq_ring_size_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        bool single_map = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (single_map)
+            sq_ring_size_ = cq_ring_size_ = max(sq_ring_size_, cq_ring_size_);
+
+        void *sq = mmap(nullptr, sq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        ring_fd_, IORING_OFF_SQ_RING);
+        if (sq == MAP_FAILED)
+        {
+            close();
+            return false;
+        }
+        sq_ring_ = static_cast<uint8_t *>(sq);
+
+        if (single_map)
+        {
+            cq_ring_ = sq_ring_;
+        }
+        else
+        {
+            void *cq = mmap(nullptr, cq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                            ring_fd_, IORING_OFF_CQ_RING);
+            if (cq == MAP_FAILED)
+            {
+                close();
+                return false;
+            }
+            cq_ring_ = static_cast<uint8_t *>(cq);
+        }
+
+        sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+        void *sqes = mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                          ring_fd_, IORING_OFF_SQES);
+        if (sqes == MAP_FAILED)
+        {
+            close();
+            return false;
+        }
+        sqes_ = static_cast<io_uring_sqe *>(sqes);
+
+        sq_tail_ = reinterpret_cast<unsigned *>(sq_ring_ + params.sq_off.tail);
+        sq_mask_ = reinterpret_cast<unsigned *>(sq_ring_ + params.sq_off.ring_mask);
+        sq_array_ = reinterpret_cast<unsigned *>(sq_ring_ + params.sq_off.array);
+        cq_head_ = reinterpret_cast<unsigned *>(cq_ring_ + params.cq_off.head);
+        cq_tail_ = reinterpret_cast<unsigned *>(cq_ring_ + params.cq_off.tail);
+        cq_mask_ = reinterpret_cast<unsigned *>(cq_ring_ + params.cq_off.ring_mask);
+        cqes_ = reinterpret_cast<io_uring_cqe *>(cq_ring_ + params.cq_off.cqes);
+        return true;
+    }
+
+    void close()
+    {
+        if (sqes_)
+            munmap(sqes_, sqes_size_);
+        if (cq_ring_ && cq_ring_ != sq_ring_)
+            munmap(cq_ring_, cq_ring_size_);
+        if (sq_ring_)
+            munmap(sq_ring_, sq_ring_size_);
+        sqes_ = nullptr;
+        cq_ring_ = nullptr;
+        sq_ring_ = nullptr;
+        if (ring_fd_ >= 0)
+        {
+            ::close(ring_fd_);
+            ring_fd_ = -1;
+        }
+    }
+
+    bool is_open() const { return ring_fd_ >= 0; }
+
+    // Reads everything, a ring's worth at a time. False if any read failed
+    // or hit the end of its file.
+    bool read_all(vector<Read> &reads)
+    {
+        bool ok = true;
+        for (size_t first = 0; first < reads.size(); first += entries_)
+        {
+            unsigned count = static_cast<unsigned>(min<size_t>(entries_, reads.size() - first));
+            ok = run(reads, first, count) && ok;
+        }
+        return ok;
+    }
+};
+
+#endif
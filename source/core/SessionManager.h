@@ -167,7 +167,7 @@ public:
         }
         
         DriverProfile new_driver;
-        new_driver.driver_id = db_.get_max_driver_id() + 1;
+        new_driver.driver_id = db_.next_driver_id();
         
         strncpy(new_driver.username, username.c_str(), sizeof(new_driver.username) - 1);
         strncpy(new_driver.full_name, full_name.c_str(), sizeof(new_driver.full_name) - 1);
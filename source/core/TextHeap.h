@@ -0,0 +1,181 @@
+#ifndef TEXTHEAP_H
+#define TEXTHEAP_H
+
+#include <string>
+#include <atomic>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+using namespace std;
+
+#pragma pack(push, 1)
+struct HeapRef
+{
+    uint64_t offset;
+    uint32_t length;
+};
+#pragma pack(pop)
+
+// Append-only file holding the text fields of compact database records. A
+// record slot keeps a HeapRef per text field; an empty string is {0, 0}.
+// Text is never rewritten in place, so a reference stays valid for as long
+// as a record holds it and unchanged text can be shared by later versions
+// of the record. Appends go through the database's write-ahead log, which
+// makes them durable together with the slot that refers to them.
+class TextHeap
+{
+private:
+    static const uint64_t HEADER_SIZE = 64;
+    static const uint64_t MAP_RESERVE = 1ULL << 36;
+
+    int fd_;
+    uint8_t *map_base_;
+    atomic<uint64_t> tail_;
+
+    bool write_all(uint64_t offset, const uint8_t *data, uint64_t length)
+    {
+        while (length > 0)
+        {
+            ssize_t n = pwrite(fd_, data, length, offset);
+            if (n <= 0)
+                return false;
+            data += n;
+            offset += n;
+            length -= n;
+        }
+        return true;
+    }
+
+public:
+    TextHeap() : fd_(-1), map_base_(nullptr), tail_(0) {}
+
+    ~TextHeap()
+    {
+        close();
+    }
+
+    static bool create(const string &path)
+    {
+        int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0)
+            return false;
+
+        char header[HEADER_SIZE];
+        memset(header, 0, sizeof(header));
+        memcpy(header, "SDMHEAP1", 8);
+        bool ok = pwrite(fd, header, sizeof(header), 0) == static_cast<ssize_t>(sizeof(header)) && fdatasync(fd) == 0;
+        ::close(fd);
+        return ok;
+    }
+
+    // Reads go through a read-only mapping reserved far past the end of the
+    // file, so it covers later appends without remapping
+    bool open(const string &path, bool use_mmap)
+    {
+        close();
+        fd_ = ::open(path.c_str(), O_RDWR);
+        if (fd_ < 0)
+            return false;
+
+        char magic[8];
+        struct stat st;
+        if (pread(fd_, magic, sizeof(magic), 0) != static_cast<ssize_t>(sizeof(magic)) ||
+            memcmp(magic, "SDMHEAP1", 8) != 0 || fstat(fd_, &st) != 0)
+        {
+            close();
+            return false;
+        }
+        tail_ = max(static_cast<uint64_t>(st.st_size), HEADER_SIZE);
+
+        if (use_mmap)
+        {
+            void *map = mmap(nullptr, MAP_RESERVE, PROT_READ, MAP_SHARED, fd_, 0);
+            if (map != MAP_FAILED)
+                map_base_ = static_cast<uint8_t *>(map);
+        }
+        return true;
+    }
+
+    void close()
+    {
+        if (map_base_)
+        {
+            munmap(map_base_, MAP_RESERVE);
+            map_base_ = nullptr;
+        }
+        if (fd_ >= 0)
+        {
+            ::close(fd_);
+            fd_ = -1;
+        }
+        tail_ = 0;
+    }
+
+    bool is_open() const { return fd_ >= 0; }
+    int fd() const { return fd_; }
+
+    // Claims length bytes at the end of the heap
+    uint64_t reserve(uint32_t length)
+    {
+        return tail_.fetch_add(length);
+    }
+
+    // Also used by log replay, which may write past the current tail
+    bool write(uint64_t offset, const void *data, uint64_t length)
+    {
+        if (fd_ < 0 || offset < HEADER_SIZE)
+            return false;
+        uint64_t tail = tail_.load();
+        while (tail < offset + length && !tail_.compare_exchange_weak(tail, offset + length))
+        {
+        }
+        return write_all(offset, static_cast<const uint8_t *>(data), length);
+    }
+
+    // A reference past the tail, left by a slot whose text never reached the
+    // heap, reads as an error rather than past the end of the file
+    bool read(const HeapRef &ref, void *data) const
+    {
+        if (ref.length == 0)
+            return true;
+        if (ref.offset < HEADER_SIZE || ref.offset + ref.length > tail_.load())
+            return false;
+        if (map_base_ && ref.offset + ref.length <= MAP_RESERVE)
+        {
+            memcpy(data, map_base_ + ref.offset, ref.length);
+            return true;
+        }
+        return pread(fd_, data, ref.length, ref.offset) == static_cast<ssize_t>(ref.length);
+    }
+
+    bool equals(const HeapRef &ref, const char *text, uint32_t length) const
+    {
+        if (ref.length != length)
+            return false;
+        if (length == 0)
+            return true;
+        if (ref.offset < HEADER_SIZE || ref.offset + ref.length > tail_.load())
+            return false;
+        if (map_base_ && ref.offset + ref.length <= MAP_RESERVE)
+            return memcmp(map_base_ + ref.offset, text, length) == 0;
+
+        string stored(length, '\0');
+        return read(ref, &stored[0]) && memcmp(stored.data(), text, length) == 0;
+    }
+
+    bool sync()
+    {
+        return fd_ < 0 || fdatasync(fd_) == 0;
+    }
+
+    uint64_t size() const
+    {
+        return tail_.load();
+    }
+};
+
+#endif
@@ -0,0 +1,211 @@
+#ifndef TRIPCOLUMNSTORE_H
+#define TRIPCOLUMNSTORE_H
+
+#include "../../include/sdm_types.hpp"
+#include <string>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+using namespace std;
+
+#pragma pack(push, 1)
+struct TripColumnHeader
+{
+    char magic[8];
+    uint32_t capacity;
+    uint64_t stamp;
+};
+#pragma pack(pop)
+
+// Struct-of-arrays copy of the numeric trip fields analytics read, one entry
+// per trip table slot, kept in a memory-mapped side file next to the
+// database. The columns are derived data: the header stamp names the
+// checkpoint they match and is cleared (synchronously) before the first
+// change after a checkpoint, so a file that was not saved by the latest
+// checkpoint is detected at open and rebuilt from the trip table.
+class TripColumnStore
+{
+private:
+    static const uint64_t PAGE_SIZE = 4096;
+
+    int fd_;
+    uint8_t *map_base_;
+    uint64_t map_size_;
+    uint32_t capacity_;
+    bool dirty_;
+
+    uint64_t *trip_id_;
+    uint64_t *driver_id_;
+    uint64_t *start_time_;
+    uint32_t *duration_;
+    uint32_t *harsh_events_;
+    double *distance_;
+    double *fuel_consumed_;
+    double *max_speed_;
+
+    template <typename T>
+    void column(T *&base, uint64_t &offset)
+    {
+        base = map_base_ ? reinterpret_cast<T *>(map_base_ + offset) : nullptr;
+        offset += (static_cast<uint64_t>(capacity_) * sizeof(T) + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+    }
+
+    // Points the columns into the mapping and returns the file size
+    uint64_t layout()
+    {
+        uint64_t offset = PAGE_SIZE;
+        column(trip_id_, offset);
+        column(driver_id_, offset);
+        column(start_time_, offset);
+        column(duration_, offset);
+        column(harsh_events_, offset);
+        column(distance_, offset);
+        column(fuel_consumed_, offset);
+        column(max_speed_, offset);
+        return offset;
+    }
+
+    TripColumnHeader *header() { return reinterpret_cast<TripColumnHeader *>(map_base_); }
+
+public:
+    TripColumnStore()
+        : fd_(-1), map_base_(nullptr), map_size_(0), capacity_(0), dirty_(false) {}
+
+    ~TripColumnStore()
+    {
+        close();
+    }
+
+    // Maps the file for capacity slots. valid is set when its contents match
+    // checkpoint stamp; otherwise the columns are cleared for a rebuild.
+    bool open(const string &path, uint32_t capacity, uint64_t stamp, bool &valid)
+    {
+        close();
+        valid = false;
+        capacity_ = capacity;
+
+        fd_ = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+        if (fd_ < 0)
+            return false;
+
+        uint64_t size = layout();
+        struct stat st;
+        TripColumnHeader existing;
+        memset(&existing, 0, sizeof(existing));
+        if (fstat(fd_, &st) == 0 && static_cast<uint64_t>(st.st_size) == size)
+        {
+            valid = pread(fd_, &existing, sizeof(existing), 0) == static_cast<ssize_t>(sizeof(existing)) &&
+                    memcmp(existing.magic, "SDMCOL01", 8) == 0 &&
+                    existing.capacity == capacity && existing.stamp == stamp && stamp != 0;
+        }
+
+        // Truncating first leaves a stale file as zero-filled holes
+        if (!valid && (ftruncate(fd_, 0) != 0 || ftruncate(fd_, size) != 0))
+        {
+            close();
+            return false;
+        }
+
+        void *map = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+        if (map == MAP_FAILED)
+        {
+            valid = false;
+            close();
+            return false;
+        }
+        map_base_ = static_cast<uint8_t *>(map);
+        map_size_ = size;
+        layout();
+
+        if (!valid)
+        {
+            memcpy(header()->magic, "SDMCOL01", 8);
+            header()->capacity = capacity;
+            header()->stamp = 0;
+        }
+        dirty_ = !valid;
+        return true;
+    }
+
+    void close()
+    {
+        if (map_base_)
+        {
+            munmap(map_base_, map_size_);
+            map_base_ = nullptr;
+            map_size_ = 0;
+        }
+        if (fd_ >= 0)
+        {
+            ::close(fd_);
+            fd_ = -1;
+        }
+    }
+
+    bool is_open() const { return map_base_ != nullptr; }
+
+    // Must run before the trip table changes, under its exclusive lock
+    void begin_update()
+    {
+        if (!map_base_ || dirty_)
+            return;
+        header()->stamp = 0;
+        msync(map_base_, PAGE_SIZE, MS_SYNC);
+        dirty_ = true;
+    }
+
+    void set(uint32_t slot, const TripRecord &trip)
+    {
+        if (!map_base_ || slot >= capacity_)
+            return;
+        trip_id_[slot] = trip.trip_id;
+        driver_id_[slot] = trip.driver_id;
+        start_time_[slot] = trip.start_time;
+        duration_[slot] = trip.duration;
+        harsh_events_[slot] = static_cast<uint32_t>(trip.harsh_braking_count) + trip.rapid_acceleration_count +
+                              trip.speeding_count + trip.sharp_turn_count;
+        distance_[slot] = trip.distance;
+        fuel_consumed_[slot] = trip.fuel_consumed;
+        max_speed_[slot] = trip.max_speed;
+    }
+
+    void clear(uint32_t slot)
+    {
+        if (map_base_ && slot < capacity_)
+            trip_id_[slot] = 0;
+    }
+
+    // Called by a checkpoint once the database file is durable
+    bool save(uint64_t stamp)
+    {
+        if (!map_base_)
+            return true;
+        if (dirty_ && msync(map_base_, map_size_, MS_SYNC) != 0)
+            return false;
+        dirty_ = false;
+        if (header()->stamp == stamp)
+            return true;
+        header()->stamp = stamp;
+        return msync(map_base_, PAGE_SIZE, MS_SYNC) == 0;
+    }
+
+    uint64_t trip_id(uint32_t slot) const { return trip_id_[slot]; }
+    uint64_t driver_id(uint32_t slot) const { return driver_id_[slot]; }
+    uint64_t start_time(uint32_t slot) const { return start_time_[slot]; }
+
+    void accumulate(uint32_t slot, TripTotals &totals) const
+    {
+        totals.trip_count++;
+        totals.total_distance += distance_[slot];
+        totals.total_duration += duration_[slot];
+        totals.total_fuel += fuel_consumed_[slot];
+        totals.harsh_events += harsh_events_[slot];
+        if (max_speed_[slot] > totals.max_speed)
+            totals.max_speed = max_speed_[slot];
+    }
+};
+
+#endif
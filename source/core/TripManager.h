@@ -19,7 +19,6 @@ private:
     DatabaseManager &db_;
     CacheManager &cache_;
     IndexManager &index_;
-    uint64_t next_trip_id_;
 
     CircularQueue<GPSWaypoint> gps_buffer_;
 
@@ -76,7 +75,6 @@ public:
         : db_(db), cache_(cache), index_(index),
           gps_buffer_(gps_buffer_size) 
     {
-        next_trip_id_ = db_.get_max_trip_id() + 1;
         load_active_trips();
     }
 
@@ -180,6 +178,69 @@ public:
         return log_gps_point(trip_id, latitude, longitude, speed, 0, 5.0);
     }
 
+    // Returns the number of points accepted; stops at the first rejected one
+    size_t log_gps_points(uint64_t trip_id, const vector<GPSWaypoint> &points)
+    {
+        auto it = std::find_if(active_trips_.begin(), active_trips_.end(),
+                               [trip_id](const ActiveTrip &t)
+                               { return t.trip_id == trip_id; });
+        if (it == active_trips_.end())
+        {
+            return 0;
+        }
+
+        uint64_t now = get_current_timestamp();
+        size_t logged = 0;
+        for (GPSWaypoint waypoint : points)
+        {
+            if (waypoint.timestamp == 0)
+                waypoint.timestamp = now;
+
+            if (!gps_buffer_.try_enqueue(waypoint))
+                break;
+
+            it->waypoints.push_back(waypoint);
+            detect_driving_events(*it, waypoint);
+            logged++;
+        }
+        return logged;
+    }
+
+    // Stores already completed trips (e.g. from a telematics backfill) for
+    // one driver in a single database write. Returns the new trip ids.
+    vector<uint64_t> import_trips(uint64_t driver_id, vector<TripRecord> trips)
+    {
+        vector<uint64_t> ids;
+        if (trips.empty())
+            return ids;
+
+        uint64_t first_id = db_.next_trip_id(trips.size());
+        vector<pair<uint64_t, uint64_t>> index_entries;
+
+        for (size_t i = 0; i < trips.size(); i++)
+        {
+            TripRecord &trip = trips[i];
+            trip.trip_id = first_id + i;
+            trip.driver_id = driver_id;
+            if (trip.duration == 0 && trip.end_time > trip.start_time)
+                trip.duration = trip.end_time - trip.start_time;
+
+            ids.push_back(trip.trip_id);
+            index_entries.push_back({trip.trip_id, trip.start_time});
+        }
+
+        if (!db_.create_trips_batch(trips))
+        {
+            return vector<uint64_t>();
+        }
+
+        index_.insert_primary_batch(3, index_entries);
+        update_driver_stats(driver_id, trips);
+        cache_.clear_query_cache();
+
+        return ids;
+    }
+
     bool end_trip(uint64_t trip_id, double end_lat, double end_lon,
                   const std::string &end_address = "")
     {
@@ -335,25 +396,7 @@ public:
                                                     uint64_t start_time,
                                                     uint64_t end_time)
     {
-        std::vector<TripRecord> trips;
-
-        auto offsets = index_.range_query_primary(3, driver_id, start_time, end_time);
-
-        for (uint64_t offset : offsets)
-        {
-            TripRecord trip;
-
-            auto all_trips = db_.get_trips_by_driver(driver_id, 10000);
-            for (const auto &t : all_trips)
-            {
-                if (t.start_time >= start_time && t.start_time <= end_time)
-                {
-                    trips.push_back(t);
-                }
-            }
-        }
-
-        return trips;
+        return db_.get_trips_by_date_range(driver_id, start_time, end_time);
     }
 
     bool get_trip_details(uint64_t trip_id, TripRecord &trip)
@@ -399,25 +442,13 @@ public:
     {
         TripStatistics stats = {};
 
-        auto trips = db_.get_trips_by_driver(driver_id, 10000);
-
-        for (const auto &trip : trips)
-        {
-            stats.total_trips++;
-            stats.total_distance += trip.distance;
-            stats.total_duration += trip.duration;
-            stats.total_fuel += trip.fuel_consumed;
-
-            if (trip.max_speed > stats.max_speed)
-            {
-                stats.max_speed = trip.max_speed;
-            }
-
-            stats.total_harsh_events += trip.harsh_braking_count +
-                                        trip.rapid_acceleration_count +
-                                        trip.speeding_count +
-                                        trip.sharp_turn_count;
-        }
+        TripTotals totals = db_.get_trip_totals(driver_id);
+        stats.total_trips = totals.trip_count;
+        stats.total_distance = totals.total_distance;
+        stats.total_duration = totals.total_duration;
+        stats.total_fuel = totals.total_fuel;
+        stats.max_speed = totals.max_speed;
+        stats.total_harsh_events = static_cast<uint32_t>(totals.harsh_events);
 
         if (stats.total_trips > 0 && stats.total_duration > 0)
         {
@@ -449,7 +480,7 @@ public:
 private:
     uint64_t generate_trip_id()
     {
-        return next_trip_id_++;
+        return db_.next_trip_id();
     }
 
     uint64_t get_current_timestamp()
@@ -514,16 +545,24 @@ private:
     }
 
     void update_driver_stats(const TripRecord &trip)
+    {
+        update_driver_stats(trip.driver_id, vector<TripRecord>(1, trip));
+    }
+
+    void update_driver_stats(uint64_t driver_id, const vector<TripRecord> &trips)
     {
         DriverProfile driver;
-        if (db_.read_driver(trip.driver_id, driver))
+        if (db_.read_driver(driver_id, driver))
         {
-            driver.total_trips++;
-            driver.total_distance += trip.distance;
-            driver.total_fuel_consumed += trip.fuel_consumed;
-            driver.harsh_events_count += trip.harsh_braking_count +
-                                         trip.rapid_acceleration_count +
-                                         trip.speeding_count;
+            for (const auto &trip : trips)
+            {
+                driver.total_trips++;
+                driver.total_distance += trip.distance;
+                driver.total_fuel_consumed += trip.fuel_consumed;
+                driver.harsh_events_count += trip.harsh_braking_count +
+                                             trip.rapid_acceleration_count +
+                                             trip.speeding_count;
+            }
 
             TripStatistics stats;
             memset(&stats, 0, sizeof(TripStatistics));
@@ -533,7 +572,7 @@ private:
             driver.safety_score = calculate_safety_score(stats);
 
             db_.update_driver(driver);
-            cache_.invalidate_driver(trip.driver_id);
+            cache_.invalidate_driver(driver_id);
         }
     }
 };
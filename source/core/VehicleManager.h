@@ -16,8 +16,6 @@ private:
     DatabaseManager &db_;
     CacheManager &cache_;
     IndexManager &index_;
-    uint64_t next_vehicle_id_;
-    uint64_t next_maintenance_id_;
     uint64_t next_alert_id_;
     set<string> processed_alerts_;
 
@@ -165,8 +163,6 @@ public:
     VehicleManager(DatabaseManager &db, CacheManager &cache, IndexManager &index)
         : db_(db), cache_(cache), index_(index) 
     {
-        next_vehicle_id_ = db_.get_max_vehicle_id() + 1;
-        next_maintenance_id_ = db_.get_max_maintenance_id() + 1;
         next_alert_id_ = 1;
     }
 
@@ -411,12 +407,12 @@ public:
 private:
     uint64_t generate_vehicle_id()
     {
-        return next_vehicle_id_++;
+        return db_.next_vehicle_id();
     }
 
     uint64_t generate_maintenance_id()
     {
-        return next_maintenance_id_++;
+        return db_.next_maintenance_id();
     }
 
     uint64_t generate_alert_id()
@@ -0,0 +1,517 @@
+#ifndef WRITEAHEADLOG_H
+#define WRITEAHEADLOG_H
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <shared_mutex>
+#include <condition_variable>
+#include <chrono>
+#include <functional>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+using namespace std;
+
+#pragma pack(push, 1)
+struct WALFrameHeader
+{
+    uint32_t magic;
+    uint32_t payload_size;
+    uint64_t lsn;
+    uint32_t crc;
+};
+
+struct WALSegmentHeader
+{
+    uint64_t offset;
+    uint32_t length;
+};
+#pragma pack(pop)
+
+// Physical redo log for DatabaseManager. A frame carries every byte range one
+// mutation wrote to the database file, so replaying frames in order after a
+// crash reproduces all committed mutations. Frames are made durable by group
+// commit: the first waiter becomes the flusher, optionally lingers for the
+// configured time window (or until the size window fills), then writes and
+// fdatasyncs everything appended so far on behalf of all waiters.
+//
+// Logged writes reach the database file only after their frame is durable:
+// the flusher applies each synced frame in log order through the apply
+// callback. Until then readers of the file patch what they read with
+// overlay().
+class WriteAheadLog
+{
+public:
+    // The writes of one mutation, owned by whoever runs it. A thread's
+    // active stagings form a stack, so a mutation begun inside another,
+    // on this log or another one, keeps its writes apart from the outer one.
+    struct Staging
+    {
+        WriteAheadLog *log = nullptr;
+        Staging *outer = nullptr;
+        vector<uint8_t> payload;
+    };
+
+private:
+    struct Frame
+    {
+        uint64_t lsn;
+        uint64_t low;
+        uint64_t high;
+        vector<uint8_t> payload;
+    };
+
+    static const uint32_t FRAME_MAGIC = 0x4C415753;
+    static const uint64_t CHECKPOINT_BYTES = 64ULL * 1024 * 1024;
+
+    string path_;
+    int fd_;
+    bool enabled_;
+    uint32_t group_commit_ms_;
+    uint32_t group_commit_bytes_;
+
+    mutex mutex_;
+    condition_variable cond_;
+    vector<uint8_t> pending_;
+    uint64_t last_lsn_;
+    uint64_t durable_lsn_;
+    uint64_t log_size_;
+    bool flushing_;
+    bool failed_;
+
+    // Committed frames not yet applied to the database file, in log order.
+    // Only the flusher or a drain removes them, under frames_mutex_ held
+    // exclusively.
+    deque<Frame> unapplied_;
+    shared_mutex frames_mutex_;
+    function<bool(uint64_t, const uint8_t *, uint32_t)> apply_;
+
+    // Innermost active staging of the calling thread
+    static Staging *&active()
+    {
+        static thread_local Staging *active = nullptr;
+        return active;
+    }
+
+    static vector<uint32_t> build_crc_table()
+    {
+        vector<uint32_t> table(256);
+        for (uint32_t i = 0; i < 256; i++)
+        {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++)
+                c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            table[i] = c;
+        }
+        return table;
+    }
+
+    static uint32_t crc32(const uint8_t *data, size_t length)
+    {
+        static const vector<uint32_t> table = build_crc_table();
+        uint32_t crc = 0xFFFFFFFFu;
+        for (size_t i = 0; i < length; i++)
+        {
+            crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+        }
+        return crc ^ 0xFFFFFFFFu;
+    }
+
+    bool window_full() const
+    {
+        return group_commit_bytes_ > 0 && pending_.size() >= group_commit_bytes_;
+    }
+
+    // Copies the segments of payload overlapping [offset, offset + length)
+    static void patch(const vector<uint8_t> &payload, uint64_t offset, uint8_t *data, uint64_t length)
+    {
+        size_t p = 0;
+        while (p + sizeof(WALSegmentHeader) <= payload.size())
+        {
+            WALSegmentHeader segment;
+            memcpy(&segment, payload.data() + p, sizeof(segment));
+            p += sizeof(segment);
+            uint64_t begin = max(segment.offset, offset);
+            uint64_t end = min(segment.offset + segment.length, offset + length);
+            if (begin < end)
+                memcpy(data + (begin - offset), payload.data() + p + (begin - segment.offset), end - begin);
+            p += segment.length;
+        }
+    }
+
+    bool apply_frame(const Frame &frame)
+    {
+        if (!apply_)
+            return true;
+        size_t p = 0;
+        while (p + sizeof(WALSegmentHeader) <= frame.payload.size())
+        {
+            WALSegmentHeader segment;
+            memcpy(&segment, frame.payload.data() + p, sizeof(segment));
+            p += sizeof(segment);
+            if (!apply_(segment.offset, frame.payload.data() + p, segment.length))
+                return false;
+            p += segment.length;
+        }
+        return true;
+    }
+
+    // Applies the unapplied frames up to lsn, which are durable; run by the
+    // flusher only
+    bool apply_through(uint64_t lsn)
+    {
+        vector<const Frame *> ready;
+        {
+            shared_lock<shared_mutex> frames(frames_mutex_);
+            for (const Frame &frame : unapplied_)
+            {
+                if (frame.lsn > lsn)
+                    break;
+                ready.push_back(&frame);
+            }
+        }
+        for (const Frame *frame : ready)
+        {
+            if (!apply_frame(*frame))
+                return false;
+        }
+        unique_lock<shared_mutex> frames(frames_mutex_);
+        unapplied_.erase(unapplied_.begin(), unapplied_.begin() + ready.size());
+        return true;
+    }
+
+    bool write_all(const uint8_t *data, size_t length)
+    {
+        while (length > 0)
+        {
+            ssize_t n = ::write(fd_, data, length);
+            if (n <= 0)
+                return false;
+            data += n;
+            length -= n;
+        }
+        return true;
+    }
+
+public:
+    WriteAheadLog()
+        : fd_(-1), enabled_(false), group_commit_ms_(0), group_commit_bytes_(0),
+          last_lsn_(0), durable_lsn_(0), log_size_(0), flushing_(false), failed_(false) {}
+
+    ~WriteAheadLog()
+    {
+        close();
+    }
+
+    void configure(bool enabled, uint32_t group_commit_ms, uint32_t group_commit_bytes)
+    {
+        enabled_ = enabled;
+        group_commit_ms_ = group_commit_ms;
+        group_commit_bytes_ = group_commit_bytes;
+    }
+
+    bool is_enabled() const { return enabled_; }
+
+    // How a durable frame's writes reach the database file
+    void set_apply(const function<bool(uint64_t, const uint8_t *, uint32_t)> &apply)
+    {
+        apply_ = apply;
+    }
+
+    // A log left behind is opened even when logging is disabled, so its
+    // frames are replayed and the log truncated before anything newer is
+    // written; it is then closed at that truncate
+    bool open(const string &path)
+    {
+        close();
+        path_ = path;
+        struct stat st;
+        if (!enabled_ && stat(path_.c_str(), &st) != 0)
+            return true;
+
+        fd_ = ::open(path_.c_str(), enabled_ ? O_RDWR | O_CREAT | O_APPEND : O_RDWR | O_APPEND, 0644);
+        if (fd_ < 0)
+            return false;
+
+        log_size_ = fstat(fd_, &st) == 0 ? st.st_size : 0;
+        last_lsn_ = 0;
+        durable_lsn_ = 0;
+        failed_ = false;
+        pending_.clear();
+        unapplied_.clear();
+        return true;
+    }
+
+    void close()
+    {
+        if (fd_ >= 0)
+        {
+            ::close(fd_);
+            fd_ = -1;
+        }
+    }
+
+    // Applies every intact frame in log order and stops at the first torn or
+    // corrupt one. Returns the number of frames applied, or -1 on I/O error.
+    int replay(const function<bool(uint64_t, const uint8_t *, uint32_t)> &apply)
+    {
+        if (fd_ < 0 || log_size_ == 0)
+            return 0;
+
+        vector<uint8_t> log(log_size_);
+        uint64_t done = 0;
+        while (done < log.size())
+        {
+            ssize_t n = pread(fd_, log.data() + done, log.size() - done, done);
+            if (n <= 0)
+                return -1;
+            done += n;
+        }
+
+        int frames = 0;
+        size_t pos = 0;
+        while (pos + sizeof(WALFrameHeader) <= log.size())
+        {
+            WALFrameHeader frame;
+            memcpy(&frame, log.data() + pos, sizeof(frame));
+            const uint8_t *payload = log.data() + pos + sizeof(frame);
+            if (frame.magic != FRAME_MAGIC ||
+                pos + sizeof(frame) + frame.payload_size > log.size() ||
+                crc32(payload, frame.payload_size) != frame.crc)
+                break;
+
+            size_t p = 0;
+            while (p + sizeof(WALSegmentHeader) <= frame.payload_size)
+            {
+                WALSegmentHeader segment;
+                memcpy(&segment, payload + p, sizeof(segment));
+                p += sizeof(segment);
+                if (p + segment.length > frame.payload_size ||
+                    !apply(segment.offset, payload + p, segment.length))
+                    return -1;
+                p += segment.length;
+            }
+
+            last_lsn_ = durable_lsn_ = frame.lsn;
+            pos += sizeof(frame) + frame.payload_size;
+            frames++;
+        }
+        return frames;
+    }
+
+    void begin(Staging &s)
+    {
+        s.log = this;
+        s.payload.clear();
+        s.outer = active();
+        active() = &s;
+    }
+
+    // Adds the write to the innermost active staging of this log. True when
+    // it did, so the caller leaves the database file to the flusher.
+    bool stage(uint64_t offset, const void *data, uint32_t length)
+    {
+        if (!enabled_)
+            return false;
+        Staging *s = active();
+        while (s && s->log != this)
+            s = s->outer;
+        if (!s)
+            return false;
+
+        WALSegmentHeader segment = {offset, length};
+        const uint8_t *header = reinterpret_cast<const uint8_t *>(&segment);
+        s->payload.insert(s->payload.end(), header, header + sizeof(segment));
+        const uint8_t *bytes = static_cast<const uint8_t *>(data);
+        s->payload.insert(s->payload.end(), bytes, bytes + length);
+        return true;
+    }
+
+    // Ends the staging and turns its writes into a frame, queued for the
+    // next group commit. Must run while the mutation still holds its table
+    // lock so frames for overlapping bytes are queued in the order they were
+    // applied.
+    uint64_t commit(Staging &s)
+    {
+        active() = s.outer;
+        s.log = nullptr;
+        if (!enabled_ || s.payload.empty())
+            return 0;
+
+        lock_guard<mutex> lock(mutex_);
+        WALFrameHeader frame;
+        frame.magic = FRAME_MAGIC;
+        frame.payload_size = static_cast<uint32_t>(s.payload.size());
+        frame.lsn = ++last_lsn_;
+        frame.crc = crc32(s.payload.data(), s.payload.size());
+
+        const uint8_t *header = reinterpret_cast<const uint8_t *>(&frame);
+        pending_.insert(pending_.end(), header, header + sizeof(frame));
+        pending_.insert(pending_.end(), s.payload.begin(), s.payload.end());
+
+        Frame unapplied = {frame.lsn, UINT64_MAX, 0, vector<uint8_t>()};
+        size_t p = 0;
+        while (p + sizeof(WALSegmentHeader) <= s.payload.size())
+        {
+            WALSegmentHeader segment;
+            memcpy(&segment, s.payload.data() + p, sizeof(segment));
+            unapplied.low = min(unapplied.low, segment.offset);
+            unapplied.high = max(unapplied.high, segment.offset + segment.length);
+            p += sizeof(segment) + segment.length;
+        }
+        unapplied.payload.swap(s.payload);
+        {
+            unique_lock<shared_mutex> frames(frames_mutex_);
+            unapplied_.push_back(move(unapplied));
+        }
+
+        if (window_full())
+            cond_.notify_all();
+        return frame.lsn;
+    }
+
+    bool wait_durable(uint64_t lsn)
+    {
+        if (!enabled_ || lsn == 0)
+            return true;
+
+        unique_lock<mutex> lock(mutex_);
+        while (durable_lsn_ < lsn)
+        {
+            if (failed_)
+                return false;
+
+            if (flushing_)
+            {
+                cond_.wait(lock);
+                continue;
+            }
+
+            flushing_ = true;
+            if (group_commit_ms_ > 0)
+            {
+                cond_.wait_for(lock, chrono::milliseconds(group_commit_ms_),
+                               [this] { return window_full(); });
+            }
+
+            vector<uint8_t> batch;
+            batch.swap(pending_);
+            uint64_t batch_lsn = last_lsn_;
+
+            lock.unlock();
+            bool ok = write_all(batch.data(), batch.size()) && fdatasync(fd_) == 0 && apply_through(batch_lsn);
+            lock.lock();
+
+            flushing_ = false;
+            if (ok)
+            {
+                log_size_ += batch.size();
+                if (batch_lsn > durable_lsn_)
+                    durable_lsn_ = batch_lsn;
+            }
+            else
+            {
+                failed_ = true;
+            }
+            cond_.notify_all();
+        }
+        return true;
+    }
+
+    // Makes every committed frame durable and applied. After a failed
+    // flush the remaining frames are applied as they stand; the checkpoint
+    // that follows makes them durable.
+    bool drain()
+    {
+        if (!enabled_)
+            return true;
+        uint64_t lsn;
+        {
+            lock_guard<mutex> lock(mutex_);
+            lsn = last_lsn_;
+        }
+        if (wait_durable(lsn))
+            return true;
+
+        unique_lock<mutex> lock(mutex_);
+        cond_.wait(lock, [this] { return !flushing_; });
+        unique_lock<shared_mutex> frames(frames_mutex_);
+        for (const Frame &frame : unapplied_)
+        {
+            if (!apply_frame(frame))
+                return false;
+        }
+        unapplied_.clear();
+        return true;
+    }
+
+    // Keeps applied frames in the overlay while the caller reads the
+    // database file and then patches what it read
+    shared_lock<shared_mutex> hold_overlay()
+    {
+        return shared_lock<shared_mutex>(frames_mutex_);
+    }
+
+    // Copies over data the logged writes to [offset, offset + length) that
+    // the file does not hold yet: unapplied frames in log order, then the
+    // calling thread's own stagings. The caller holds hold_overlay().
+    void overlay(uint64_t offset, void *data, uint64_t length)
+    {
+        uint8_t *out = static_cast<uint8_t *>(data);
+        for (const Frame &frame : unapplied_)
+        {
+            if (frame.low < offset + length && offset < frame.high)
+                patch(frame.payload, offset, out, length);
+        }
+
+        vector<const Staging *> staged;
+        for (Staging *s = active(); s; s = s->outer)
+        {
+            if (s->log == this)
+                staged.push_back(s);
+        }
+        for (size_t i = staged.size(); i > 0; i--)
+        {
+            patch(staged[i - 1]->payload, offset, out, length);
+        }
+    }
+
+    bool checkpoint_due()
+    {
+        lock_guard<mutex> lock(mutex_);
+        return enabled_ && log_size_ >= CHECKPOINT_BYTES;
+    }
+
+    // Called once the database file itself has been synced and no mutation
+    // can commit: everything logged so far is durable, so the log restarts.
+    bool truncate()
+    {
+        if (fd_ < 0)
+            return true;
+
+        unique_lock<mutex> lock(mutex_);
+        cond_.wait(lock, [this] { return !flushing_; });
+
+        pending_.clear();
+        {
+            unique_lock<shared_mutex> frames(frames_mutex_);
+            unapplied_.clear();
+        }
+        durable_lsn_ = last_lsn_;
+        failed_ = false;
+        bool ok = ftruncate(fd_, 0) == 0 && fdatasync(fd_) == 0;
+        if (ok)
+            log_size_ = 0;
+        if (ok && !enabled_)
+            close();
+        cond_.notify_all();
+        return ok;
+    }
+};
+
+#endif
@@ -1,15 +1,19 @@
 #ifndef BPLUSTREE_H
 #define BPLUSTREE_H
 
-#include <string>
-
+#include "BufferPool.h"
+#include "KeyCompare.h"
 #include <cstdint>
 #include <cstring>
 #include <vector>
 #include <string>
-#include <fstream>
+#include <memory>
+#include <algorithm>
 #include <cerrno>
 #include <iostream>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
 using namespace std;
 
 struct BPlusKey
@@ -34,27 +38,27 @@ struct BPlusKey
 
     bool operator<(const BPlusKey &other) const
     {
-        return strcmp(data, other.data) < 0;
+        return compare_cstring(data, other.data) < 0;
     }
 
     bool operator==(const BPlusKey &other) const
     {
-        return strcmp(data, other.data) == 0;
+        return compare_cstring(data, other.data) == 0;
     }
 
     bool operator<=(const BPlusKey &other) const
     {
-        return strcmp(data, other.data) <= 0;
+        return compare_cstring(data, other.data) <= 0;
     }
 
     bool operator>(const BPlusKey &other) const
     {
-        return strcmp(data, other.data) > 0;
+        return compare_cstring(data, other.data) > 0;
     }
 
     bool operator>=(const BPlusKey &other) const
     {
-        return strcmp(data, other.data) >= 0;
+        return compare_cstring(data, other.data) >= 0;
     }
 };
 
@@ -75,7 +79,8 @@ struct BPlusValue
     }
 };
 
-struct BPlusNode
+// Node layout of format 1 files, read only to convert them to format 2
+struct BPlusNodeV1
 {
     static constexpr int ORDER = 10;
     static constexpr int MAX_KEYS = 19;
@@ -101,7 +106,7 @@ struct BPlusNode
 
     uint8_t node_padding[1280];
 
-    BPlusNode() : node_type(1), key_count(0), parent_offset(0), level(0),
+    BPlusNodeV1() : node_type(1), key_count(0), parent_offset(0), level(0),
                   next_leaf(0), prev_leaf(0)
     {
         memset(padding, 0, sizeof(padding));
@@ -116,8 +121,116 @@ struct BPlusNode
     bool is_full() const { return key_count >= MAX_KEYS; }
 };
 
+static_assert(sizeof(BPlusNodeV1) == 4096, "BPlusNodeV1 must be 4096 bytes");
+
+// Format 2 page. Keys are variable length and stored without the prefix
+// shared by every key of the node, which is kept once. data holds, in order:
+// the shared prefix, the end offset of each key's suffix, the values of a
+// leaf (id and entity type, VALUE_SIZE bytes each) or the child offsets of an
+// internal node, and the suffixes back to back. A node splits when its keys
+// no longer fit rather than at a fixed key count.
+struct BPlusNode
+{
+    static constexpr size_t DATA_SIZE = 4072;
+    static constexpr size_t VALUE_SIZE = 9;
+    static constexpr size_t MIN_FILL = DATA_SIZE / 4;
+    static constexpr uint8_t FREE_NODE = 2;
+
+    uint8_t node_type;
+    uint8_t prefix_length;
+    uint16_t key_count;
+    uint16_t level;
+    uint16_t reserved;
+    uint64_t next_leaf;
+    uint64_t prev_leaf;
+    uint8_t data[DATA_SIZE];
+
+    BPlusNode()
+    {
+        memset(static_cast<void *>(this), 0, sizeof(BPlusNode));
+        node_type = 1;
+    }
+
+    bool is_leaf() const { return node_type == 1; }
+
+    size_t payload_start() const { return prefix_length + 2 * key_count; }
+
+    size_t suffix_start() const
+    {
+        return payload_start() + (is_leaf() ? VALUE_SIZE * key_count : 8 * (key_count + 1));
+    }
+
+    size_t suffix_end(int i) const
+    {
+        uint16_t end;
+        memcpy(&end, data + prefix_length + 2 * i, sizeof(end));
+        return end;
+    }
+
+    const uint8_t *suffix(int i, size_t &length) const
+    {
+        size_t first = i > 0 ? suffix_end(i - 1) : 0;
+        length = suffix_end(i) - first;
+        return data + suffix_start() + first;
+    }
+
+    size_t used_bytes() const
+    {
+        return suffix_start() + (key_count > 0 ? suffix_end(key_count - 1) : 0);
+    }
+
+    string key(int i) const
+    {
+        size_t length;
+        const uint8_t *rest = suffix(i, length);
+        string result(reinterpret_cast<const char *>(data), prefix_length);
+        result.append(reinterpret_cast<const char *>(rest), length);
+        return result;
+    }
+
+    uint64_t child(int i) const
+    {
+        uint64_t offset;
+        memcpy(&offset, data + payload_start() + 8 * i, sizeof(offset));
+        return offset;
+    }
+
+    BPlusValue value(int i) const
+    {
+        const uint8_t *entry = data + payload_start() + VALUE_SIZE * i;
+        BPlusValue result;
+        memcpy(&result.primary_id, entry, sizeof(result.primary_id));
+        result.entity_type = entry[8];
+        return result;
+    }
+
+    void set_value(int i, const BPlusValue &value)
+    {
+        uint8_t *entry = data + payload_start() + VALUE_SIZE * i;
+        memcpy(entry, &value.primary_id, sizeof(value.primary_id));
+        entry[8] = value.entity_type;
+    }
+};
+
 static_assert(sizeof(BPlusNode) == 4096, "BPlusNode must be 4096 bytes");
 
+// A node decoded for modification: whole keys, and the values of a leaf or
+// the children of an internal node
+struct BPlusEntries
+{
+    uint8_t node_type;
+    uint16_t level;
+    uint64_t next_leaf;
+    uint64_t prev_leaf;
+    vector<string> keys;
+    vector<BPlusValue> values;
+    vector<uint64_t> children;
+
+    BPlusEntries() : node_type(1), level(0), next_leaf(0), prev_leaf(0) {}
+
+    bool is_leaf() const { return node_type == 1; }
+};
+
 struct BPlusMetadata
 {
     char magic[8];
@@ -126,11 +239,12 @@ struct BPlusMetadata
     uint64_t leftmost_leaf;
     uint64_t total_entries;
     uint32_t tree_height;
-    uint8_t reserved[3996];
+    uint64_t free_list_head;
+    uint8_t reserved[3984];
 
-    BPlusMetadata() : root_offset(0), leftmost_leaf(0), total_entries(0), tree_height(0)
+    BPlusMetadata() : root_offset(0), leftmost_leaf(0), total_entries(0), tree_height(0), free_list_head(0)
     {
-        strncpy(magic, "BPLUS001", 8);
+        strncpy(magic, "BPLUS002", 8);
         memset(index_name, 0, sizeof(index_name));
         memset(reserved, 0, sizeof(reserved));
     }
@@ -138,169 +252,581 @@ struct BPlusMetadata
 
 static_assert(sizeof(BPlusMetadata) == 4096, "BPlusMetadata must be 4096 bytes");
 
+
 class BPlusTree
 {
 private:
-    fstream file_;
+    int fd_;
     string filename_;
     BPlusMetadata metadata_;
 
+    // Same page buffer pool arrangement as BTree
+    static constexpr size_t CACHE_SIZE = 64;
+    unique_ptr<BufferPool> own_pool_;
+    BufferPool *pool_;
+    uint32_t pool_file_;
+    uint64_t file_end_;
+
     bool read_node(uint64_t offset, BPlusNode &node)
     {
-        if (offset == 0)
+        if (offset == 0 || offset + sizeof(BPlusNode) > file_end_)
             return false;
-        file_.seekg(offset, ios::beg);
-        file_.read(reinterpret_cast<char *>(&node), sizeof(BPlusNode));
-        return file_.good();
+        return pool_->read(pool_file_, offset, &node, sizeof(BPlusNode));
     }
 
     bool write_node(uint64_t offset, const BPlusNode &node)
     {
-        file_.seekp(offset, ios::beg);
-        file_.write(reinterpret_cast<const char *>(&node), sizeof(BPlusNode));
-        file_.flush();
-        return file_.good();
+        return pool_->write(pool_file_, offset, &node, sizeof(BPlusNode), false);
     }
 
+    // Freed pages are reused as in BTree
     uint64_t allocate_node()
     {
-        file_.seekp(0, ios::end);
-        uint64_t offset = file_.tellp();
         BPlusNode empty;
-        file_.write(reinterpret_cast<char *>(&empty), sizeof(BPlusNode));
+        uint64_t offset = metadata_.free_list_head;
+        BPlusNode free_node;
+        if (offset != 0 && read_node(offset, free_node) && free_node.node_type == BPlusNode::FREE_NODE)
+        {
+            metadata_.free_list_head = free_node.next_leaf;
+            write_node(offset, empty);
+            return offset;
+        }
+        metadata_.free_list_head = 0;
+
+        offset = file_end_;
+        file_end_ += sizeof(BPlusNode);
+        write_node(offset, empty);
         return offset;
     }
 
-    int find_key_position(const BPlusNode &node, const BPlusKey &key)
+    void release_node(uint64_t offset)
+    {
+        BPlusNode node;
+        node.node_type = BPlusNode::FREE_NODE;
+        node.next_leaf = metadata_.free_list_head;
+        write_node(offset, node);
+        metadata_.free_list_head = offset;
+    }
+
+    bool read_metadata()
+    {
+        return pread(fd_, &metadata_, sizeof(BPlusMetadata), 0) == static_cast<ssize_t>(sizeof(BPlusMetadata));
+    }
+
+    bool write_metadata()
+    {
+        return pwrite(fd_, &metadata_, sizeof(BPlusMetadata), 0) == static_cast<ssize_t>(sizeof(BPlusMetadata));
+    }
+
+    // Writes nodes to the end of the file in one go, bypassing the pool
+    bool append_nodes(const vector<BPlusNode> &nodes)
     {
-        int pos = 0;
-        while (pos < node.key_count && node.keys[pos] < key)
+        const uint8_t *data = reinterpret_cast<const uint8_t *>(nodes.data());
+        uint64_t length = nodes.size() * sizeof(BPlusNode);
+        while (length > 0)
         {
-            pos++;
+            ssize_t n = pwrite(fd_, data, length, file_end_);
+            if (n <= 0)
+                return false;
+            data += n;
+            file_end_ += n;
+            length -= n;
         }
-        return pos;
+        return true;
     }
 
-    void split_child(uint64_t parent_offset, BPlusNode &parent, int index)
+    static size_t common_prefix(const string &a, const string &b)
     {
-        BPlusNode child;
-        read_node(parent.child_offsets[index], child);
+        size_t length = min(a.size(), b.size());
+        size_t i = 0;
+        while (i < length && a[i] == b[i])
+            i++;
+        return i;
+    }
 
-        uint64_t new_offset = allocate_node();
-        BPlusNode new_node;
-        new_node.node_type = child.node_type;
-        new_node.level = child.level;
+    // Page bytes needed by keys [first, end) of node; keys are sorted, so
+    // the prefix they share is the one shared by the first and last
+    static size_t encoded_size(const BPlusEntries &node, size_t first, size_t end)
+    {
+        size_t count = end - first;
+        size_t prefix = count > 0 ? common_prefix(node.keys[first], node.keys[end - 1]) : 0;
+        size_t size = prefix + 2 * count + (node.is_leaf() ? BPlusNode::VALUE_SIZE * count : 8 * (count + 1));
+        for (size_t k = first; k < end; k++)
+        {
+            size += node.keys[k].size() - prefix;
+        }
+        return size;
+    }
 
-        int mid = BPlusNode::MIN_KEYS;
-        new_node.key_count = BPlusNode::MIN_KEYS;
+    // Encodes keys [first, end) of node, with their values or the children
+    // [first, end] around them; the caller sets the leaf links
+    static void encode(const BPlusEntries &node, size_t first, size_t end, BPlusNode &page)
+    {
+        page = BPlusNode();
+        page.node_type = node.node_type;
+        page.level = node.level;
+
+        size_t count = end - first;
+        size_t prefix = count > 0 ? common_prefix(node.keys[first], node.keys[end - 1]) : 0;
+        page.prefix_length = static_cast<uint8_t>(prefix);
+        page.key_count = static_cast<uint16_t>(count);
+        if (count > 0)
+            memcpy(page.data, node.keys[first].data(), prefix);
+
+        uint8_t *payload = page.data + page.payload_start();
+        uint8_t *suffixes = page.data + page.suffix_start();
+        uint16_t suffix_end = 0;
+        for (size_t k = 0; k < count; k++)
+        {
+            const string &key = node.keys[first + k];
+            memcpy(suffixes + suffix_end, key.data() + prefix, key.size() - prefix);
+            suffix_end += static_cast<uint16_t>(key.size() - prefix);
+            memcpy(page.data + prefix + 2 * k, &suffix_end, sizeof(suffix_end));
 
-        for (int i = 0; i < BPlusNode::MIN_KEYS; i++)
+            if (node.is_leaf())
+            {
+                memcpy(payload + BPlusNode::VALUE_SIZE * k, &node.values[first + k].primary_id, 8);
+                payload[BPlusNode::VALUE_SIZE * k + 8] = node.values[first + k].entity_type;
+            }
+        }
+        if (!node.is_leaf())
         {
-            new_node.keys[i] = child.keys[mid + 1 + i];
+            memcpy(payload, &node.children[first], 8 * (count + 1));
         }
+    }
 
-        if (child.is_leaf())
+    static void decode(const BPlusNode &page, BPlusEntries &node)
+    {
+        node.node_type = page.node_type;
+        node.level = page.level;
+        node.next_leaf = page.next_leaf;
+        node.prev_leaf = page.prev_leaf;
+        node.keys.clear();
+        node.values.clear();
+        node.children.clear();
+        for (int i = 0; i < page.key_count; i++)
+        {
+            node.keys.push_back(page.key(i));
+            if (page.is_leaf())
+                node.values.push_back(page.value(i));
+        }
+        if (!page.is_leaf())
         {
-            for (int i = 0; i < BPlusNode::MIN_KEYS; i++)
+            for (int i = 0; i <= page.key_count; i++)
+                node.children.push_back(page.child(i));
+        }
+    }
+
+    // Start of each page node's keys are split into. A node that fits stays
+    // whole; an overflowing one is halved when both halves fit, and packed
+    // page by page otherwise, which is also how bulk_load lays out a level.
+    // Leaf pieces keep their last key as the separator; in internal nodes
+    // the key between two pieces moves up.
+    static vector<size_t> plan_split(const BPlusEntries &node, bool halve)
+    {
+        size_t count = node.keys.size();
+        size_t gap = node.is_leaf() ? 0 : 1;
+        if (encoded_size(node, 0, count) <= BPlusNode::DATA_SIZE)
+            return {0};
+
+        size_t mid = count / 2;
+        if (halve && encoded_size(node, 0, mid) <= BPlusNode::DATA_SIZE &&
+            encoded_size(node, mid + gap, count) <= BPlusNode::DATA_SIZE)
+            return {0, mid + gap};
+
+        size_t fixed = 2 + (node.is_leaf() ? BPlusNode::VALUE_SIZE : 8);
+        vector<size_t> starts;
+        size_t first = 0;
+        while (true)
+        {
+            starts.push_back(first);
+            size_t end = first;
+            size_t lengths = 0;
+            while (end < count)
             {
-                new_node.values[i] = child.values[mid + 1 + i];
+                size_t prefix = common_prefix(node.keys[first], node.keys[end]);
+                size_t keys = end + 1 - first;
+                size_t size = prefix + fixed * keys + gap * 8 + lengths + node.keys[end].size() - prefix * keys;
+                if (size > BPlusNode::DATA_SIZE && end > first)
+                    break;
+                lengths += node.keys[end].size();
+                end++;
             }
-            new_node.next_leaf = child.next_leaf;
-            child.next_leaf = new_offset;
-            new_node.prev_leaf = parent.child_offsets[index];
+            if (end == count)
+                break;
+            first = end + gap;
+        }
+        return starts;
+    }
+
+    static size_t piece_end(const BPlusEntries &node, const vector<size_t> &starts, size_t piece)
+    {
+        if (piece + 1 == starts.size())
+            return node.keys.size();
+        return node.is_leaf() ? starts[piece + 1] : starts[piece + 1] - 1;
+    }
+
+    // Writes node at offset, splitting it over new pages if it no longer
+    // fits; splits receives the separator and offset of each new right-hand
+    // sibling
+    bool store_node(uint64_t offset, const BPlusEntries &node, vector<pair<string, uint64_t>> &splits)
+    {
+        splits.clear();
+        vector<size_t> starts = plan_split(node, true);
+
+        vector<uint64_t> offsets{offset};
+        for (size_t j = 1; j < starts.size(); j++)
+        {
+            offsets.push_back(allocate_node());
         }
-        else
+
+        for (size_t j = 0; j < starts.size(); j++)
         {
-            for (int i = 0; i <= BPlusNode::MIN_KEYS; i++)
+            size_t end = piece_end(node, starts, j);
+            BPlusNode page;
+            encode(node, starts[j], end, page);
+            if (node.is_leaf())
             {
-                new_node.child_offsets[i] = child.child_offsets[mid + 1 + i];
+                page.prev_leaf = j > 0 ? offsets[j - 1] : node.prev_leaf;
+                page.next_leaf = j + 1 < starts.size() ? offsets[j + 1] : node.next_leaf;
             }
+            if (!write_node(offsets[j], page))
+                return false;
+            if (j + 1 < starts.size())
+                splits.push_back({node.keys[node.is_leaf() ? end - 1 : end], offsets[j + 1]});
         }
 
-        child.key_count = BPlusNode::MIN_KEYS;
+        if (node.is_leaf() && starts.size() > 1 && node.next_leaf != 0)
+        {
+            BPlusNode next;
+            if (!read_node(node.next_leaf, next))
+                return false;
+            next.prev_leaf = offsets.back();
+            return write_node(node.next_leaf, next);
+        }
+        return true;
+    }
 
-        for (int i = parent.key_count; i > index; i--)
+    // First position whose key is not less than key, searched on the page:
+    // the key is compared with the node's prefix once, then with suffixes
+    int find_key_position(const BPlusNode &node, const uint8_t *key, size_t length)
+    {
+        size_t prefix = node.prefix_length;
+        if (node.key_count == 0)
+            return 0;
+
+        int result = memcmp(key, node.data, min(length, prefix));
+        if (result < 0 || (result == 0 && length < prefix))
+            return 0;
+        if (result > 0)
+            return node.key_count;
+
+        int low = 0;
+        int high = node.key_count;
+        while (low < high)
         {
-            parent.keys[i] = parent.keys[i - 1];
-            parent.child_offsets[i + 1] = parent.child_offsets[i];
+            int mid = (low + high) / 2;
+            size_t suffix_length;
+            const uint8_t *suffix = node.suffix(mid, suffix_length);
+            if (compare_bytes(suffix, suffix_length, key + prefix, length - prefix) < 0)
+                low = mid + 1;
+            else
+                high = mid;
         }
+        return low;
+    }
 
-        parent.keys[index] = child.keys[mid];
-        parent.child_offsets[index + 1] = new_offset;
-        parent.key_count++;
+    // Only a node whose child split is decoded and rewritten
+    bool insert_recursive(uint64_t offset, const string &key, const BPlusValue &value,
+                          vector<pair<string, uint64_t>> &splits)
+    {
+        splits.clear();
+        BPlusNode page;
+        if (!read_node(offset, page))
+            return false;
+
+        BPlusEntries node;
+        if (page.is_leaf())
+        {
+            decode(page, node);
+            size_t pos = upper_bound(node.keys.begin(), node.keys.end(), key) - node.keys.begin();
+            node.keys.insert(node.keys.begin() + pos, key);
+            node.values.insert(node.values.begin() + pos, value);
+            return store_node(offset, node, splits);
+        }
+
+        int pos = find_key_position(page, reinterpret_cast<const uint8_t *>(key.data()), key.size());
+        vector<pair<string, uint64_t>> child_splits;
+        if (!insert_recursive(page.child(pos), key, value, child_splits))
+            return false;
+        if (child_splits.empty())
+            return true;
 
-        write_node(parent.child_offsets[index], child);
-        write_node(new_offset, new_node);
-        write_node(parent_offset, parent);
+        decode(page, node);
+        for (size_t j = 0; j < child_splits.size(); j++)
+        {
+            node.keys.insert(node.keys.begin() + pos + j, child_splits[j].first);
+            node.children.insert(node.children.begin() + pos + 1 + j, child_splits[j].second);
+        }
+        return store_node(offset, node, splits);
     }
 
-    void insert_non_full(uint64_t node_offset, BPlusNode &node,
-                         const BPlusKey &key, const BPlusValue &value)
+    // The root split: a new root above it takes the separators, and may
+    // split in turn
+    bool grow_root(vector<pair<string, uint64_t>> &splits)
     {
-        int pos = node.key_count - 1;
-
-        if (node.is_leaf())
+        while (!splits.empty())
         {
-            while (pos >= 0 && node.keys[pos] > key)
+            BPlusEntries root;
+            root.node_type = 0;
+            root.level = static_cast<uint16_t>(metadata_.tree_height + 1);
+            root.children.push_back(metadata_.root_offset);
+            for (const auto &split : splits)
             {
-                node.keys[pos + 1] = node.keys[pos];
-                node.values[pos + 1] = node.values[pos];
-                pos--;
+                root.keys.push_back(split.first);
+                root.children.push_back(split.second);
             }
-            node.keys[pos + 1] = key;
-            node.values[pos + 1] = value;
-            node.key_count++;
-            write_node(node_offset, node);
+
+            uint64_t root_offset = allocate_node();
+            if (!store_node(root_offset, root, splits))
+                return false;
+            metadata_.root_offset = root_offset;
+            metadata_.tree_height++;
+
+            pool_->flush(pool_file_);
+            write_metadata();
         }
-        else
+        return true;
+    }
+
+    // Leaf and position of the first entry of key
+    bool find_entry(const BPlusKey &key, uint64_t &leaf_offset, BPlusNode &leaf, int &pos)
+    {
+        const uint8_t *text = reinterpret_cast<const uint8_t *>(key.data);
+        size_t length = strnlen(key.data, sizeof(key.data));
+
+        uint64_t offset = metadata_.root_offset;
+        while (read_node(offset, leaf))
         {
-            while (pos >= 0 && node.keys[pos] > key)
-                pos--;
-            pos++;
+            pos = find_key_position(leaf, text, length);
+            if (!leaf.is_leaf())
+            {
+                offset = leaf.child(pos);
+                continue;
+            }
 
-            BPlusNode child;
-            read_node(node.child_offsets[pos], child);
+            // Past the leaf's last key, a run of equal keys left behind a
+            // separator by removals starts on the next leaf
+            while (pos >= leaf.key_count)
+            {
+                offset = leaf.next_leaf;
+                if (offset == 0 || !read_node(offset, leaf))
+                    return false;
+                pos = find_key_position(leaf, text, length);
+            }
+            size_t suffix_length;
+            const uint8_t *suffix = leaf.suffix(pos, suffix_length);
+            leaf_offset = offset;
+            return leaf.prefix_length + suffix_length == length &&
+                   memcmp(suffix, text + leaf.prefix_length, suffix_length) == 0;
+        }
+        return false;
+    }
 
-            if (child.is_full())
+    // Rebalances child index of parent after it fell below MIN_FILL bytes,
+    // with its left sibling if it has one, like BTree::rebalance_child but
+    // by bytes: the two merge when they fit one page, otherwise the split
+    // point nearest the middle at which both halves fit is used. The caller
+    // stores the parent, whose separator may have changed length.
+    void rebalance_child(BPlusEntries &parent, int index)
+    {
+        size_t left_index = index > 0 ? index - 1 : index;
+        uint64_t left_offset = parent.children[left_index];
+        uint64_t right_offset = parent.children[left_index + 1];
+        BPlusNode left_page;
+        BPlusNode right_page;
+        if (!read_node(left_offset, left_page) || !read_node(right_offset, right_page))
+            return;
+
+        BPlusEntries left;
+        BPlusEntries right;
+        decode(left_page, left);
+        decode(right_page, right);
+
+        BPlusEntries both = move(left);
+        if (!both.is_leaf())
+            both.keys.push_back(parent.keys[left_index]);
+        both.keys.insert(both.keys.end(), right.keys.begin(), right.keys.end());
+        both.values.insert(both.values.end(), right.values.begin(), right.values.end());
+        both.children.insert(both.children.end(), right.children.begin(), right.children.end());
+        both.next_leaf = right.next_leaf;
+
+        size_t count = both.keys.size();
+        if (encoded_size(both, 0, count) <= BPlusNode::DATA_SIZE)
+        {
+            BPlusNode page;
+            encode(both, 0, count, page);
+            page.prev_leaf = both.prev_leaf;
+            page.next_leaf = both.next_leaf;
+            write_node(left_offset, page);
+
+            BPlusNode next;
+            if (both.is_leaf() && both.next_leaf != 0 && read_node(both.next_leaf, next))
             {
-                split_child(node_offset, node, pos);
-                if (node.keys[pos] < key)
-                    pos++;
-                read_node(node.child_offsets[pos], child);
+                next.prev_leaf = left_offset;
+                write_node(both.next_leaf, next);
             }
+            release_node(right_offset);
 
-            insert_non_full(node.child_offsets[pos], child, key, value);
+            parent.keys.erase(parent.keys.begin() + left_index);
+            parent.children.erase(parent.children.begin() + left_index + 1);
+            return;
+        }
+
+        size_t gap = both.is_leaf() ? 0 : 1;
+        size_t middle = count / 2;
+        for (size_t distance = 0; distance < count; distance++)
+        {
+            for (size_t split : {middle - min(distance, middle), middle + distance})
+            {
+                if (split == 0 || split + gap >= count ||
+                    encoded_size(both, 0, split) > BPlusNode::DATA_SIZE ||
+                    encoded_size(both, split + gap, count) > BPlusNode::DATA_SIZE)
+                    continue;
+
+                BPlusNode page;
+                encode(both, 0, split, page);
+                page.prev_leaf = both.is_leaf() ? both.prev_leaf : 0;
+                page.next_leaf = both.is_leaf() ? right_offset : 0;
+                write_node(left_offset, page);
+
+                encode(both, split + gap, count, page);
+                page.prev_leaf = both.is_leaf() ? left_offset : 0;
+                page.next_leaf = both.next_leaf;
+                write_node(right_offset, page);
+
+                parent.keys[left_index] = both.keys[both.is_leaf() ? split - 1 : split];
+                return;
+            }
         }
     }
 
-    bool search_recursive(uint64_t node_offset, const BPlusKey &key, BPlusValue &result)
+    // Removes the entry of key with primary_id from the subtree at offset.
+    // size returns the bytes its root now uses, and splits any siblings
+    // split off it when a longer separator no longer fit.
+    bool remove_recursive(uint64_t offset, const string &key, uint64_t primary_id, size_t &size,
+                          vector<pair<string, uint64_t>> &splits)
     {
-        if (node_offset == 0)
+        splits.clear();
+        BPlusNode page;
+        if (!read_node(offset, page))
             return false;
 
-        BPlusNode node;
-        read_node(node_offset, node);
+        BPlusEntries node;
+        if (page.is_leaf())
+        {
+            decode(page, node);
+            auto first = lower_bound(node.keys.begin(), node.keys.end(), key);
+            for (size_t i = first - node.keys.begin(); i < node.keys.size() && node.keys[i] == key; i++)
+            {
+                if (node.values[i].primary_id != primary_id)
+                    continue;
+                node.keys.erase(node.keys.begin() + i);
+                node.values.erase(node.values.begin() + i);
+                size = encoded_size(node, 0, node.keys.size());
+                return store_node(offset, node, splits);
+            }
+            return false;
+        }
+
+        // A run of equal keys can continue past its separator
+        int pos = find_key_position(page, reinterpret_cast<const uint8_t *>(key.data()), key.size());
+        size_t child_size = 0;
+        vector<pair<string, uint64_t>> child_splits;
+        bool removed = false;
+        for (int index = pos; index <= page.key_count && !removed; index++)
+        {
+            if (index > pos && page.key(index - 1) != key)
+                break;
+            removed = remove_recursive(page.child(index), key, primary_id, child_size, child_splits);
+            pos = index;
+        }
+        if (!removed)
+            return false;
+
+        if (child_splits.empty() && child_size >= BPlusNode::MIN_FILL)
+        {
+            size = page.used_bytes();
+            return true;
+        }
+
+        decode(page, node);
+        for (size_t j = 0; j < child_splits.size(); j++)
+        {
+            node.keys.insert(node.keys.begin() + pos + j, child_splits[j].first);
+            node.children.insert(node.children.begin() + pos + 1 + j, child_splits[j].second);
+        }
+        if (child_splits.empty() && node.children.size() > 1)
+            rebalance_child(node, pos);
+
+        size = encoded_size(node, 0, node.keys.size());
+        return store_node(offset, node, splits);
+    }
+
+    // Rewrites a format 1 file in format 2 like BTree::convert_from_v1
+    bool convert_from_v1()
+    {
+        cout << "          Converting to format 2: " << filename_ << endl;
 
-        int pos = find_key_position(node, key);
+        struct stat st;
+        if (fstat(fd_, &st) != 0)
+            return false;
+        // Bounds the walk if the old file's links are damaged
+        uint64_t pages = static_cast<uint64_t>(st.st_size) / sizeof(BPlusNodeV1);
 
-        if (node.is_leaf())
+        vector<pair<BPlusKey, BPlusValue>> entries;
+        BPlusNodeV1 node;
+        uint64_t offset = metadata_.leftmost_leaf;
+        while (offset != 0)
         {
-            if (pos < node.key_count && node.keys[pos] == key)
+            if (pages-- == 0 ||
+                pread(fd_, &node, sizeof(BPlusNodeV1), offset) != static_cast<ssize_t>(sizeof(BPlusNodeV1)))
+                return false;
+            for (int i = 0; i < node.key_count && i < BPlusNodeV1::MAX_KEYS; i++)
             {
-                result = node.values[pos];
-                return true;
+                entries.push_back({node.keys[i], node.values[i]});
             }
-            return false;
+            offset = node.next_leaf;
         }
 
-        return search_recursive(node.child_offsets[pos], key, result);
+        string converted_file = filename_ + ".convert";
+        {
+            BPlusTree converted(converted_file, string(metadata_.index_name, strnlen(metadata_.index_name, sizeof(metadata_.index_name))), pool_);
+            if (!converted.create() || !converted.open() || !converted.bulk_load(move(entries)))
+            {
+                unlink(converted_file.c_str());
+                return false;
+            }
+        }
+
+        if (rename(converted_file.c_str(), filename_.c_str()) != 0)
+            return false;
+
+        ::close(fd_);
+        fd_ = ::open(filename_.c_str(), O_RDWR);
+        return fd_ >= 0 && read_metadata();
     }
 
 public:
-    BPlusTree(const string &filename, const string &index_name)
-        : filename_(filename)
+    BPlusTree(const string &filename, const string &index_name, BufferPool *pool = nullptr)
+        : fd_(-1), filename_(filename), pool_(pool), pool_file_(0), file_end_(0)
     {
         strncpy(metadata_.index_name, index_name.c_str(), sizeof(metadata_.index_name) - 1);
+        if (!pool_)
+        {
+            own_pool_ = make_unique<BufferPool>(CACHE_SIZE * BufferPool::PAGE_SIZE);
+            pool_ = own_pool_.get();
+        }
     }
     ~BPlusTree()
     {
@@ -309,49 +835,38 @@ public:
 
     bool create()
     {
-
-        if (file_.is_open())
-        {
-            file_.close();
-        }
+        close();
 
         cout << "          Creating: " << filename_ << endl;
 
-        file_.open(filename_, ios::out | ios::binary | ios::trunc);
-        if (!file_.is_open())
+        int fd = ::open(filename_.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0)
         {
             cerr << "          ERROR: Cannot create file: " << filename_ << endl;
             cerr << "          Error: " << strerror(errno) << endl;
             return false;
         }
 
-        file_.write(reinterpret_cast<char *>(&metadata_), sizeof(BPlusMetadata));
-
-        if (!file_.good())
-        {
-            cerr << "          ERROR: Failed to write metadata!" << endl;
-            file_.close();
-            return false;
-        }
-
         BPlusNode root;
         metadata_.root_offset = sizeof(BPlusMetadata);
         metadata_.leftmost_leaf = metadata_.root_offset;
 
-        file_.write(reinterpret_cast<char *>(&root), sizeof(BPlusNode));
-
-        if (!file_.good())
+        if (pwrite(fd, &root, sizeof(BPlusNode), metadata_.root_offset) != static_cast<ssize_t>(sizeof(BPlusNode)))
         {
             cerr << "          ERROR: Failed to write root node!" << endl;
-            file_.close();
+            ::close(fd);
             return false;
         }
 
-        file_.flush();
+        if (pwrite(fd, &metadata_, sizeof(BPlusMetadata), 0) != static_cast<ssize_t>(sizeof(BPlusMetadata)))
+        {
+            cerr << "          ERROR: Failed to write metadata!" << endl;
+            ::close(fd);
+            return false;
+        }
 
-        file_.seekp(0);
-        file_.write(reinterpret_cast<char *>(&metadata_), sizeof(BPlusMetadata));
-        file_.flush();
+        // Reopened read/write by open()
+        ::close(fd);
 
         cout << "          Created successfully" << endl;
         return true;
@@ -360,16 +875,13 @@ public:
     bool open()
     {
 
-        if (file_.is_open())
+        if (fd_ >= 0)
         {
             cout << "          File already open, verifying..." << endl;
-            file_.seekg(0, ios::beg);
-            file_.read(reinterpret_cast<char *>(&metadata_), sizeof(BPlusMetadata));
-
-            if (string(metadata_.magic, 8) != "BPLUS001")
+            if (!read_metadata() || string(metadata_.magic, 8) != "BPLUS002")
             {
                 cerr << "          ERROR: Invalid magic number!" << endl;
-                file_.close();
+                close();
                 return false;
             }
 
@@ -378,66 +890,206 @@ public:
 
         cout << "          Opening: " << filename_ << endl;
 
-        file_.open(filename_, ios::in | ios::out | ios::binary);
-        if (!file_.is_open())
+        fd_ = ::open(filename_.c_str(), O_RDWR);
+        if (fd_ < 0)
         {
             cerr << "          ERROR: Cannot open file: " << filename_ << endl;
             return false;
         }
 
-        file_.read(reinterpret_cast<char *>(&metadata_), sizeof(BPlusMetadata));
+        if (read_metadata() && string(metadata_.magic, 8) == "BPLUS001" && !convert_from_v1())
+        {
+            cerr << "          ERROR: Cannot convert file: " << filename_ << endl;
+            if (fd_ >= 0)
+                ::close(fd_);
+            fd_ = -1;
+            return false;
+        }
 
-        bool valid = (string(metadata_.magic, 8) == "BPLUS001");
+        struct stat st;
+        bool valid = read_metadata() && string(metadata_.magic, 8) == "BPLUS002" && fstat(fd_, &st) == 0;
         if (!valid)
         {
             cerr << "          ERROR: Invalid BPlusTree file" << endl;
-            file_.close();
+            ::close(fd_);
+            fd_ = -1;
+            return false;
         }
+        file_end_ = static_cast<uint64_t>(st.st_size);
+        pool_file_ = pool_->add_file(fd_);
 
         return valid;
     }
     void close()
     {
-        if (file_.is_open())
+        if (fd_ >= 0)
         {
-            file_.seekp(0);
-            file_.write(reinterpret_cast<char *>(&metadata_), sizeof(BPlusMetadata));
-            file_.close();
+            pool_->remove_file(pool_file_);
+            write_metadata();
+            ::close(fd_);
+            fd_ = -1;
         }
     }
 
+    // Writes the dirty nodes and the counters and forces the file to disk
+    bool sync()
+    {
+        if (fd_ < 0)
+            return true;
+        return pool_->flush(pool_file_) && write_metadata() && fdatasync(fd_) == 0;
+    }
+
     bool insert(const BPlusKey &key, const BPlusValue &value)
     {
-        BPlusNode root;
-        read_node(metadata_.root_offset, root);
+        if (fd_ < 0)
+            return false;
 
-        if (root.is_full())
-        {
-            uint64_t new_root_offset = allocate_node();
-            BPlusNode new_root;
-            new_root.node_type = 0;
-            new_root.level = root.level + 1;
-            new_root.child_offsets[0] = metadata_.root_offset;
+        vector<pair<string, uint64_t>> splits;
+        if (!insert_recursive(metadata_.root_offset, key.to_string(), value, splits) || !grow_root(splits))
+            return false;
 
-            split_child(new_root_offset, new_root, 0);
-            metadata_.root_offset = new_root_offset;
-            metadata_.tree_height++;
+        metadata_.total_entries++;
+        return pool_->flush(pool_file_);
+    }
 
-            read_node(new_root_offset, new_root);
-            insert_non_full(new_root_offset, new_root, key, value);
-        }
-        else
+    bool search(const BPlusKey &key, BPlusValue &result)
+    {
+        uint64_t leaf_offset;
+        BPlusNode leaf;
+        int pos;
+        if (!find_entry(key, leaf_offset, leaf, pos))
+            return false;
+        result = leaf.value(pos);
+        return true;
+    }
+
+    // Replaces the value of the first entry of key in place
+    bool update(const BPlusKey &key, const BPlusValue &value)
+    {
+        if (fd_ < 0)
+            return false;
+
+        uint64_t leaf_offset;
+        BPlusNode leaf;
+        int pos;
+        if (!find_entry(key, leaf_offset, leaf, pos))
+            return false;
+        leaf.set_value(pos, value);
+        return write_node(leaf_offset, leaf) && pool_->flush(pool_file_);
+    }
+
+    // Removes the entry of key whose value has primary_id. Nodes left
+    // under MIN_FILL bytes borrow from or merge with a sibling on the way
+    // back up, and a root left with a single child is replaced by it.
+    bool remove(const BPlusKey &key, uint64_t primary_id)
+    {
+        if (fd_ < 0)
+            return false;
+
+        size_t size;
+        vector<pair<string, uint64_t>> splits;
+        if (!remove_recursive(metadata_.root_offset, key.to_string(), primary_id, size, splits) ||
+            !grow_root(splits))
+            return false;
+
+        BPlusNode root;
+        if (read_node(metadata_.root_offset, root) && !root.is_leaf() && root.key_count == 0)
         {
-            insert_non_full(metadata_.root_offset, root, key, value);
+            uint64_t old_root = metadata_.root_offset;
+            metadata_.root_offset = root.child(0);
+            metadata_.tree_height--;
+
+            pool_->flush(pool_file_);
+            write_metadata();
+            release_node(old_root);
         }
 
-        metadata_.total_entries++;
-        return true;
+        if (metadata_.total_entries > 0)
+            metadata_.total_entries--;
+        return pool_->flush(pool_file_);
     }
 
-    bool search(const BPlusKey &key, BPlusValue &result)
+    // Replaces the tree's contents with entries, built bottom-up like
+    // BTree::bulk_load, except that each level is packed page by page since
+    // keys vary in size. Internal keys are the last key of each child but
+    // the last, as splits leave them.
+    bool bulk_load(vector<pair<BPlusKey, BPlusValue>> entries)
     {
-        return search_recursive(metadata_.root_offset, key, result);
+        if (fd_ < 0)
+            return false;
+
+        stable_sort(entries.begin(), entries.end(),
+                    [](const pair<BPlusKey, BPlusValue> &a, const pair<BPlusKey, BPlusValue> &b)
+                    { return a.first < b.first; });
+
+        pool_->flush(pool_file_);
+        pool_->discard(pool_file_, 0, file_end_);
+        if (ftruncate(fd_, sizeof(BPlusMetadata)) != 0)
+            return false;
+        file_end_ = sizeof(BPlusMetadata);
+
+        BPlusEntries level;
+        level.keys.reserve(entries.size());
+        level.values.reserve(entries.size());
+        for (const auto &entry : entries)
+        {
+            level.keys.push_back(entry.first.to_string());
+            level.values.push_back(entry.second);
+        }
+        size_t count = entries.size();
+        entries.clear();
+        entries.shrink_to_fit();
+
+        uint16_t height = 0;
+        vector<BPlusNode> batch;
+        while (true)
+        {
+            vector<size_t> starts = plan_split(level, false);
+            uint64_t first_offset = file_end_;
+
+            BPlusEntries parent;
+            parent.node_type = 0;
+            parent.level = height + 1;
+            for (size_t j = 0; j < starts.size(); j++)
+            {
+                uint64_t offset = first_offset + j * sizeof(BPlusNode);
+                size_t end = piece_end(level, starts, j);
+
+                BPlusNode page;
+                encode(level, starts[j], end, page);
+                if (level.is_leaf())
+                {
+                    page.prev_leaf = j > 0 ? offset - sizeof(BPlusNode) : 0;
+                    page.next_leaf = j + 1 < starts.size() ? offset + sizeof(BPlusNode) : 0;
+                }
+                parent.children.push_back(offset);
+                if (j + 1 < starts.size())
+                    parent.keys.push_back(level.keys[level.is_leaf() ? end - 1 : end]);
+
+                batch.push_back(page);
+                if (batch.size() == CACHE_SIZE || j + 1 == starts.size())
+                {
+                    if (!append_nodes(batch))
+                        return false;
+                    batch.clear();
+                }
+            }
+
+            if (height == 0)
+                metadata_.leftmost_leaf = first_offset;
+            if (starts.size() == 1)
+            {
+                metadata_.root_offset = first_offset;
+                break;
+            }
+            level = move(parent);
+            height++;
+        }
+
+        metadata_.tree_height = height;
+        metadata_.total_entries = count;
+        metadata_.free_list_head = 0;
+        return write_metadata();
     }
 
     vector<pair<BPlusKey, BPlusValue>> scan_all()
@@ -445,14 +1097,12 @@ public:
         vector<pair<BPlusKey, BPlusValue>> results;
 
         uint64_t current = metadata_.leftmost_leaf;
-        while (current != 0)
+        BPlusNode leaf;
+        while (current != 0 && read_node(current, leaf))
         {
-            BPlusNode leaf;
-            read_node(current, leaf);
-
             for (int i = 0; i < leaf.key_count; i++)
             {
-                results.push_back({leaf.keys[i], leaf.values[i]});
+                results.push_back({BPlusKey(leaf.key(i)), leaf.value(i)});
             }
 
             current = leaf.next_leaf;
@@ -462,5 +1112,6 @@ public:
     }
 
     uint64_t get_total_entries() const { return metadata_.total_entries; }
+    uint32_t get_tree_height() const { return metadata_.tree_height; }
 };
 #endif
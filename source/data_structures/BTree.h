@@ -1,14 +1,21 @@
 #ifndef BTREE_H
 #define BTREE_H
 
+#include "BufferPool.h"
+#include "KeyCompare.h"
 #include <cstdint>
 #include <cstring>
 #include <vector>
-#include <fstream>
+#include <string>
 #include <memory>
+#include <algorithm>
 #include <stdexcept>
 #include <cerrno>
+#include <cstdio>
 #include <iostream>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
 using namespace std;
 
 struct CompositeKey
@@ -56,6 +63,40 @@ struct CompositeKey
     {
         return !(*this < other);
     }
+
+    // Big-endian fields back to back, so encoded keys compare with memcmp
+    // in the same order as operator<
+    static constexpr int ENCODED_SIZE = 21;
+
+    void encode(uint8_t *out) const
+    {
+        out[0] = entity_type;
+        for (int i = 0; i < 8; i++)
+        {
+            out[1 + i] = static_cast<uint8_t>(primary_id >> (56 - 8 * i));
+            out[9 + i] = static_cast<uint8_t>(timestamp >> (56 - 8 * i));
+        }
+        for (int i = 0; i < 4; i++)
+        {
+            out[17 + i] = static_cast<uint8_t>(sequence >> (24 - 8 * i));
+        }
+    }
+
+    static CompositeKey decode(const uint8_t *in)
+    {
+        CompositeKey key;
+        key.entity_type = in[0];
+        for (int i = 0; i < 8; i++)
+        {
+            key.primary_id = (key.primary_id << 8) | in[1 + i];
+            key.timestamp = (key.timestamp << 8) | in[9 + i];
+        }
+        for (int i = 0; i < 4; i++)
+        {
+            key.sequence = (key.sequence << 8) | in[17 + i];
+        }
+        return key;
+    }
 };
 
 struct BTreeValue
@@ -76,7 +117,8 @@ struct BTreeValue
         memset(reserved, 0, sizeof(reserved));
     }
 };
-struct BTreeNode
+// Node layout of format 1 files, read only to convert them to format 2
+struct BTreeNodeV1
 {
     static constexpr int ORDER = 5;         
     static constexpr int MAX_KEYS = 9;      
@@ -107,7 +149,7 @@ struct BTreeNode
     
     uint8_t padding[3480];
 
-    BTreeNode() : node_type(1), key_count(0), parent_offset(0), level(0),
+    BTreeNodeV1() : node_type(1), key_count(0), parent_offset(0), level(0),
                   dirty_flag(0), crc16(0), next_leaf(0), prev_leaf(0)
     {
         memset(header_padding, 0, sizeof(header_padding));
@@ -122,6 +164,73 @@ struct BTreeNode
     bool is_full() const { return key_count >= MAX_KEYS; }
     bool is_underflow() const { return key_count < MIN_KEYS; }
 };
+static_assert(sizeof(BTreeNodeV1) == 4096, "BTreeNodeV1 must be exactly 4096 bytes");
+
+// Format 2 node: the packed values of a leaf or the child offsets of an
+// internal node, followed by the keys stored back to back in their 21-byte
+// encoded form, so a 4096-byte page holds 127 keys instead of 9
+#pragma pack(push, 1)
+struct PackedValue
+{
+    uint64_t record_offset;
+    uint8_t file_id;
+    uint16_t record_size;
+};
+#pragma pack(pop)
+
+struct BTreeNode
+{
+    static constexpr int KEY_SIZE = CompositeKey::ENCODED_SIZE;
+    static constexpr int MAX_KEYS = 127;
+    static constexpr int MIN_KEYS = 63;
+    static constexpr int MAX_CHILDREN = 128;
+    static constexpr uint8_t FREE_NODE = 2;
+
+    uint8_t node_type;
+    uint8_t dirty_flag;
+    uint16_t key_count;
+    uint16_t level;
+    uint16_t crc16;
+    uint64_t next_leaf;
+    uint64_t prev_leaf;
+
+    union
+    {
+        PackedValue values[MAX_KEYS];
+        uint64_t child_offsets[MAX_CHILDREN];
+    };
+
+    uint8_t keys[MAX_KEYS][KEY_SIZE];
+
+    uint8_t padding[5];
+
+    BTreeNode()
+    {
+        memset(static_cast<void *>(this), 0, sizeof(BTreeNode));
+        node_type = 1;
+    }
+
+    bool is_leaf() const { return node_type == 1; }
+    bool is_full() const { return key_count >= MAX_KEYS; }
+    bool is_underflow() const { return key_count < MIN_KEYS; }
+
+    CompositeKey key(int i) const { return CompositeKey::decode(keys[i]); }
+    void set_key(int i, const CompositeKey &key) { key.encode(keys[i]); }
+
+    BTreeValue value(int i) const
+    {
+        return BTreeValue(values[i].record_offset, values[i].file_id, values[i].record_size);
+    }
+
+    void set_value(int i, const BTreeValue &value)
+    {
+        values[i].record_offset = value.record_offset;
+        values[i].file_id = value.file_id;
+        values[i].record_size = value.record_size;
+    }
+
+    int compare_key(int i, const uint8_t *key) const { return compare_normalized(keys[i], key, KEY_SIZE); }
+};
 static_assert(sizeof(BTreeNode) == 4096, "BTreeNode must be exactly 4096 bytes");
 
 struct BTreeMetadata
@@ -135,10 +244,10 @@ struct BTreeMetadata
     uint64_t last_compaction; 
     uint8_t reserved[4040];   
 
-    BTreeMetadata() : version(1), root_offset(0), total_records(0),
+    BTreeMetadata() : version(2), root_offset(0), total_records(0),
                       tree_height(0), free_list_head(0), last_compaction(0)
     {
-        strncpy(magic, "BTREE001", 8);
+        strncpy(magic, "BTREE002", 8);
         memset(reserved, 0, sizeof(reserved));
     }
 };
@@ -147,109 +256,130 @@ static_assert(sizeof(BTreeMetadata) == 4096, "BTreeMetadata must be 4096 bytes")
 class BTree
 {
 private:
-    fstream file_;
+    int fd_;
     string filename_;
     BTreeMetadata metadata_;
 
-    struct CacheEntry
-    {
-        uint64_t offset;
-        BTreeNode node;
-        bool dirty;
-    };
-    
-    vector<CacheEntry> cache_;
+    // Nodes are read and written through a page buffer pool, shared with the
+    // other index and database files when one is passed in; otherwise the
+    // tree keeps a private pool of CACHE_SIZE pages. Node writes leave dirty
+    // pages that are flushed once per insert, so a split writes each node
+    // once however many times it was updated.
     static constexpr size_t CACHE_SIZE = 256;
+    unique_ptr<BufferPool> own_pool_;
+    BufferPool *pool_;
+    uint32_t pool_file_;
+    uint64_t file_end_;
 
     bool read_node(uint64_t offset, BTreeNode &node)
     {
-        if (offset == 0)
+        if (offset == 0 || offset + sizeof(BTreeNode) > file_end_)
             return false;
-
-        for (auto &entry : cache_)
-        {
-            if (entry.offset == offset)
-            {
-                node = entry.node;
-                return true;
-            }
-        }
-
-        file_.seekg(offset, ios::beg);
-        file_.read(reinterpret_cast<char *>(&node), sizeof(BTreeNode));
-
-        if (!file_.good())
-            return false;
-
-        add_to_cache(offset, node, false);
-        return true;
+        return pool_->read(pool_file_, offset, &node, sizeof(BTreeNode));
     }
 
     bool write_node(uint64_t offset, const BTreeNode &node)
     {
         if (offset == 0)
             return false;
-
-        file_.seekp(offset, ios::beg);
-        file_.write(reinterpret_cast<const char *>(&node), sizeof(BTreeNode));
-        file_.flush();
-
-        update_cache(offset, node, false);
-        return file_.good();
+        return pool_->write(pool_file_, offset, &node, sizeof(BTreeNode), false);
     }
 
+    // Pages freed by merges are chained through next_leaf from
+    // free_list_head and reused before the file grows. A head left stale by
+    // a crash is dropped rather than followed into a page in use.
     uint64_t allocate_node()
     {
-        
-        file_.seekp(0, ios::end);
-        uint64_t offset = file_.tellp();
-
         BTreeNode empty_node;
-        file_.write(reinterpret_cast<char *>(&empty_node), sizeof(BTreeNode));
-        file_.flush();
+        uint64_t offset = metadata_.free_list_head;
+        BTreeNode free_node;
+        if (offset != 0 && read_node(offset, free_node) && free_node.node_type == BTreeNode::FREE_NODE)
+        {
+            metadata_.free_list_head = free_node.next_leaf;
+            write_node(offset, empty_node);
+            return offset;
+        }
+        metadata_.free_list_head = 0;
 
+        offset = file_end_;
+        file_end_ += sizeof(BTreeNode);
+        write_node(offset, empty_node);
         return offset;
     }
 
-    
-    void add_to_cache(uint64_t offset, const BTreeNode &node, bool dirty)
+    void release_node(uint64_t offset)
+    {
+        BTreeNode node;
+        node.node_type = BTreeNode::FREE_NODE;
+        node.next_leaf = metadata_.free_list_head;
+        write_node(offset, node);
+        metadata_.free_list_head = offset;
+    }
+
+    bool write_metadata()
     {
-        if (cache_.size() >= CACHE_SIZE)
+        return pwrite(fd_, &metadata_, sizeof(BTreeMetadata), 0) == static_cast<ssize_t>(sizeof(BTreeMetadata));
+    }
+
+    bool read_metadata()
+    {
+        return pread(fd_, &metadata_, sizeof(BTreeMetadata), 0) == static_cast<ssize_t>(sizeof(BTreeMetadata));
+    }
+
+    // Writes nodes to the end of the file in one go, bypassing the pool
+    bool append_nodes(const vector<BTreeNode> &nodes)
+    {
+        const uint8_t *data = reinterpret_cast<const uint8_t *>(nodes.data());
+        uint64_t length = nodes.size() * sizeof(BTreeNode);
+        while (length > 0)
         {
-            
-            if (cache_[0].dirty)
-            {
-                write_node(cache_[0].offset, cache_[0].node);
-            }
-            cache_.erase(cache_.begin());
+            ssize_t n = pwrite(fd_, data, length, file_end_);
+            if (n <= 0)
+                return false;
+            data += n;
+            file_end_ += n;
+            length -= n;
         }
-        cache_.push_back({offset, node, dirty});
+        return true;
     }
 
-    
-    void update_cache(uint64_t offset, const BTreeNode &node, bool dirty)
+    // Entries i of count spread as evenly as possible over parts nodes
+    static size_t share_start(size_t count, size_t parts, size_t i)
     {
-        for (auto &entry : cache_)
+        return count * i / parts;
+    }
+
+    // First position whose key is not less than key
+    int find_key_position(const BTreeNode &node, const uint8_t *key)
+    {
+        int low = 0;
+        int high = node.key_count;
+        while (low < high)
         {
-            if (entry.offset == offset)
-            {
-                entry.node = node;
-                entry.dirty = dirty;
-                return;
-            }
+            int mid = (low + high) / 2;
+            if (node.compare_key(mid, key) < 0)
+                low = mid + 1;
+            else
+                high = mid;
         }
-        add_to_cache(offset, node, dirty);
+        return low;
     }
 
-    
-    int find_key_position(const BTreeNode &node, const CompositeKey &key)
+    // First position whose key is greater than key, so equal keys are
+    // inserted after the ones already there
+    int find_insert_position(const BTreeNode &node, const uint8_t *key)
     {
-        int pos = 0;
-        while (pos < node.key_count && node.keys[pos] < key)
+        int low = 0;
+        int high = node.key_count;
+        while (low < high)
         {
-            pos++;
+            int mid = (low + high) / 2;
+            if (node.compare_key(mid, key) <= 0)
+                low = mid + 1;
+            else
+                high = mid;
         }
-        return pos;
+        return low;
     }
 
     
@@ -267,21 +397,17 @@ private:
         new_node.level = child.level;
 
         int mid = BTreeNode::MIN_KEYS;
-
-        
-        new_node.key_count = BTreeNode::MIN_KEYS;
-        for (int i = 0; i < BTreeNode::MIN_KEYS; i++)
-        {
-            new_node.keys[i] = child.keys[mid + 1 + i];
-        }
+        uint8_t separator[BTreeNode::KEY_SIZE];
+        memcpy(separator, child.keys[mid], BTreeNode::KEY_SIZE);
 
         
         if (child.is_leaf())
         {
-            for (int i = 0; i < BTreeNode::MIN_KEYS; i++)
-            {
-                new_node.values[i] = child.values[mid + 1 + i];
-            }
+            // Leaves keep every entry: the separator is copied up, not moved,
+            // and stays as the first key of the right-hand leaf
+            new_node.key_count = child.key_count - mid;
+            memcpy(new_node.keys, child.keys[mid], new_node.key_count * BTreeNode::KEY_SIZE);
+            memcpy(new_node.values, &child.values[mid], new_node.key_count * sizeof(PackedValue));
             
             new_node.next_leaf = child.next_leaf;
             child.next_leaf = new_node_offset;
@@ -289,22 +415,21 @@ private:
         }
         else
         {
-            for (int i = 0; i <= BTreeNode::MIN_KEYS; i++)
-            {
-                new_node.child_offsets[i] = child.child_offsets[mid + 1 + i];
-            }
+            new_node.key_count = BTreeNode::MIN_KEYS;
+            memcpy(new_node.keys, child.keys[mid + 1], BTreeNode::MIN_KEYS * BTreeNode::KEY_SIZE);
+            memcpy(new_node.child_offsets, &child.child_offsets[mid + 1],
+                   (BTreeNode::MIN_KEYS + 1) * sizeof(uint64_t));
         }
 
         child.key_count = BTreeNode::MIN_KEYS;
 
         
-        for (int i = parent.key_count; i > child_index; i--)
-        {
-            parent.keys[i] = parent.keys[i - 1];
-            parent.child_offsets[i + 1] = parent.child_offsets[i];
-        }
+        int moved = parent.key_count - child_index;
+        memmove(parent.keys[child_index + 1], parent.keys[child_index], moved * BTreeNode::KEY_SIZE);
+        memmove(&parent.child_offsets[child_index + 2], &parent.child_offsets[child_index + 1],
+                moved * sizeof(uint64_t));
 
-        parent.keys[child_index] = child.keys[mid];
+        memcpy(parent.keys[child_index], separator, BTreeNode::KEY_SIZE);
         parent.child_offsets[child_index + 1] = new_node_offset;
         parent.key_count++;
 
@@ -316,35 +441,25 @@ private:
 
     
     void insert_non_full(uint64_t node_offset, BTreeNode &node,
-                         const CompositeKey &key, const BTreeValue &value)
+                         const uint8_t *key, const BTreeValue &value)
     {
-        int pos = node.key_count - 1;
+        int pos = find_insert_position(node, key);
 
         if (node.is_leaf())
         {
             
-            while (pos >= 0 && node.keys[pos] > key)
-            {
-                node.keys[pos + 1] = node.keys[pos];
-                node.values[pos + 1] = node.values[pos];
-                pos--;
-            }
+            int moved = node.key_count - pos;
+            memmove(node.keys[pos + 1], node.keys[pos], moved * BTreeNode::KEY_SIZE);
+            memmove(&node.values[pos + 1], &node.values[pos], moved * sizeof(PackedValue));
 
-            node.keys[pos + 1] = key;
-            node.values[pos + 1] = value;
+            memcpy(node.keys[pos], key, BTreeNode::KEY_SIZE);
+            node.set_value(pos, value);
             node.key_count++;
 
             write_node(node_offset, node);
         }
         else
         {
-            
-            while (pos >= 0 && node.keys[pos] > key)
-            {
-                pos--;
-            }
-            pos++;
-
             BTreeNode child;
             uint64_t child_offset = node.child_offsets[pos];
             read_node(child_offset, child);
@@ -352,7 +467,7 @@ private:
             if (child.is_full())
             {
                 split_child(node_offset, node, pos);
-                if (node.keys[pos] < key)
+                if (node.compare_key(pos, key) <= 0)
                 {
                     pos++;
                 }
@@ -363,90 +478,269 @@ private:
         }
     }
 
-    
-    bool search_recursive(uint64_t node_offset, const CompositeKey &key, BTreeValue &result)
+    // Finds the leaf entry equal to key. Equal keys go right of a
+    // separator, but the left child is tried too since a duplicate run
+    // bulk-loaded across two leaves also ends the left one.
+    bool find_entry(uint64_t node_offset, const uint8_t *key, uint64_t &leaf_offset, BTreeNode &leaf, int &pos)
     {
-        if (node_offset == 0)
-            return false;
-
         BTreeNode node;
         if (!read_node(node_offset, node))
             return false;
 
-        int pos = find_key_position(node, key);
+        int at = find_key_position(node, key);
+        if (node.is_leaf())
+        {
+            if (at >= node.key_count || node.compare_key(at, key) != 0)
+                return false;
+            leaf_offset = node_offset;
+            leaf = node;
+            pos = at;
+            return true;
+        }
 
-        
-        if (pos < node.key_count && node.keys[pos] == key)
+        if (at < node.key_count && node.compare_key(at, key) == 0 &&
+            find_entry(node.child_offsets[at + 1], key, leaf_offset, leaf, pos))
+            return true;
+        return find_entry(node.child_offsets[at], key, leaf_offset, leaf, pos);
+    }
+
+    // Rebalances child index of parent after it fell below MIN_KEYS, with
+    // its left sibling if it has one: the two are merged when their keys fit
+    // one node, otherwise the keys are shared out evenly between them. The
+    // caller writes the parent.
+    void rebalance_child(BTreeNode &parent, int index)
+    {
+        int left_index = index > 0 ? index - 1 : index;
+        uint64_t left_offset = parent.child_offsets[left_index];
+        uint64_t right_offset = parent.child_offsets[left_index + 1];
+        BTreeNode left;
+        BTreeNode right;
+        if (!read_node(left_offset, left) || !read_node(right_offset, right))
+            return;
+
+        // Both nodes' entries in order, with the parent's separator between
+        // them for internal nodes
+        const int KS = BTreeNode::KEY_SIZE;
+        bool leaf = left.is_leaf();
+        uint8_t keys[2 * BTreeNode::MAX_KEYS + 1][BTreeNode::KEY_SIZE];
+        PackedValue values[2 * BTreeNode::MAX_KEYS];
+        uint64_t children[2 * BTreeNode::MAX_CHILDREN];
+
+        int count = left.key_count;
+        memcpy(keys, left.keys, left.key_count * KS);
+        if (leaf)
         {
-            if (node.is_leaf())
+            memcpy(values, left.values, left.key_count * sizeof(PackedValue));
+            memcpy(&values[count], right.values, right.key_count * sizeof(PackedValue));
+        }
+        else
+        {
+            memcpy(children, left.child_offsets, (left.key_count + 1) * sizeof(uint64_t));
+            memcpy(&children[count + 1], right.child_offsets, (right.key_count + 1) * sizeof(uint64_t));
+            memcpy(keys[count], parent.keys[left_index], KS);
+            count++;
+        }
+        memcpy(keys[count], right.keys, right.key_count * KS);
+        count += right.key_count;
+
+        if (count <= BTreeNode::MAX_KEYS)
+        {
+            left.key_count = count;
+            memcpy(left.keys, keys, count * KS);
+            if (leaf)
             {
-                result = node.values[pos];
-                return true;
+                memcpy(left.values, values, count * sizeof(PackedValue));
+                left.next_leaf = right.next_leaf;
+                BTreeNode next;
+                if (right.next_leaf != 0 && read_node(right.next_leaf, next))
+                {
+                    next.prev_leaf = left_offset;
+                    write_node(right.next_leaf, next);
+                }
             }
             else
             {
-                
-                return search_recursive(node.child_offsets[pos + 1], key, result);
+                memcpy(left.child_offsets, children, (count + 1) * sizeof(uint64_t));
             }
+            write_node(left_offset, left);
+            release_node(right_offset);
+
+            int moved = parent.key_count - left_index - 1;
+            memmove(parent.keys[left_index], parent.keys[left_index + 1], moved * KS);
+            memmove(&parent.child_offsets[left_index + 1], &parent.child_offsets[left_index + 2],
+                    moved * sizeof(uint64_t));
+            parent.key_count--;
+            return;
         }
 
-        
-        if (node.is_leaf())
+        int left_count = count / 2;
+        int right_first = leaf ? left_count : left_count + 1;
+        left.key_count = left_count;
+        right.key_count = count - right_first;
+        memcpy(left.keys, keys, left_count * KS);
+        memcpy(right.keys, keys[right_first], right.key_count * KS);
+        if (leaf)
         {
+            memcpy(left.values, values, left_count * sizeof(PackedValue));
+            memcpy(right.values, &values[right_first], right.key_count * sizeof(PackedValue));
+        }
+        else
+        {
+            memcpy(left.child_offsets, children, (left_count + 1) * sizeof(uint64_t));
+            memcpy(right.child_offsets, &children[right_first], (right.key_count + 1) * sizeof(uint64_t));
+        }
+        memcpy(parent.keys[left_index], keys[left_count], KS);
+        write_node(left_offset, left);
+        write_node(right_offset, right);
+    }
+
+    // Removes one entry equal to key from the subtree at node_offset; node
+    // is left holding the subtree's root so the caller can see whether it
+    // underflowed
+    bool remove_recursive(uint64_t node_offset, const uint8_t *key, BTreeNode &node)
+    {
+        if (!read_node(node_offset, node))
             return false;
+
+        int pos = find_key_position(node, key);
+        if (node.is_leaf())
+        {
+            if (pos >= node.key_count || node.compare_key(pos, key) != 0)
+                return false;
+            int moved = node.key_count - pos - 1;
+            memmove(node.keys[pos], node.keys[pos + 1], moved * BTreeNode::KEY_SIZE);
+            memmove(&node.values[pos], &node.values[pos + 1], moved * sizeof(PackedValue));
+            node.key_count--;
+            return write_node(node_offset, node);
         }
 
-        
-        return search_recursive(node.child_offsets[pos], key, result);
+        BTreeNode child;
+        int index = pos;
+        bool removed = false;
+        if (pos < node.key_count && node.compare_key(pos, key) == 0)
+        {
+            index = pos + 1;
+            removed = remove_recursive(node.child_offsets[index], key, child);
+        }
+        if (!removed)
+        {
+            index = pos;
+            removed = remove_recursive(node.child_offsets[index], key, child);
+        }
+        if (!removed)
+            return false;
+
+        if (child.is_underflow())
+        {
+            rebalance_child(node, index);
+            write_node(node_offset, node);
+        }
+        return true;
     }
 
     
+    // Descends to the leaf that may hold start_key, then walks the leaf
+    // chain; max_results of 0 means no limit
     void range_query_recursive(uint64_t node_offset,
-                               const CompositeKey &start_key,
-                               const CompositeKey &end_key,
-                               vector<pair<CompositeKey, BTreeValue>> &results)
+                               const uint8_t *start_key,
+                               const uint8_t *end_key,
+                               vector<pair<CompositeKey, BTreeValue>> &results,
+                               size_t max_results = 0)
     {
-        if (node_offset == 0)
-            return;
-
         BTreeNode node;
-        if (!read_node(node_offset, node))
-            return;
+        while (node_offset != 0)
+        {
+            if (!read_node(node_offset, node))
+                return;
+            if (node.is_leaf())
+                break;
+            node_offset = node.child_offsets[find_key_position(node, start_key)];
+        }
 
-        if (node.is_leaf())
+        while (node_offset != 0)
         {
-            
-            for (int i = 0; i < node.key_count; i++)
+            for (int i = find_key_position(node, start_key); i < node.key_count; i++)
             {
-                if (node.keys[i] >= start_key && node.keys[i] <= end_key)
-                {
-                    results.push_back({node.keys[i], node.values[i]});
-                }
+                if (node.compare_key(i, end_key) > 0)
+                    return;
+                results.push_back({node.key(i), node.value(i)});
+                if (max_results != 0 && results.size() >= max_results)
+                    return;
             }
 
-            
-            if (node.key_count > 0 && node.keys[node.key_count - 1] < end_key && node.next_leaf != 0)
+            node_offset = node.next_leaf;
+            if (node_offset != 0 && !read_node(node_offset, node))
+                return;
+        }
+    }
+
+    // Rewrites a format 1 file in format 2: the old leaf chain is read in
+    // key order and bulk-loaded into a new file, which then replaces the old
+    // one, so a failed conversion leaves the original untouched
+    bool convert_from_v1()
+    {
+        cout << "        Converting BTree file to format 2: " << filename_ << endl;
+
+        struct stat st;
+        if (fstat(fd_, &st) != 0)
+            return false;
+        // Bounds the walk if the old file's links are damaged
+        uint64_t pages = static_cast<uint64_t>(st.st_size) / sizeof(BTreeNodeV1);
+
+        vector<pair<CompositeKey, BTreeValue>> entries;
+        BTreeNodeV1 node;
+        uint64_t offset = metadata_.root_offset;
+        while (offset != 0)
+        {
+            if (pread(fd_, &node, sizeof(BTreeNodeV1), offset) != static_cast<ssize_t>(sizeof(BTreeNodeV1)))
+                return false;
+            if (node.is_leaf())
+                break;
+            offset = node.child_offsets[0];
+        }
+
+        while (offset != 0)
+        {
+            for (int i = 0; i < node.key_count && i < BTreeNodeV1::MAX_KEYS; i++)
             {
-                range_query_recursive(node.next_leaf, start_key, end_key, results);
+                entries.push_back({node.keys[i], node.values[i]});
             }
+
+            offset = node.next_leaf;
+            if (offset != 0 && pages-- == 0)
+                return false;
+            if (offset != 0 &&
+                pread(fd_, &node, sizeof(BTreeNodeV1), offset) != static_cast<ssize_t>(sizeof(BTreeNodeV1)))
+                return false;
         }
-        else
+
+        string converted_file = filename_ + ".convert";
         {
-            
-            int pos = find_key_position(node, start_key);
-            for (int i = pos; i <= node.key_count; i++)
+            BTree converted(converted_file, pool_);
+            if (!converted.create() || !converted.open() || !converted.bulk_load(entries))
             {
-                range_query_recursive(node.child_offsets[i], start_key, end_key, results);
-                if (i < node.key_count && node.keys[i] > end_key)
-                    break;
+                unlink(converted_file.c_str());
+                return false;
             }
         }
+
+        if (rename(converted_file.c_str(), filename_.c_str()) != 0)
+            return false;
+
+        ::close(fd_);
+        fd_ = ::open(filename_.c_str(), O_RDWR);
+        return fd_ >= 0 && read_metadata();
     }
 
 public:
-    BTree(const string &filename) : filename_(filename)
+    BTree(const string &filename, BufferPool *pool = nullptr)
+        : fd_(-1), filename_(filename), pool_(pool), pool_file_(0), file_end_(0)
     {
-        cache_.reserve(CACHE_SIZE);
+        if (!pool_)
+        {
+            own_pool_ = make_unique<BufferPool>(CACHE_SIZE * BufferPool::PAGE_SIZE);
+            pool_ = own_pool_.get();
+        }
     }
 
     ~BTree()
@@ -456,16 +750,12 @@ public:
    
     bool create()
     {
-        
-        if (file_.is_open())
-        {
-            file_.close();
-        }
+        close();
 
         cout << "        Opening file for creation: " << filename_ << endl;
 
-        file_.open(filename_, ios::out | ios::binary | ios::trunc);
-        if (!file_.is_open())
+        int fd = ::open(filename_.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0)
         {
             cerr << "        ERROR: Cannot create file: " << filename_ << endl;
             cerr << "        Error: " << strerror(errno) << endl;
@@ -476,12 +766,10 @@ public:
 
         
         metadata_ = BTreeMetadata();
-        file_.write(reinterpret_cast<char *>(&metadata_), sizeof(BTreeMetadata));
-
-        if (!file_.good())
+        if (pwrite(fd, &metadata_, sizeof(BTreeMetadata), 0) != static_cast<ssize_t>(sizeof(BTreeMetadata)))
         {
             cerr << "        ERROR: Failed to write metadata!" << endl;
-            file_.close();
+            ::close(fd);
             return false;
         }
 
@@ -493,40 +781,35 @@ public:
         root.level = 0;
         metadata_.root_offset = sizeof(BTreeMetadata);
 
-        file_.write(reinterpret_cast<char *>(&root), sizeof(BTreeNode));
-
-        if (!file_.good())
+        if (pwrite(fd, &root, sizeof(BTreeNode), metadata_.root_offset) != static_cast<ssize_t>(sizeof(BTreeNode)))
         {
             cerr << "        ERROR: Failed to write root node!" << endl;
-            file_.close();
+            ::close(fd);
             return false;
         }
 
-        file_.flush();
-
         cout << "        Updating metadata..." << endl;
 
         
-        file_.seekp(0, ios::beg);
-        file_.write(reinterpret_cast<char *>(&metadata_), sizeof(BTreeMetadata));
-        file_.flush();
+        bool ok = pwrite(fd, &metadata_, sizeof(BTreeMetadata), 0) == static_cast<ssize_t>(sizeof(BTreeMetadata));
 
-        cout << "        BTree file created successfully" << endl;
-        return true;
+        // Reopened read/write by open()
+        ::close(fd);
+
+        if (ok)
+            cout << "        BTree file created successfully" << endl;
+        return ok;
     }
 
     bool open()
     {
-        if (file_.is_open())
+        if (fd_ >= 0)
         {
             cout << "        File already open, verifying..." << endl;
-            file_.seekg(0, ios::beg);
-            file_.read(reinterpret_cast<char *>(&metadata_), sizeof(BTreeMetadata));
-
-            if (string(metadata_.magic, 8) != "BTREE001")
+            if (!read_metadata() || string(metadata_.magic, 8) != "BTREE002")
             {
                 cerr << "        ERROR: Invalid magic number!" << endl;
-                file_.close();
+                close();
                 return false;
             }
 
@@ -536,21 +819,32 @@ public:
 
         cout << "        Opening file: " << filename_ << endl;
 
-        file_.open(filename_, ios::in | ios::out | ios::binary);
-        if (!file_.is_open())
+        fd_ = ::open(filename_.c_str(), O_RDWR);
+        if (fd_ < 0)
         {
             cerr << "        ERROR: Cannot open file: " << filename_ << endl;
             return false;
         }
 
-        file_.read(reinterpret_cast<char *>(&metadata_), sizeof(BTreeMetadata));
+        if (read_metadata() && string(metadata_.magic, 8) == "BTREE001" && !convert_from_v1())
+        {
+            cerr << "        ERROR: Cannot convert BTree file: " << filename_ << endl;
+            if (fd_ >= 0)
+                ::close(fd_);
+            fd_ = -1;
+            return false;
+        }
 
-        if (string(metadata_.magic, 8) != "BTREE001")
+        struct stat st;
+        if (!read_metadata() || string(metadata_.magic, 8) != "BTREE002" || fstat(fd_, &st) != 0)
         {
             cerr << "        ERROR: Invalid BTree file (bad magic)" << endl;
-            file_.close();
+            ::close(fd_);
+            fd_ = -1;
             return false;
         }
+        file_end_ = static_cast<uint64_t>(st.st_size);
+        pool_file_ = pool_->add_file(fd_);
 
         cout << "        BTree opened successfully" << endl;
         return true;
@@ -558,32 +852,32 @@ public:
     
     void close()
     {
-        
-        for (auto &entry : cache_)
-        {
-            if (entry.dirty)
-            {
-                write_node(entry.offset, entry.node);
-            }
-        }
-        cache_.clear();
+        if (fd_ < 0)
+            return;
 
-        if (file_.is_open())
-        {
-            
-            file_.seekp(0, ios::beg);
-            file_.write(reinterpret_cast<char *>(&metadata_), sizeof(BTreeMetadata));
-            file_.flush();
-            file_.close();
-        }
+        pool_->remove_file(pool_file_);
+        write_metadata();
+        ::close(fd_);
+        fd_ = -1;
+    }
+
+    // Writes the dirty nodes and the counters and forces the file to disk
+    bool sync()
+    {
+        if (fd_ < 0)
+            return true;
+        return pool_->flush(pool_file_) && write_metadata() && fdatasync(fd_) == 0;
     }
 
     
     bool insert(const CompositeKey &key, const BTreeValue &value)
     {
-        if (metadata_.root_offset == 0)
+        if (fd_ < 0 || metadata_.root_offset == 0)
             return false;
 
+        uint8_t encoded[BTreeNode::KEY_SIZE];
+        key.encode(encoded);
+
         BTreeNode root;
         read_node(metadata_.root_offset, root);
 
@@ -601,35 +895,195 @@ public:
             metadata_.root_offset = new_root_offset;
             metadata_.tree_height++;
 
+            // A root change must survive a crash, so the new root is written
+            // before the metadata pointing at it; counters are rewritten on close
+            pool_->flush(pool_file_);
+            write_metadata();
+
             read_node(new_root_offset, new_root);
-            insert_non_full(new_root_offset, new_root, key, value);
+            insert_non_full(new_root_offset, new_root, encoded, value);
         }
         else
         {
-            insert_non_full(metadata_.root_offset, root, key, value);
+            insert_non_full(metadata_.root_offset, root, encoded, value);
         }
 
         metadata_.total_records++;
-        return true;
+        return pool_->flush(pool_file_);
     }
 
     bool search(const CompositeKey &key, BTreeValue &result)
     {
-        return search_recursive(metadata_.root_offset, key, result);
+        uint8_t encoded[BTreeNode::KEY_SIZE];
+        key.encode(encoded);
+
+        uint64_t leaf_offset;
+        BTreeNode leaf;
+        int pos;
+        if (!find_entry(metadata_.root_offset, encoded, leaf_offset, leaf, pos))
+            return false;
+        result = leaf.value(pos);
+        return true;
+    }
+
+    // Replaces the value stored with key in place
+    bool update(const CompositeKey &key, const BTreeValue &value)
+    {
+        if (fd_ < 0)
+            return false;
+
+        uint8_t encoded[BTreeNode::KEY_SIZE];
+        key.encode(encoded);
+
+        uint64_t leaf_offset;
+        BTreeNode leaf;
+        int pos;
+        if (!find_entry(metadata_.root_offset, encoded, leaf_offset, leaf, pos))
+            return false;
+        leaf.set_value(pos, value);
+        return write_node(leaf_offset, leaf) && pool_->flush(pool_file_);
+    }
+
+    // Removes one entry equal to key. Nodes left below MIN_KEYS borrow from
+    // or merge with a sibling on the way back up, and a root left with a
+    // single child is replaced by it.
+    bool remove(const CompositeKey &key)
+    {
+        if (fd_ < 0 || metadata_.root_offset == 0)
+            return false;
+
+        uint8_t encoded[BTreeNode::KEY_SIZE];
+        key.encode(encoded);
+
+        BTreeNode root;
+        if (!remove_recursive(metadata_.root_offset, encoded, root))
+            return false;
+
+        if (!root.is_leaf() && root.key_count == 0)
+        {
+            uint64_t old_root = metadata_.root_offset;
+            metadata_.root_offset = root.child_offsets[0];
+            metadata_.tree_height--;
+
+            // As for a new root, the metadata moves only once the tree it
+            // points at is on disk
+            pool_->flush(pool_file_);
+            write_metadata();
+            release_node(old_root);
+        }
+
+        if (metadata_.total_records > 0)
+            metadata_.total_records--;
+        return pool_->flush(pool_file_);
     }
 
     vector<pair<CompositeKey, BTreeValue>> range_query(
-        const CompositeKey &start_key, const CompositeKey &end_key)
+        const CompositeKey &start_key, const CompositeKey &end_key,
+        size_t max_results = 0)
     {
+        uint8_t start[BTreeNode::KEY_SIZE];
+        uint8_t end[BTreeNode::KEY_SIZE];
+        start_key.encode(start);
+        end_key.encode(end);
 
         vector<pair<CompositeKey, BTreeValue>> results;
-        range_query_recursive(metadata_.root_offset, start_key, end_key, results);
+        range_query_recursive(metadata_.root_offset, start, end, results, max_results);
         return results;
     }
 
+    // Replaces the tree's contents with entries, built bottom-up: the
+    // entries are sorted, written into leaves packed as evenly full as
+    // possible, one after another, and then each level of internal nodes
+    // above them is written the same way. Each node is written once, instead
+    // of the splits and flushes of inserting the entries one at a time.
+    bool bulk_load(vector<pair<CompositeKey, BTreeValue>> entries)
+    {
+        if (fd_ < 0)
+            return false;
+
+        stable_sort(entries.begin(), entries.end(),
+                    [](const pair<CompositeKey, BTreeValue> &a, const pair<CompositeKey, BTreeValue> &b)
+                    { return a.first < b.first; });
+
+        pool_->flush(pool_file_);
+        pool_->discard(pool_file_, 0, file_end_);
+        if (ftruncate(fd_, sizeof(BTreeMetadata)) != 0)
+            return false;
+        file_end_ = sizeof(BTreeMetadata);
+
+        // First key and offset of every node of the level last written
+        vector<pair<CompositeKey, uint64_t>> level;
+        size_t leaves = max<size_t>(1, (entries.size() + BTreeNode::MAX_KEYS - 1) / BTreeNode::MAX_KEYS);
+        vector<BTreeNode> batch;
+        for (size_t i = 0; i < leaves; i++)
+        {
+            uint64_t offset = file_end_ + batch.size() * sizeof(BTreeNode);
+            size_t first = share_start(entries.size(), leaves, i);
+            size_t end = share_start(entries.size(), leaves, i + 1);
+
+            BTreeNode leaf;
+            leaf.key_count = static_cast<uint16_t>(end - first);
+            for (size_t k = first; k < end; k++)
+            {
+                leaf.set_key(k - first, entries[k].first);
+                leaf.set_value(k - first, entries[k].second);
+            }
+            leaf.prev_leaf = i > 0 ? offset - sizeof(BTreeNode) : 0;
+            leaf.next_leaf = i + 1 < leaves ? offset + sizeof(BTreeNode) : 0;
+            level.push_back({entries.empty() ? CompositeKey() : entries[first].first, offset});
+
+            batch.push_back(leaf);
+            if (batch.size() == CACHE_SIZE || i + 1 == leaves)
+            {
+                if (!append_nodes(batch))
+                    return false;
+                batch.clear();
+            }
+        }
+
+        uint16_t height = 0;
+        while (level.size() > 1)
+        {
+            height++;
+            size_t nodes = (level.size() + BTreeNode::MAX_CHILDREN - 1) / BTreeNode::MAX_CHILDREN;
+            vector<pair<CompositeKey, uint64_t>> parents;
+            for (size_t i = 0; i < nodes; i++)
+            {
+                size_t first = share_start(level.size(), nodes, i);
+                size_t end = share_start(level.size(), nodes, i + 1);
+
+                BTreeNode node;
+                node.node_type = 0;
+                node.level = height;
+                node.key_count = static_cast<uint16_t>(end - first - 1);
+                for (size_t c = first; c < end; c++)
+                {
+                    node.child_offsets[c - first] = level[c].second;
+                    if (c > first)
+                        node.set_key(c - first - 1, level[c].first);
+                }
+                parents.push_back({level[first].first, file_end_ + batch.size() * sizeof(BTreeNode)});
+
+                batch.push_back(node);
+                if (batch.size() == CACHE_SIZE || i + 1 == nodes)
+                {
+                    if (!append_nodes(batch))
+                        return false;
+                    batch.clear();
+                }
+            }
+            level.swap(parents);
+        }
+
+        metadata_.root_offset = level[0].second;
+        metadata_.tree_height = height;
+        metadata_.total_records = entries.size();
+        metadata_.free_list_head = 0;
+        return write_metadata();
+    }
+
     uint64_t get_total_records() const { return metadata_.total_records; }
     uint32_t get_tree_height() const { return metadata_.tree_height; }
-    size_t get_cache_size() const { return cache_.size(); }
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,376 @@
+#ifndef BUFFERPOOL_H
+#define BUFFERPOOL_H
+
+#include "HashTable.h"
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <unistd.h>
+using namespace std;
+
+// Fixed 4 KB page frames shared by every file registered with the pool.
+// Frames are found through a hash table keyed by (file, page) and replaced
+// with the CLOCK algorithm; a pinned frame is never replaced. Writes either
+// go through to the file at once or leave the frame dirty until the file is
+// flushed or the frame is evicted. Page reads happen outside the pool lock,
+// so a miss only holds up readers of the same page.
+class BufferPool
+{
+public:
+    static const uint32_t PAGE_SIZE = 4096;
+
+private:
+    static const uint64_t NO_PAGE = UINT64_MAX;
+    static const uint32_t PAGE_BITS = 40;
+
+    struct Frame
+    {
+        uint64_t key;
+        uint32_t pins;
+        bool referenced;
+        bool dirty;
+        bool loading;
+    };
+
+    struct File
+    {
+        int fd;
+        vector<uint32_t> dirty;
+    };
+
+    vector<uint8_t> memory_;
+    vector<Frame> frames_;
+    HashTable<uint64_t, uint32_t> table_;
+    vector<File> files_;
+    uint32_t hand_;
+    uint64_t hits_;
+    uint64_t misses_;
+    mutable mutex mutex_;
+    condition_variable loaded_;
+
+    static uint64_t page_key(uint32_t file, uint64_t page)
+    {
+        return (static_cast<uint64_t>(file) << PAGE_BITS) | page;
+    }
+
+    uint8_t *frame_data(uint32_t frame)
+    {
+        return memory_.data() + static_cast<size_t>(frame) * PAGE_SIZE;
+    }
+
+    // Pages past the end of the file read as zeros
+    static bool read_page(int fd, uint64_t page, uint8_t *data)
+    {
+        uint64_t done = 0;
+        while (done < PAGE_SIZE)
+        {
+            ssize_t n = pread(fd, data + done, PAGE_SIZE - done, page * PAGE_SIZE + done);
+            if (n < 0)
+                return false;
+            if (n == 0)
+                break;
+            done += n;
+        }
+        memset(data + done, 0, PAGE_SIZE - done);
+        return true;
+    }
+
+    static bool write_fully(int fd, uint64_t offset, const uint8_t *data, uint64_t length)
+    {
+        while (length > 0)
+        {
+            ssize_t n = pwrite(fd, data, length, offset);
+            if (n <= 0)
+                return false;
+            data += n;
+            offset += n;
+            length -= n;
+        }
+        return true;
+    }
+
+    // Caller holds mutex_
+    bool write_back(uint32_t frame)
+    {
+        Frame &f = frames_[frame];
+        if (!f.dirty)
+            return true;
+        uint64_t page = f.key & ((1ULL << PAGE_BITS) - 1);
+        if (!write_fully(files_[f.key >> PAGE_BITS].fd, page * PAGE_SIZE, frame_data(frame), PAGE_SIZE))
+            return false;
+        f.dirty = false;
+        return true;
+    }
+
+    // Caller holds mutex_. Two sweeps of the clock clear every reference
+    // bit, so an unpinned frame is found if there is one.
+    bool find_victim(uint32_t &victim)
+    {
+        for (size_t n = 0; n < frames_.size() * 2; n++)
+        {
+            uint32_t frame = hand_;
+            hand_ = (hand_ + 1) % frames_.size();
+            Frame &f = frames_[frame];
+            if (f.pins > 0 || f.loading)
+                continue;
+            if (f.referenced)
+            {
+                f.referenced = false;
+                continue;
+            }
+            if (!write_back(frame))
+                continue;
+            victim = frame;
+            return true;
+        }
+        return false;
+    }
+
+    void mark_dirty(uint32_t frame)
+    {
+        Frame &f = frames_[frame];
+        if (f.dirty)
+            return;
+        f.dirty = true;
+        files_[f.key >> PAGE_BITS].dirty.push_back(frame);
+    }
+
+    // Frame of a page, pinned and read in if load is set; false when every
+    // frame is pinned or the read fails
+    bool pin(uint32_t file, uint64_t page, bool load, uint32_t &frame)
+    {
+        uint64_t key = page_key(file, page);
+        unique_lock<mutex> lock(mutex_);
+        while (table_.get(key, frame))
+        {
+            Frame &f = frames_[frame];
+            if (f.loading)
+            {
+                loaded_.wait(lock);
+                continue;
+            }
+            f.pins++;
+            f.referenced = true;
+            hits_++;
+            return true;
+        }
+
+        misses_++;
+        if (frames_.empty() || !find_victim(frame))
+            return false;
+
+        Frame &f = frames_[frame];
+        if (f.key != NO_PAGE)
+            table_.remove(f.key);
+        f.key = key;
+        f.pins = 1;
+        f.referenced = true;
+        f.loading = load;
+        table_.insert(key, frame);
+        if (!load)
+            return true;
+
+        int fd = files_[file].fd;
+        lock.unlock();
+        bool ok = read_page(fd, page, frame_data(frame));
+        lock.lock();
+        f.loading = false;
+        if (!ok)
+        {
+            table_.remove(key);
+            f.key = NO_PAGE;
+            f.pins = 0;
+        }
+        loaded_.notify_all();
+        return ok;
+    }
+
+    void unpin(uint32_t frame, bool dirty)
+    {
+        lock_guard<mutex> lock(mutex_);
+        frames_[frame].pins--;
+        if (dirty)
+            mark_dirty(frame);
+    }
+
+public:
+    explicit BufferPool(uint64_t budget_bytes)
+        : frames_(budget_bytes / PAGE_SIZE), table_(max<size_t>(budget_bytes / PAGE_SIZE * 2, 16)),
+          hand_(0), hits_(0), misses_(0)
+    {
+        memory_.resize(frames_.size() * PAGE_SIZE);
+        for (Frame &f : frames_)
+        {
+            f = {NO_PAGE, 0, false, false, false};
+        }
+    }
+
+    BufferPool(const BufferPool &) = delete;
+    BufferPool &operator=(const BufferPool &) = delete;
+
+    // The returned id names the file in every other call until remove_file
+    uint32_t add_file(int fd)
+    {
+        lock_guard<mutex> lock(mutex_);
+        for (uint32_t i = 0; i < files_.size(); i++)
+        {
+            if (files_[i].fd < 0)
+            {
+                files_[i].fd = fd;
+                return i;
+            }
+        }
+        files_.push_back({fd, {}});
+        return static_cast<uint32_t>(files_.size() - 1);
+    }
+
+    // Writes the file's dirty pages and gives up its frames. No page of it
+    // may be pinned.
+    bool remove_file(uint32_t file)
+    {
+        bool ok = flush(file);
+        lock_guard<mutex> lock(mutex_);
+        for (uint32_t i = 0; i < frames_.size(); i++)
+        {
+            Frame &f = frames_[i];
+            if (f.key != NO_PAGE && (f.key >> PAGE_BITS) == file)
+            {
+                table_.remove(f.key);
+                f = {NO_PAGE, 0, false, false, false};
+            }
+        }
+        files_[file].fd = -1;
+        files_[file].dirty.clear();
+        return ok;
+    }
+
+    bool read(uint32_t file, uint64_t offset, void *data, uint64_t length)
+    {
+        uint8_t *out = static_cast<uint8_t *>(data);
+        while (length > 0)
+        {
+            uint64_t page = offset / PAGE_SIZE;
+            uint32_t within = offset % PAGE_SIZE;
+            uint32_t chunk = static_cast<uint32_t>(min<uint64_t>(length, PAGE_SIZE - within));
+            uint32_t frame;
+            if (pin(file, page, true, frame))
+            {
+                memcpy(out, frame_data(frame) + within, chunk);
+                unpin(frame, false);
+            }
+            else
+            {
+                int fd;
+                {
+                    lock_guard<mutex> lock(mutex_);
+                    fd = files_[file].fd;
+                }
+                if (pread(fd, out, chunk, offset) != static_cast<ssize_t>(chunk))
+                    return false;
+            }
+            out += chunk;
+            offset += chunk;
+            length -= chunk;
+        }
+        return true;
+    }
+
+    // With write_through the bytes reach the file before returning and only
+    // pages already resident are updated; otherwise they stay in dirty
+    // frames until flush or eviction
+    bool write(uint32_t file, uint64_t offset, const void *data, uint64_t length, bool write_through)
+    {
+        const uint8_t *in = static_cast<const uint8_t *>(data);
+        if (write_through)
+        {
+            int fd;
+            {
+                lock_guard<mutex> lock(mutex_);
+                fd = files_[file].fd;
+            }
+            if (!write_fully(fd, offset, in, length))
+                return false;
+        }
+
+        while (length > 0)
+        {
+            uint64_t page = offset / PAGE_SIZE;
+            uint32_t within = offset % PAGE_SIZE;
+            uint32_t chunk = static_cast<uint32_t>(min<uint64_t>(length, PAGE_SIZE - within));
+            uint32_t frame;
+            if (write_through)
+            {
+                unique_lock<mutex> lock(mutex_);
+                while (table_.get(page_key(file, page), frame) && frames_[frame].loading)
+                    loaded_.wait(lock);
+                if (table_.get(page_key(file, page), frame))
+                    memcpy(frame_data(frame) + within, in, chunk);
+            }
+            else if (pin(file, page, chunk < PAGE_SIZE, frame))
+            {
+                memcpy(frame_data(frame) + within, in, chunk);
+                unpin(frame, true);
+            }
+            else
+            {
+                int fd;
+                {
+                    lock_guard<mutex> lock(mutex_);
+                    fd = files_[file].fd;
+                }
+                if (!write_fully(fd, offset, in, chunk))
+                    return false;
+            }
+            in += chunk;
+            offset += chunk;
+            length -= chunk;
+        }
+        return true;
+    }
+
+    // Drops resident pages in a byte range the file changed underneath the
+    // pool (hole punching). Partly covered pages are read in again later.
+    void discard(uint32_t file, uint64_t offset, uint64_t length)
+    {
+        lock_guard<mutex> lock(mutex_);
+        for (uint64_t page = offset / PAGE_SIZE; page * PAGE_SIZE < offset + length; page++)
+        {
+            uint32_t frame;
+            if (!table_.get(page_key(file, page), frame) || frames_[frame].pins > 0 || frames_[frame].loading)
+                continue;
+            table_.remove(page_key(file, page));
+            frames_[frame] = {NO_PAGE, 0, false, false, false};
+        }
+    }
+
+    // Writes the file's dirty pages in page order
+    bool flush(uint32_t file)
+    {
+        lock_guard<mutex> lock(mutex_);
+        vector<uint32_t> &dirty = files_[file].dirty;
+        sort(dirty.begin(), dirty.end(), [this](uint32_t a, uint32_t b)
+             { return frames_[a].key < frames_[b].key; });
+        vector<uint32_t> failed;
+        for (uint32_t frame : dirty)
+        {
+            if (frames_[frame].key != NO_PAGE && (frames_[frame].key >> PAGE_BITS) == file && !write_back(frame))
+                failed.push_back(frame);
+        }
+        dirty.swap(failed);
+        return dirty.empty();
+    }
+
+    size_t frame_count() const { return frames_.size(); }
+
+    void get_stats(uint64_t &hits, uint64_t &misses) const
+    {
+        lock_guard<mutex> lock(mutex_);
+        hits = hits_;
+        misses = misses_;
+    }
+};
+
+#endif
@@ -0,0 +1,72 @@
+#ifndef KEYCOMPARE_H
+#define KEYCOMPARE_H
+
+#include <cstdint>
+#include <cstring>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+using namespace std;
+
+// Index keys are searched in their normalized byte form, where memcmp order
+// is key order, so the first PREFIX_SIZE bytes of two keys are compared in
+// one vector compare and only keys sharing that prefix need a full compare
+static constexpr size_t PREFIX_SIZE = 16;
+
+// Sign of the first differing byte of the two prefixes, 0 if they match
+inline int compare_prefix(const uint8_t *a, const uint8_t *b)
+{
+#if defined(__SSE2__)
+    __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i *>(a));
+    __m128i y = _mm_loadu_si128(reinterpret_cast<const __m128i *>(b));
+    uint32_t differ = ~static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(x, y))) & 0xFFFF;
+    if (differ == 0)
+        return 0;
+    int i = __builtin_ctz(differ);
+    return a[i] < b[i] ? -1 : 1;
+#else
+    return memcmp(a, b, PREFIX_SIZE);
+#endif
+}
+
+// Full compare of two normalized keys of size bytes, size >= PREFIX_SIZE
+inline int compare_normalized(const uint8_t *a, const uint8_t *b, size_t size)
+{
+    int result = compare_prefix(a, b);
+    if (result != 0)
+        return result;
+    return memcmp(a + PREFIX_SIZE, b + PREFIX_SIZE, size - PREFIX_SIZE);
+}
+
+// Lexicographic order of two byte strings, the shorter first when one is a
+// prefix of the other
+inline int compare_bytes(const uint8_t *a, size_t a_length, const uint8_t *b, size_t b_length)
+{
+    size_t length = a_length < b_length ? a_length : b_length;
+    int result = length >= PREFIX_SIZE ? compare_normalized(a, b, length) : memcmp(a, b, length);
+    if (result != 0)
+        return result;
+    return a_length < b_length ? -1 : (a_length > b_length ? 1 : 0);
+}
+
+// strcmp order for NUL-terminated keys held in buffers of at least
+// PREFIX_SIZE bytes, decided on the prefix unless both keys run past it
+inline int compare_cstring(const char *a, const char *b)
+{
+#if defined(__SSE2__)
+    __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i *>(a));
+    __m128i y = _mm_loadu_si128(reinterpret_cast<const __m128i *>(b));
+    uint32_t differ = ~static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(x, y))) & 0xFFFF;
+    uint32_t end = static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(x, _mm_setzero_si128())));
+    if ((differ | end) != 0)
+    {
+        int i = __builtin_ctz(differ | end);
+        return static_cast<int>(static_cast<uint8_t>(a[i])) - static_cast<int>(static_cast<uint8_t>(b[i]));
+    }
+    return strcmp(a + PREFIX_SIZE, b + PREFIX_SIZE);
+#else
+    return strcmp(a, b);
+#endif
+}
+
+#endif
@@ -0,0 +1,177 @@
+#ifndef SLOTBITMAP_H
+#define SLOTBITMAP_H
+
+#include <vector>
+#include <cstdint>
+using namespace std;
+
+class SlotBitmap
+{
+private:
+    vector<uint64_t> words_;
+    uint32_t capacity_;
+    uint32_t used_;
+    size_t hint_;
+
+    void mask_tail()
+    {
+        // Bits past capacity stay set so allocate() never hands them out
+        if (capacity_ % 64)
+        {
+            words_.back() |= ~0ULL << (capacity_ % 64);
+        }
+    }
+
+public:
+    SlotBitmap() : capacity_(0), used_(0), hint_(0) {}
+
+    void reset(uint32_t capacity)
+    {
+        capacity_ = capacity;
+        words_.assign((static_cast<size_t>(capacity) + 63) / 64, 0);
+        used_ = 0;
+        hint_ = 0;
+        mask_tail();
+    }
+
+    // Call after filling data() from disk
+    void refresh()
+    {
+        mask_tail();
+        used_ = 0;
+        for (uint64_t word : words_)
+        {
+            used_ += __builtin_popcountll(word);
+        }
+        if (capacity_ % 64)
+        {
+            used_ -= 64 - (capacity_ % 64);
+        }
+        hint_ = 0;
+    }
+
+    bool allocate(uint32_t &slot)
+    {
+        for (size_t w = hint_; w < words_.size(); w++)
+        {
+            if (~words_[w] != 0)
+            {
+                uint32_t bit = __builtin_ctzll(~words_[w]);
+                words_[w] |= 1ULL << bit;
+                slot = static_cast<uint32_t>(w * 64 + bit);
+                used_++;
+                hint_ = w;
+                return true;
+            }
+        }
+        hint_ = words_.size();
+        return false;
+    }
+
+    void set(uint32_t slot)
+    {
+        uint64_t bit = 1ULL << (slot % 64);
+        if (slot < capacity_ && !(words_[slot / 64] & bit))
+        {
+            words_[slot / 64] |= bit;
+            used_++;
+        }
+    }
+
+    void release(uint32_t slot)
+    {
+        uint64_t bit = 1ULL << (slot % 64);
+        if (slot < capacity_ && (words_[slot / 64] & bit))
+        {
+            words_[slot / 64] &= ~bit;
+            used_--;
+            if (slot / 64 < hint_)
+            {
+                hint_ = slot / 64;
+            }
+        }
+    }
+
+    bool test(uint32_t slot) const
+    {
+        return slot < capacity_ && (words_[slot / 64] >> (slot % 64)) & 1;
+    }
+
+    // Advances slot to the next used slot at or after it
+    bool next_used(uint32_t &slot) const
+    {
+        size_t w = slot / 64;
+        if (w >= words_.size())
+            return false;
+
+        uint64_t word = words_[w] & (~0ULL << (slot % 64));
+        while (true)
+        {
+            if (word)
+            {
+                uint64_t next = w * 64 + __builtin_ctzll(word);
+                if (next >= capacity_)
+                    return false;
+                slot = static_cast<uint32_t>(next);
+                return true;
+            }
+            if (++w >= words_.size())
+                return false;
+            word = words_[w];
+        }
+    }
+
+    // Advances slot to the next free slot at or after it
+    bool next_free(uint32_t &slot) const
+    {
+        size_t w = slot / 64;
+        if (w >= words_.size())
+            return false;
+
+        // Tail bits are kept set, so a free bit is always below capacity
+        uint64_t word = ~words_[w] & (~0ULL << (slot % 64));
+        while (true)
+        {
+            if (word)
+            {
+                slot = static_cast<uint32_t>(w * 64 + __builtin_ctzll(word));
+                return true;
+            }
+            if (++w >= words_.size())
+                return false;
+            word = ~words_[w];
+        }
+    }
+
+    // Moves slot back to the last used slot at or before it
+    bool prev_used(uint32_t &slot) const
+    {
+        if (capacity_ == 0)
+            return false;
+        if (slot >= capacity_)
+            slot = capacity_ - 1;
+
+        size_t w = slot / 64;
+        uint64_t word = words_[w] & (~0ULL >> (63 - slot % 64));
+        while (true)
+        {
+            if (word)
+            {
+                slot = static_cast<uint32_t>(w * 64 + 63 - __builtin_clzll(word));
+                return true;
+            }
+            if (w-- == 0)
+                return false;
+            word = words_[w];
+        }
+    }
+
+    uint64_t *data() { return words_.data(); }
+    const uint64_t &word(size_t index) const { return words_[index]; }
+    size_t word_count() const { return words_.size(); }
+    uint32_t capacity() const { return capacity_; }
+    uint32_t used() const { return used_; }
+    bool full() const { return used_ >= capacity_; }
+};
+
+#endif
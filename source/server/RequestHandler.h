@@ -65,6 +65,46 @@ public:
         auto it = data.find(key);
         return (it != data.end()) ? it->second : default_value;
     }
+
+    // Batch payloads travel as one flat value since parse() splits on ',':
+    // rows are separated by ';' and fields within a row by '|'
+    static vector<vector<string>> parse_rows(const string &value)
+    {
+        vector<vector<string>> rows;
+        istringstream rows_ss(value);
+        string row;
+
+        while (getline(rows_ss, row, ';'))
+        {
+            if (row.find_first_not_of(" \t\r\n") == string::npos)
+                continue;
+
+            vector<string> fields;
+            istringstream fields_ss(row);
+            string field;
+            while (getline(fields_ss, field, '|'))
+            {
+                field.erase(0, field.find_first_not_of(" \t\r\n"));
+                field.erase(field.find_last_not_of(" \t\r\n") + 1);
+                fields.push_back(field);
+            }
+            rows.push_back(fields);
+        }
+
+        return rows;
+    }
+
+    static string join_ids(const vector<uint64_t> &ids)
+    {
+        string result;
+        for (size_t i = 0; i < ids.size(); i++)
+        {
+            if (i > 0)
+                result += ";";
+            result += to_string(ids[i]);
+        }
+        return result;
+    }
 };
 
 class RequestHandler
@@ -386,6 +426,82 @@ public:
                                                "Failed to log GPS point");
             }
         }
+        else if (operation == "trip_log_gps_batch")
+        {
+            // points: "lat|lon|speed;lat|lon|speed;..."
+            uint64_t trip_id = stoull(SimpleJSON::get_value(params, "trip_id", "0"));
+            auto rows = SimpleJSON::parse_rows(SimpleJSON::get_value(params, "points"));
+
+            vector<GPSWaypoint> points;
+            for (const auto &row : rows)
+            {
+                if (row.size() < 3)
+                {
+                    return response_builder_.error("INVALID_BATCH",
+                                                   "Each GPS point needs latitude|longitude|speed");
+                }
+
+                GPSWaypoint waypoint;
+                memset(&waypoint, 0, sizeof(GPSWaypoint));
+                waypoint.latitude = stod(row[0]);
+                waypoint.longitude = stod(row[1]);
+                waypoint.speed = stof(row[2]);
+                waypoint.accuracy = 5.0f;
+                points.push_back(waypoint);
+            }
+
+            size_t logged = trip_mgr_.log_gps_points(trip_id, points);
+            if (logged > 0 || points.empty())
+            {
+                return response_builder_.success("GPS_BATCH_LOGGED", {{"logged", to_string(logged)},
+                                                                      {"submitted", to_string(points.size())}});
+            }
+            else
+            {
+                return response_builder_.error("GPS_LOG_FAILED",
+                                               "Failed to log GPS points");
+            }
+        }
+        else if (operation == "trip_import")
+        {
+            // trips: "vehicle_id|start_time|end_time|distance|avg_speed|max_speed|fuel_consumed;..."
+            auto rows = SimpleJSON::parse_rows(SimpleJSON::get_value(params, "trips"));
+
+            vector<TripRecord> trips;
+            for (const auto &row : rows)
+            {
+                if (row.size() < 7)
+                {
+                    return response_builder_.error("INVALID_BATCH",
+                                                   "Each trip needs vehicle_id|start_time|end_time|distance|avg_speed|max_speed|fuel_consumed");
+                }
+
+                TripRecord trip;
+                memset(&trip, 0, sizeof(TripRecord));
+                trip.vehicle_id = stoull(row[0]);
+                trip.start_time = stoull(row[1]);
+                trip.end_time = stoull(row[2]);
+                trip.distance = stod(row[3]);
+                trip.avg_speed = stod(row[4]);
+                trip.max_speed = stod(row[5]);
+                trip.fuel_consumed = stod(row[6]);
+                if (trip.distance > 0 && trip.fuel_consumed > 0)
+                    trip.fuel_efficiency = trip.distance / trip.fuel_consumed;
+                trips.push_back(trip);
+            }
+
+            auto ids = trip_mgr_.import_trips(driver.driver_id, trips);
+            if (!ids.empty())
+            {
+                return response_builder_.success("TRIPS_IMPORTED", {{"count", to_string(ids.size())},
+                                                                    {"trip_ids", SimpleJSON::join_ids(ids)}});
+            }
+            else
+            {
+                return response_builder_.error("TRIP_IMPORT_FAILED",
+                                               "Failed to import trips");
+            }
+        }
         else if (operation == "trip_end")
         {
             uint64_t trip_id = stoull(SimpleJSON::get_value(params, "trip_id", "0"));
@@ -710,6 +826,44 @@ public:
                                                "Failed to add fuel expense");
             }
         }
+        else if (operation == "expense_add_batch")
+        {
+            // items: "vehicle_id|category|amount|description|trip_id;..."
+            auto rows = SimpleJSON::parse_rows(SimpleJSON::get_value(params, "items"));
+
+            vector<ExpenseRecord> expenses;
+            for (const auto &row : rows)
+            {
+                if (row.size() < 3)
+                {
+                    return response_builder_.error("INVALID_BATCH",
+                                                   "Each expense needs at least vehicle_id|category|amount");
+                }
+
+                ExpenseRecord expense;
+                memset(&expense, 0, sizeof(ExpenseRecord));
+                expense.vehicle_id = stoull(row[0]);
+                expense.category = static_cast<ExpenseCategory>(stoi(row[1]));
+                expense.amount = stod(row[2]);
+                if (row.size() > 3)
+                    strncpy(expense.description, row[3].c_str(), sizeof(expense.description) - 1);
+                if (row.size() > 4 && !row[4].empty())
+                    expense.trip_id = stoull(row[4]);
+                expenses.push_back(expense);
+            }
+
+            auto ids = expense_mgr_.add_expenses_batch(driver.driver_id, expenses);
+            if (!ids.empty())
+            {
+                return response_builder_.success("EXPENSES_ADDED", {{"count", to_string(ids.size())},
+                                                                    {"expense_ids", SimpleJSON::join_ids(ids)}});
+            }
+            else
+            {
+                return response_builder_.error("EXPENSE_ADD_FAILED",
+                                               "Failed to add expenses");
+            }
+        }
         else if (operation == "expense_get_list")
         {
             int limit = stoi(SimpleJSON::get_value(params, "limit", "100"));
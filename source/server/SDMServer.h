@@ -25,6 +25,7 @@
 #include <vector>
 #include <atomic>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <unistd.h>
@@ -44,7 +45,10 @@ private:
     RequestQueue request_queue_;
     vector<thread> worker_threads_;
     thread listener_thread_;
+    thread compaction_thread_;
+    thread backup_thread_;
 
+    BufferPool *buffer_pool_;
     DatabaseManager *db_manager_;
     CacheManager *cache_manager_;
     IndexManager *index_manager_;
@@ -69,7 +73,7 @@ public:
     SDMServer(const SDMConfig &config)
         : config_(config), running_(false), server_socket_(-1),
           request_queue_(config.queue_capacity),
-          db_manager_(nullptr), cache_manager_(nullptr),
+          buffer_pool_(nullptr), db_manager_(nullptr), cache_manager_(nullptr),
           index_manager_(nullptr), security_manager_(nullptr),
           session_manager_(nullptr), trip_manager_(nullptr),
           vehicle_manager_(nullptr), expense_manager_(nullptr),
@@ -94,7 +98,12 @@ public:
         cout << "Initializing server..." << endl;
 
         cout << "  [1/9] Initializing database..." << endl;
-        db_manager_ = new DatabaseManager(config_.database_path);
+        buffer_pool_ = new BufferPool(config_.buffer_pool_size);
+        db_manager_ = new DatabaseManager(config_.database_path, config_.use_mmap);
+        db_manager_->configure_wal(config_.wal_enabled, config_.wal_group_commit_ms,
+                                   config_.wal_group_commit_bytes);
+        db_manager_->configure_io(config_.io_uring);
+        db_manager_->configure_buffer_pool(buffer_pool_);
         if (!db_manager_->open())
         {
             cerr << "    Failed to open database. Creating new..." << endl;
@@ -120,7 +129,7 @@ public:
         cout << "    ✓ Cache manager initialized" << endl;
 
         cout << "  [3/9] Initializing index manager..." << endl;
-        index_manager_ = new IndexManager(config_.index_path);
+        index_manager_ = new IndexManager(config_.index_path, buffer_pool_);
         if (!index_manager_->open_indexes())
         {
             cout << "    No existing indexes found. Creating new..." << endl;
@@ -130,6 +139,7 @@ public:
                 return false;
             }
         }
+        db_manager_->attach_indexes(index_manager_);
         cout << "    ✓ Index manager initialized" << endl;
 
         cout << "  [4/9] Initializing security manager..." << endl;
@@ -246,6 +256,16 @@ public:
         cout << "Starting listener thread..." << endl;
         listener_thread_ = thread(&SDMServer::listener_thread, this);
 
+        if (config_.compaction_interval > 0)
+        {
+            compaction_thread_ = thread(&SDMServer::compaction_thread, this);
+        }
+
+        if (config_.backup_interval > 0)
+        {
+            backup_thread_ = thread(&SDMServer::backup_thread, this);
+        }
+
         cout << endl;
         cout << "╔════════════════════════════════════════╗" << endl;
         cout << "║  Smart Drive Manager Server RUNNING   ║" << endl;
@@ -293,6 +313,16 @@ public:
 
         worker_threads_.clear();
 
+        if (compaction_thread_.joinable())
+        {
+            compaction_thread_.join();
+        }
+
+        if (backup_thread_.joinable())
+        {
+            backup_thread_.join();
+        }
+
         print_statistics();
 
         cout << "Server stopped successfully." << endl;
@@ -379,6 +409,71 @@ private:
         }
     }
 
+    // Compacts the database whenever fragmentation has crossed the
+    // configured threshold at one of the periodic checks, and seals records
+    // that have aged past cold_after_days
+    void compaction_thread()
+    {
+        auto last_check = chrono::steady_clock::now();
+        while (running_)
+        {
+            this_thread::sleep_for(chrono::milliseconds(250));
+            if (chrono::steady_clock::now() - last_check < chrono::seconds(config_.compaction_interval))
+                continue;
+            last_check = chrono::steady_clock::now();
+
+            double fragmentation = db_manager_->get_fragmentation();
+            if (fragmentation >= config_.compaction_threshold)
+            {
+                uint64_t moved = db_manager_->compact();
+                cout << "Compaction moved " << moved << " records (fragmentation was "
+                     << fixed << setprecision(1) << (fragmentation * 100) << "%)" << endl;
+            }
+
+            if (config_.cold_after_days > 0)
+            {
+                uint64_t cutoff = static_cast<uint64_t>(time(nullptr)) - config_.cold_after_days * 86400ULL;
+                uint64_t sealed = db_manager_->seal_cold_records(cutoff);
+                if (sealed > 0)
+                    cout << "Sealed " << sealed << " cold record blocks" << endl;
+            }
+        }
+    }
+
+    // Writes an online backup to backup_path every backup_interval seconds:
+    // a full one first and every full_backup_every backups, incremental
+    // ones holding only the blocks changed since the previous backup between
+    void backup_thread()
+    {
+        mkdir(config_.backup_path.c_str(), 0755);
+        string name = config_.database_path.substr(config_.database_path.find_last_of('/') + 1);
+        auto last_backup = chrono::steady_clock::now();
+        uint64_t since = 0;
+        uint32_t taken = 0;
+        while (running_)
+        {
+            this_thread::sleep_for(chrono::milliseconds(250));
+            if (chrono::steady_clock::now() - last_backup < chrono::seconds(config_.backup_interval))
+                continue;
+            last_backup = chrono::steady_clock::now();
+
+            bool full = since == 0 || config_.full_backup_every <= 1 || taken % config_.full_backup_every == 0;
+            string path = config_.backup_path + "/" + name + "-" + to_string(time(nullptr)) +
+                          (full ? "-full.bak" : "-incr.bak");
+            uint64_t sequence;
+            if (db_manager_->backup(path, full ? 0 : since, sequence))
+            {
+                since = sequence;
+                taken++;
+                cout << "Backup written: " << path << endl;
+            }
+            else
+            {
+                cerr << "ERROR: Backup failed: " << path << endl;
+            }
+        }
+    }
+
     void process_request(const ServerRequest &request)
     {
         try
@@ -500,9 +595,12 @@ private:
         
         delete session_manager_;
         delete security_manager_;
+        if (db_manager_)
+            db_manager_->attach_indexes(nullptr);
         delete index_manager_;
         delete cache_manager_;
         delete db_manager_;
+        delete buffer_pool_;
     }
 };
 